@@ -2,6 +2,9 @@
 #ifndef BAMAPI_H
 #define BAMAPI_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 /* HTSlib */
 #include "bgzf.h"
 #include "sam.h"
@@ -24,6 +27,22 @@ char *bam_qual_str(const bam1_t *row, char *work_buffer);
  */
 char *bam_str_key(const bam1_t *row, const char *key, char *work_buffer);
 
+/**
+ * Read an optional integer (cCsSiI) or floating point (fd) key on a BAM row.
+ * Only the first two characters of key are used. Returns false if the key is
+ * not found or holds a value of another type.
+ */
+bool bam_int_key(const bam1_t *row, const char *key, int64_t *value);
+bool bam_float_key(const bam1_t *row, const char *key, double *value);
+
+/**
+ * Parse a region such as chr1, chr1:1000 or chr1:1,000-2,000 given with 1-based
+ * inclusive positions into a reference id and a 0-based half-open range.
+ * Returns false if the reference is unknown or the region is malformed.
+ */
+bool bam_parse_region(const bam_hdr_t *header, const char *region,
+                      int32_t *tid, int64_t *beg, int64_t *end);
+
 typedef struct aux_elm_key {
   char key[2];
   char type;
@@ -72,6 +91,9 @@ typedef struct bam_row_set {
   size_t num_entries;
   bam_sequence_row_t **rows;
   bam_aux_header_list_t aux_tags;
+  /* Set by batch lookups: the position in the batch of the key each row
+   * matched */
+  size_t *key_ids;
 } bam_row_set_t;
 
 typedef struct offset_node {
@@ -88,6 +110,17 @@ typedef struct offset_list {
 int deserialize_bam_row(bam_sequence_row_t **out,
                         bam_aux_header_list_t *tag_list, const bam1_t *row,
                         const bam_hdr_t *header);
+/**
+ * Move a BAM file to the row at a voffset. A row further on in the BGZF block
+ * already loaded is reached by reading past the rows before it, so reading
+ * rows in ascending voffset order inflates every block only once.
+ * Return 0 on success.
+ */
+int bam_seek_row(samFile *input_file, int64_t offset);
+
+/* Sort the offsets of a list into file order, see bam_seek_row */
+void sort_offset_list(offset_list_t *offset_list);
+
 int get_bam_row(bam_sequence_row_t **out, bam_aux_header_list_t *tag_list,
                 const int64_t offset, samFile *input_file, bam_hdr_t *header);
 void print_sequence_row(bam_sequence_row_t *row);
@@ -3,24 +3,111 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "bamdb_status.h"
 #include "bam_api.h"
 
 #define MAX_FILENAME 1024
 
+/* How the indices of a build are stored */
+typedef enum bamdb_backend {
+  BAMDB_BACKEND_LMDB,  // LMDB environments, can be updated and resumed
+  BAMDB_BACKEND_TABLE  // Immutable sorted tables, see bamdb_table.h
+} bamdb_backend_t;
+
+/* Rows a build indexes, tested on each row before any key is extracted. Zero
+ * values keep every row. */
+typedef struct bamdb_row_filter {
+  uint16_t require_flags;  // Flag bits that must all be set
+  uint16_t exclude_flags;  // Flag bits that must all be clear
+  uint8_t min_mapq;        // Lowest mapping quality kept
+  /* Only keep rows placed on one of these references */
+  size_t num_contigs;
+  char **contigs;
+} bamdb_row_filter_t;
+
 typedef struct bamdb_indices {
   bool includes_qname;
   size_t num_key_indices;  // Does not include qname index
   char **key_indices;
+  /* Optional, one flag per key index: store barcode values as packed integer
+   * keys, see bamdb_barcode.h */
+  bool *packed_key_indices;
+
+  /* Build options, zero values keep the defaults */
+  bool sorted_build;        // Spill sorted runs and bulk load in key order
+  size_t sort_buffer_size;  // In-memory sort budget per index in bytes
+  char *tmp_dir;            // Directory for sort runs, defaults to db_path
+  size_t num_deserialize_threads;  // Defaults to a single thread
+  size_t num_decompress_threads;   // Extra BGZF inflate threads, 0 for none
+  size_t num_chunks;  // Index this many parts of the file in parallel
+  bool update;        // Only add rows appended since the last build
+  bool resume;        // Continue from the checkpoint of an unfinished build
+  bool single_env;    // Store all indices in one LMDB environment
+  /* Store the offsets of each key as delta encoded chunks, see
+   * bamdb_postings.h. Implies single_env. */
+  bool compress_postings;
+  bamdb_backend_t backend;
+  /* Store the QNAME index as a minimal perfect hash, see bamdb_hash.h. It
+   * only answers exact lookups and cannot be updated or resumed. */
+  bool hash_qname;
+  bamdb_row_filter_t row_filter;
 } bamdb_indices_t;
 
+/* How the predicates of a multi-index query combine */
+typedef enum bamdb_combine {
+  BAMDB_COMBINE_AND,  // Rows matching every predicate
+  BAMDB_COMBINE_OR    // Rows matching any predicate
+} bamdb_combine_t;
+
+/* A bam file and its index database opened once for many queries, see
+ * bamdb_session_open */
+typedef struct bamdb_session bamdb_session_t;
+
+/* Rows of a query read one at a time, see bamdb_session_iter_rows */
+typedef struct bamdb_row_iter bamdb_row_iter_t;
+
 #ifdef BUILD_BAMDB_WRITER
 /** @brief Create an index for a given bam file
  *
- * Currently all bamdb indices are LMDB based, though this function may change
- * in the future to support multiple index types. This function will spawn
- * a deserialize thread and an additional thread per desired index column.
+ * Indices are LMDB based unless target_indices->backend selects
+ * BAMDB_BACKEND_TABLE, which writes every index once as an immutable sorted
+ * table that lookups map read-only; table builds are always sorted and cannot
+ * be updated, resumed, compressed or packed into a single environment.
+ * Lookups find either kind of index on their own. This function will spawn
+ * target_indices->num_deserialize_threads deserialize threads (at least one)
+ * and an additional thread per desired index column.
+ * When target_indices->sorted_build is set, each index is first externally
+ * sorted and then loaded in key order instead of being inserted row by row.
+ * When target_indices->num_chunks is above one, the file is split at record
+ * boundaries and each part is read and sorted on its own thread before the
+ * parts are merged into each index; this always uses a sorted load.
+ * When target_indices->update is set, an existing index of an earlier, shorter
+ * version of the file is extended with just the new rows.
+ * Unsorted builds checkpoint their progress with every commit; when
+ * target_indices->resume is set, a build that was interrupted continues from
+ * its last checkpoint instead of starting over.
+ * With target_indices->single_env, or when db_path already holds a single
+ * environment, the finished indices are moved into named databases of one
+ * environment in db_path.
+ * With target_indices->compress_postings the offsets of every key are stored
+ * as a few delta encoded chunks while they are moved into the single
+ * environment; an update keeps the posting format the indices already have.
+ * A key index named POS maps the coordinates of every placed read, for region
+ * queries on files in any sort order.
+ * Key indices named XX:i or XX:f index an integer or floating point tag in
+ * numeric order; rows without a value of that type are left out.
+ * A key index named after several fields joined by +, e.g. BX+MI:i, stores
+ * them as one key that can also be looked up by its leading fields alone.
+ * Key indices flagged in target_indices->packed_key_indices store barcodes as
+ * fixed width integer keys; values that are not barcodes are left out of those
+ * indices.
+ * With target_indices->hash_qname the QNAME index is always sorted and stored
+ * as a minimal perfect hash, which drops the names themselves and answers
+ * exact lookups with a single probe; it cannot be updated or resumed.
+ * Rows rejected by target_indices->row_filter are left out of every index; an
+ * update or resume has to use the filter the index was built with.
  *
  * @param[in] input_file The path of the bam file to index
  * @param[in] db_path Optional path of the generated index; a default path
@@ -35,6 +122,8 @@ int generate_index_file(char *input_file_name, char *output_file_name,
 void print_bamdb_rows(const char *input_file_name, const char *db_path,
                       const char *index_name, const char *key);
 
+/* Write the rows at the offsets of offset_list to a bam file, in file order.
+ * offset_list is sorted in place. Returns 0 on success. */
 int write_row_subset(char *input_file_name, offset_list_t *offset_list,
                      char *out_filename);
 
@@ -44,6 +133,10 @@ int write_row_subset(char *input_file_name, offset_list_t *offset_list,
  * caller to free the results. In the event of an error we will return an
  * empty row set object. Callers should NOT pass a preallocated or
  * existing row set to this function.
+ * On the POS coordinate index the key is a region such as chr1:1000-2000 and
+ * every read overlapping it matches.
+ * Rows are returned in file order, which lets rows sharing a BGZF block be
+ * read with a single inflate of it.
  *
  * @param[out] output Location to store the resulting records
  * @param[in] input_file_name Path of the bam file to query
@@ -55,4 +148,145 @@ int write_row_subset(char *input_file_name, offset_list_t *offset_list,
 int get_bam_rows(bam_row_set_t **output, const char *input_file_name,
                  const char *db_path, const char *index_name, const char *key);
 
+/** @brief Find all rows matching several keys, each from its own index
+ *
+ * Works like get_bam_rows, e.g. index_names {"BX", "MI:i"} and keys
+ * {"ACGT-1", "5"} with BAMDB_COMBINE_AND returns the rows with both values.
+ * The predicates are combined on the offsets stored in the indices, so only
+ * rows in the result are read from the bam file.
+ *
+ * @param[in] num_predicates Number of index names and keys
+ * @param[in] index_names Name of the index each key is searched in
+ * @param[in] keys Key searched for in each index, as for get_bam_rows
+ * @param[in] combine Whether rows must match every key or any of them
+ * @return 0 on success or a non-zero error value on failure
+ */
+int get_bam_rows_multi(bam_row_set_t **output, const char *input_file_name,
+                       const char *db_path, size_t num_predicates,
+                       char **index_names, char **keys,
+                       bamdb_combine_t combine);
+
+/** @brief Find all rows whose value lies in a range of an index
+ *
+ * Works like get_bam_rows; e.g. min_key "50" and a NULL max_key on the AS:i
+ * index returns every row with AS >= 50.
+ *
+ * @param[in] min_key Smallest value to include or NULL for no lower bound
+ * @param[in] max_key Largest value to include or NULL for no upper bound
+ * @return 0 on success or a non-zero error value on failure
+ */
+int get_bam_rows_range(bam_row_set_t **output, const char *input_file_name,
+                       const char *db_path, const char *index_name,
+                       const char *min_key, const char *max_key);
+
+/** @brief Open a bam file and its index database for a series of queries
+ *
+ * The bam header is parsed and the environment, table, hash and bloom filter
+ * of each index are opened once, the first time a query names the index, and
+ * kept until bamdb_session_close. Queries through a session then cost only
+ * the lookup and the rows read; get_bam_rows and its variants open a session
+ * for a single query. A session must not be used by several threads at once.
+ *
+ * @param[out] session Set to the new session, or NULL on failure
+ * @param[in] input_file_name Path of the bam file to query, may be NULL if
+ * the session only returns offsets of keys that are not regions
+ * @param[in] db_path Top-level directory of the index database
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_session_open(bamdb_session_t **session, const char *input_file_name,
+                       const char *db_path);
+
+void bamdb_session_close(bamdb_session_t *session);
+
+/** @brief Read the rows of large results with up to num_threads threads
+ *
+ * The sorted offsets of a query are split into spans of whole BGZF blocks,
+ * and each thread inflates and parses its spans through a bam handle of its
+ * own. Rows are still returned in file order: a span's rows are only handed
+ * over once every span before it was read, so there is no unordered mode
+ * and the rows of a threaded fetch are buffered, a bounded window of them for
+ * an iterator. Sessions start with one thread.
+ */
+void bamdb_session_set_threads(bamdb_session_t *session, size_t num_threads);
+
+/** @brief get_bam_rows through an open session */
+int bamdb_session_get_rows(bam_row_set_t **output, bamdb_session_t *session,
+                           const char *index_name, const char *key);
+
+/** @brief get_bam_rows_multi through an open session */
+int bamdb_session_get_rows_multi(bam_row_set_t **output,
+                                 bamdb_session_t *session,
+                                 size_t num_predicates, char **index_names,
+                                 char **keys, bamdb_combine_t combine);
+
+/** @brief Find the rows matching each of many keys of one index
+ *
+ * Looks every key up in a single walk through the index and reads all
+ * matching rows in one pass over the bam file, in file order. Row i matched
+ * keys[output->key_ids[i]]; a row matching several keys is returned once for
+ * each of them.
+ *
+ * @param[in] num_keys Number of keys
+ * @param[in] keys Keys searched for in the index, as for get_bam_rows
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_session_get_rows_batch(bam_row_set_t **output,
+                                 bamdb_session_t *session,
+                                 const char *index_name, size_t num_keys,
+                                 char **keys);
+
+/** @brief get_bam_rows_range through an open session */
+int bamdb_session_get_rows_range(bam_row_set_t **output,
+                                 bamdb_session_t *session,
+                                 const char *index_name, const char *min_key,
+                                 const char *max_key);
+
+/** @brief Start reading the rows matching a key one at a time
+ *
+ * Unlike bamdb_session_get_rows only the offsets of the result are held in
+ * memory. Each call to bamdb_row_iter_next reads and deserializes the next
+ * row in file order, so the first row is available as soon as the index was
+ * read and the caller can stop at any point with bamdb_row_iter_close. With
+ * more than one session thread the next few thousand rows per thread are
+ * read ahead in one threaded fetch instead, still handed out in file order.
+ * The session must stay open until the iterator is closed.
+ *
+ * @param[out] iter Set to the new iterator, or NULL on failure
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_session_iter_rows(bamdb_row_iter_t **iter, bamdb_session_t *session,
+                            const char *index_name, const char *key);
+
+/** @brief bamdb_session_get_rows_multi as an iterator */
+int bamdb_session_iter_rows_multi(bamdb_row_iter_t **iter,
+                                  bamdb_session_t *session,
+                                  size_t num_predicates, char **index_names,
+                                  char **keys, bamdb_combine_t combine);
+
+/** @brief bamdb_session_get_rows_range as an iterator */
+int bamdb_session_iter_rows_range(bamdb_row_iter_t **iter,
+                                  bamdb_session_t *session,
+                                  const char *index_name, const char *min_key,
+                                  const char *max_key);
+
+/** @brief bamdb_session_get_rows_batch as an iterator, see
+ * bamdb_row_iter_key_id */
+int bamdb_session_iter_rows_batch(bamdb_row_iter_t **iter,
+                                  bamdb_session_t *session,
+                                  const char *index_name, size_t num_keys,
+                                  char **keys);
+
+/** @brief Read the next row of an iterator
+ *
+ * @param[out] row Set to the row, to be freed with destroy_bam_sequence_row,
+ * or NULL after the last row
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_row_iter_next(bamdb_row_iter_t *iter, bam_sequence_row_t **row);
+
+/** Position in the batch of the key the last row of a batch iterator matched */
+size_t bamdb_row_iter_key_id(const bamdb_row_iter_t *iter);
+
+void bamdb_row_iter_close(bamdb_row_iter_t *iter);
+
 #endif
@@ -0,0 +1,45 @@
+/**
+ * @file bamdb_barcode.h
+ * @brief Fixed width integer encoding of nucleotide barcodes
+ *
+ * Barcodes such as ACGTACGTACGTACGT-1 are packed into a single 64 bit integer
+ * so barcode indices can be stored with MDB_INTEGERKEY. From the high bits
+ * down a packed barcode holds the numeric suffix plus one (0 when there is no
+ * suffix), the number of bases and the bases themselves at 2 bits each, first
+ * base highest. Barcodes of the same length and suffix therefore order the
+ * same way as their strings.
+ */
+#ifndef BAMDB_BARCODE_H
+#define BAMDB_BARCODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BAMDB_MAX_PACKED_BASES 24
+#define BAMDB_MAX_PACKED_SUFFIX 2046
+/* Longest string bamdb_unpack_barcode produces, including the terminator */
+#define BAMDB_MAX_BARCODE_CHARS (BAMDB_MAX_PACKED_BASES + 6)
+
+/* Index names in the metadata of packed indices carry this suffix */
+#define BAMDB_PACKED_INDEX_SUFFIX ":packed"
+
+/** @brief Pack a barcode into an integer key
+ *
+ * The missing value "*" packs to 0.
+ *
+ * @param[in] barcode Bases from ACGT, optionally followed by -N with N at most
+ * BAMDB_MAX_PACKED_SUFFIX
+ * @param[out] packed Location to store the packed barcode
+ * @return true on success or false if the barcode does not have that shape
+ */
+bool bamdb_pack_barcode(const char *barcode, uint64_t *packed);
+
+/** @brief Turn a packed barcode back into its string
+ *
+ * @param[in] packed Value produced by bamdb_pack_barcode
+ * @param[out] buffer At least BAMDB_MAX_BARCODE_CHARS bytes
+ * @return buffer
+ */
+char *bamdb_unpack_barcode(uint64_t packed, char *buffer);
+
+#endif
@@ -0,0 +1,61 @@
+/**
+ * @file bamdb_bloom.h
+ * @brief Bloom filters of the keys of an index
+ *
+ * Every completed build writes a filter of the keys of each index next to the
+ * index, db_path/<index name>.bloom. Lookups check it before opening LMDB, so
+ * keys that are not in the index are usually answered from a single cache
+ * line of a small mapped file.
+ *
+ * The filter is blocked: all bits of a key lie in one 512 bit block. Keys are
+ * hashed in the form the index stores them in, see bamdb_key.h and
+ * bamdb_barcode.h.
+ */
+#ifndef BAMDB_BLOOM_H
+#define BAMDB_BLOOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Appended to the index name to name its filter file */
+#define BAMDB_BLOOM_SUFFIX ".bloom"
+/* Bits per key, for a false positive rate of about 1% */
+#define BAMDB_BLOOM_BITS_PER_KEY 10
+
+/* Filter flags */
+#define BAMDB_BLOOM_PACKED 1  // Keys are packed barcodes
+
+typedef struct bamdb_bloom bamdb_bloom_t;
+
+/** Path of the filter of index_name in the database at db_path */
+void bamdb_bloom_path(char *path, size_t path_size, const char *db_path,
+                      const char *index_name);
+
+/** @brief Create an empty filter sized for num_keys keys */
+bamdb_bloom_t *bamdb_bloom_create(uint64_t num_keys, uint32_t flags);
+
+void bamdb_bloom_add(bamdb_bloom_t *bloom, const void *key, size_t key_size);
+
+/** @brief Write a filter to path, replacing any earlier file atomically
+ *
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_bloom_write(const bamdb_bloom_t *bloom, const char *path);
+
+/** @brief Map a filter written by bamdb_bloom_write
+ *
+ * @return The filter or NULL if there is no valid filter at path
+ */
+bamdb_bloom_t *bamdb_bloom_open(const char *path);
+
+/** @return false if key is certainly not in the filter */
+bool bamdb_bloom_may_contain(const bamdb_bloom_t *bloom, const void *key,
+                             size_t key_size);
+
+uint32_t bamdb_bloom_flags(const bamdb_bloom_t *bloom);
+
+/** Free a created filter or unmap an opened one */
+void bamdb_bloom_destroy(bamdb_bloom_t *bloom);
+
+#endif
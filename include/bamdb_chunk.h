@@ -0,0 +1,36 @@
+/* Only build if we want write functionality */
+#ifdef BUILD_BAMDB_WRITER
+/**
+ * @file bamdb_chunk.h
+ * @brief Split a BAM file into independently readable ranges of records
+ *
+ */
+#ifndef BAMDB_CHUNK_H
+#define BAMDB_CHUNK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** @brief Find record aligned start offsets for splitting a BAM file
+ *
+ * The file is cut at roughly even compressed offsets. At each cut the next
+ * BGZF block is located from its header and the first position in it that
+ * parses as a run of valid BAM records becomes the start of a chunk. Chunk i
+ * covers [starts[i], starts[i + 1]) and the last chunk runs to the end of
+ * the file. The first chunk always starts right after the header.
+ *
+ * Boundaries are found heuristically, so readers must check that the previous
+ * chunk ends exactly on the next chunk's start, and have it read on to the
+ * following start when it does not.
+ *
+ * @param[in] input_file_name Path of the BAM file to split
+ * @param[in] num_chunks Desired number of chunks
+ * @param[out] starts Allocated array of chunk start voffsets
+ * @param[out] num_starts Number of chunks found, at most num_chunks
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bam_find_chunks(const char *input_file_name, size_t num_chunks,
+                    int64_t **starts, size_t *num_starts);
+
+#endif
+#endif
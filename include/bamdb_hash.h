@@ -0,0 +1,86 @@
+/**
+ * @file bamdb_hash.h
+ * @brief Minimal perfect hash indices for exact lookups
+ *
+ * Indices that are only ever looked up by their exact value, such as QNAME,
+ * can be stored as a minimal perfect hash in db_path/<index name>.hash. The
+ * keys themselves are not stored: each of the n keys maps to its own one of n
+ * slots, which holds a 32 bit fingerprint of the key and its offsets, so a
+ * lookup reads a bucket pilot, a slot and, for keys with several offsets,
+ * the offsets stored after the slots. Keys that were never added map to a
+ * slot whose fingerprint almost never matches.
+ *
+ * The hash function is found by hash and displace: keys are split into
+ * buckets of a few keys each, and every bucket gets the first pilot value
+ * that moves all of its keys to free positions of a table slightly larger
+ * than n. The few keys landing past the first n positions are remapped to the
+ * positions left free below n.
+ */
+#ifndef BAMDB_HASH_H
+#define BAMDB_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Appended to the index name to name its hash file */
+#define BAMDB_HASH_SUFFIX ".hash"
+
+typedef struct bamdb_hash bamdb_hash_t;
+typedef struct bamdb_hash_builder bamdb_hash_builder_t;
+
+/** Path of the hash of index_name in the database at db_path */
+void bamdb_hash_path(char *path, size_t path_size, const char *db_path,
+                     const char *index_name);
+
+bamdb_hash_builder_t *bamdb_hash_create(void);
+
+/** @brief Add a key to the set the hash is built for, each key only once */
+void bamdb_hash_add_key(bamdb_hash_builder_t *builder, const void *key,
+                        size_t key_size);
+
+/** @brief Find the hash function of every added key and start writing path
+ *
+ * The hash is written to a temporary file and only replaces path once
+ * bamdb_hash_finish succeeds.
+ *
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_hash_build(bamdb_hash_builder_t *builder, const char *path);
+
+/** @brief Store the offsets of a key added before bamdb_hash_build
+ *
+ * @param[in] offsets Offsets of the key in ascending order
+ * @param[in] num_offsets Number of offsets, at least one
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_hash_set(bamdb_hash_builder_t *builder, const void *key,
+                   size_t key_size, const int64_t *offsets,
+                   size_t num_offsets);
+
+/** @brief Write the slots, move the hash into place and free builder
+ *
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_hash_finish(bamdb_hash_builder_t *builder);
+
+/** Drop a hash that failed to build and free builder */
+void bamdb_hash_discard(bamdb_hash_builder_t *builder);
+
+/** @brief Map a hash written by bamdb_hash_finish
+ *
+ * @return The hash or NULL if there is no valid hash at path
+ */
+bamdb_hash_t *bamdb_hash_open(const char *path);
+
+void bamdb_hash_close(bamdb_hash_t *hash);
+
+/** @brief Find the offsets stored under key
+ *
+ * @param[out] offsets Set to the offsets of key in ascending order, they
+ * point into the mapped file
+ * @return Number of offsets, 0 if key is not in the hash
+ */
+size_t bamdb_hash_lookup(const bamdb_hash_t *hash, const void *key,
+                         size_t key_size, const int64_t **offsets);
+
+#endif
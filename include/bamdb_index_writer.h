@@ -13,10 +13,18 @@
 
 /** @brief Generate an lmdb based index for a given bam file
  *
- * This function will spawn a dedicated deserialization thread as well as one
+ * This function will spawn a pool of deserialization threads as well as one
  * thread per desired index in order to write in parallel and maximize potential
- * throughput. This can be highly memory and disk IO intensive, so it is
- * advisible to only run this on a machine with no other active workloads.
+ * throughput. Rows are handed to the deserialization threads in turn and
+ * collected again in the same order, so each index is written in file order.
+ * With target_indices->num_chunks above one, the file is instead split into
+ * parts that are read on separate threads and merged per index at the end.
+ * With target_indices->backend set to BAMDB_BACKEND_TABLE the merged pairs
+ * of each index are written to an immutable table instead, see bamdb_table.h.
+ * With target_indices->hash_qname the QNAME pairs are merged twice, once to
+ * find a minimal perfect hash of the names and once to fill it.
+ * This can be highly memory and disk IO intensive, so it is advisible to only
+ * run this on a machine with no other active workloads.
  *
  * @param[in] input_file The path of the bam file to index
  * @param[in] db_path Optional path of the generated index; a default path
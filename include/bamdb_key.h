@@ -0,0 +1,105 @@
+/**
+ * @file bamdb_key.h
+ * @brief Sortable binary keys for typed aux tag and coordinate indices
+ *
+ * Indices of numeric aux tags are named after the tag and its type, AS:i for
+ * an integer tag or XS:f for a floating point tag. Their values are stored as
+ * fixed size big-endian keys arranged so that LMDB's default bytewise order is
+ * numeric order, which lets ranges be answered by walking a cursor.
+ *
+ * The coordinate index maps (tid, bin, pos, end) of every placed read to its
+ * offset. bin is the BAI style bin of the read's span: a read overlapping a
+ * region can only be in one of the few bins covering that region, so a region
+ * query scans just those bins instead of every read before the region.
+ *
+ * Composite indices are named after their fields joined by '+', e.g. BX+MI:i
+ * or BX+RNAME, and queried with values joined the same way. String fields are
+ * stored NUL terminated and numeric ones in their typed form, so giving just
+ * the leading values looks up every key starting with them.
+ */
+#ifndef BAMDB_KEY_H
+#define BAMDB_KEY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of every integer and floating point key */
+#define BAMDB_TYPED_KEY_SIZE 8
+/* Name of the coordinate index and size of its keys */
+#define BAMDB_REGION_INDEX "POS"
+#define BAMDB_REGION_KEY_SIZE 16
+/* Joins the fields of a composite index name and the values of its keys */
+#define BAMDB_FIELD_SEPARATOR '+'
+/* Longest single field name, e.g. QNAME or AS:i, including the terminator */
+#define BAMDB_MAX_FIELD_CHARS 8
+/* Longest key LMDB accepts with its default page size */
+#define BAMDB_MAX_KEY_SIZE 511
+
+typedef enum bamdb_key_type {
+  BAMDB_KEY_STRING,
+  BAMDB_KEY_INT,
+  BAMDB_KEY_FLOAT,
+  BAMDB_KEY_REGION,
+  BAMDB_KEY_COMPOSITE
+} bamdb_key_type_t;
+
+/** @brief Key type of an index from its name or the type suffix of it */
+bamdb_key_type_t bamdb_key_type(const char *index_name);
+
+void bamdb_store_be64(uint64_t value, void *buffer);
+uint64_t bamdb_load_be64(const void *buffer);
+
+void bamdb_encode_int_key(int64_t value, void *buffer);
+int64_t bamdb_decode_int_key(const void *buffer);
+
+void bamdb_encode_float_key(double value, void *buffer);
+double bamdb_decode_float_key(const void *buffer);
+
+/** @brief Encode a value given as text, e.g. a query from the command line
+ *
+ * @param[in] type BAMDB_KEY_INT or BAMDB_KEY_FLOAT
+ * @param[in] text The number to encode
+ * @param[out] buffer At least BAMDB_TYPED_KEY_SIZE bytes
+ * @return true on success or false if text is not a number of that type
+ */
+bool bamdb_parse_typed_key(bamdb_key_type_t type, const char *text,
+                           void *buffer);
+
+/** @brief Copy the first field of a composite index name
+ *
+ * @param[in] name Index name, or the rest of one
+ * @param[out] field The field, truncated to BAMDB_MAX_FIELD_CHARS - 1
+ * @return The start of the next field or NULL after the last one
+ */
+const char *bamdb_next_field(const char *name,
+                             char field[BAMDB_MAX_FIELD_CHARS]);
+
+/** @brief Encode the values of a composite key given as text
+ *
+ * @param[in] index_name Name of the composite index
+ * @param[in] values Values of the leading fields joined by '+'
+ * @param[out] buffer At least BAMDB_MAX_KEY_SIZE bytes
+ * @param[out] key_size Size of the encoded key
+ * @param[out] prefix Set if fewer values than fields were given
+ * @return true on success or false if a value does not fit its field
+ */
+bool bamdb_encode_composite_key(const char *index_name, const char *values,
+                                void *buffer, size_t *key_size, bool *prefix);
+
+/** Bin of a read covering [beg, end), positions are 0-based */
+uint32_t bamdb_region_bin(int64_t beg, int64_t end);
+
+/** @brief List every bin that may hold reads overlapping [beg, end)
+ *
+ * @param[out] bins Allocated list of bins, to be freed by the caller
+ * @return Number of bins in the list
+ */
+size_t bamdb_region_bins(int64_t beg, int64_t end, uint32_t **bins);
+
+void bamdb_encode_region_key(int32_t tid, uint32_t bin, int64_t pos,
+                             int64_t end, void *buffer);
+void bamdb_decode_region_key(const void *buffer, int32_t *tid, uint32_t *bin,
+                             int64_t *pos, int64_t *end);
+
+#endif
@@ -18,12 +18,44 @@
 #include "hts.h"
 #include "sam.h"
 
+/* Most named databases a single environment can hold */
+#define BAMDB_MAX_INDICES 64
+/* Name of the LMDB data file inside an environment directory */
+#define LMDB_DATA_FILE "data.mdb"
+
 char *get_default_dbname(const char *filename);
 
 int get_lmdb_env(MDB_env **env, const char *full_db_path, bool read_only);
 
 int commit_lmdb_transaction(MDB_txn *txn);
 
+/** @brief Check how the indices of a database are stored
+ *
+ * A database either holds every index as a named database of a single
+ * environment in db_path itself, or one environment per index under
+ * db_path/<index name>.
+ *
+ * @return true for a single environment
+ */
+bool is_single_env(const char *db_path);
+
+/** @brief Open a read transaction shared by every index of a database
+ *
+ * Lookups made through the transaction all see the same consistent snapshot.
+ * Only available for databases with a single environment.
+ *
+ * @return 0 on success or a non-zero error value on failure
+ */
+int open_lmdb_snapshot(MDB_env **env, MDB_txn **txn, const char *db_path);
+
+void close_lmdb_snapshot(MDB_env *env, MDB_txn *txn);
+
+/** @brief Return matching bam offsets from a snapshot opened with
+ * open_lmdb_snapshot
+ */
+int get_offsets_lmdb_txn(offset_list_t *offset_list, MDB_txn *txn,
+                         const char *index_name, const char *key);
+
 /** @brief Return matching bam offsets from an LMDB based index
  *
  * @param[out] output Offset list to populate with the results
@@ -35,6 +67,110 @@ int commit_lmdb_transaction(MDB_txn *txn);
 int get_offsets_lmdb(offset_list_t *offset_list, const char *db_path,
                      const char *index_name, const char *key);
 
+/** @brief Return the bam offsets of every key in a range of an index
+ *
+ * Bounds are given as text like the key of get_offsets_lmdb and compared in
+ * the order of the index, numerically for typed indices such as AS:i.
+ *
+ * @param[out] output Offset list to populate with the results, in key order
+ * @param[in] db_path Top-level directory of the index database
+ * @param[in] index_name Name of the field to search in
+ * @param[in] min_key Smallest value to include or NULL for no lower bound
+ * @param[in] max_key Largest value to include or NULL for no upper bound
+ * @return 0 on success or a non-zero error value on failure
+ */
+int get_offsets_lmdb_range(offset_list_t *offset_list, const char *db_path,
+                           const char *index_name, const char *min_key,
+                           const char *max_key);
+
+/** @brief Return the bam offsets of reads overlapping a region
+ *
+ * Uses the POS coordinate index, see bamdb_key.h.
+ *
+ * @param[in] tid Reference id of the region
+ * @param[in] beg 0-based start of the region
+ * @param[in] end 0-based end of the region, exclusive
+ * @return 0 on success or a non-zero error value on failure
+ */
+int get_offsets_lmdb_region(offset_list_t *offset_list, const char *db_path,
+                            int32_t tid, int64_t beg, int64_t end);
+
+/** @brief Return the bam offsets of reads overlapping a region given as text
+ *
+ * @param[in] input_file_name Bam file whose header names the references
+ * @param[in] region Region such as chr1:1000-2000, see bam_parse_region
+ * @return 0 on success or a non-zero error value on failure
+ */
+int get_region_offsets_lmdb(offset_list_t *offset_list,
+                            const char *input_file_name, const char *db_path,
+                            const char *region);
+
+/** @brief Return the bam offsets matching several keys, each from its own
+ * index
+ *
+ * The offsets stored under each key are read as sorted lists and intersected
+ * or merged without touching the bam file. Intersections start from the
+ * shortest list and skip through the others with a galloping search.
+ *
+ * @param[in] input_file_name Bam file naming the references of POS keys, may
+ * be NULL if no key is a region
+ * @param[in] num_predicates Number of index names and keys
+ * @param[in] index_names Name of the index each key is searched in
+ * @param[in] keys Key searched for in each index, as for get_offsets_lmdb
+ * @param[in] combine Whether offsets must match every key or any of them
+ * @return 0 on success or a non-zero error value on failure
+ */
+int get_offsets_lmdb_multi(offset_list_t *offset_list,
+                           const char *input_file_name, const char *db_path,
+                           size_t num_predicates, char **index_names,
+                           char **keys, bamdb_combine_t combine);
+
+/** @brief Return matching bam offsets through a session, see
+ * bamdb_session_open
+ *
+ * Works like get_offsets_lmdb, and also takes regions on the POS index if the
+ * session was opened with the bam file.
+ */
+int bamdb_session_get_offsets(offset_list_t *offset_list,
+                              bamdb_session_t *session, const char *index_name,
+                              const char *key);
+
+/** @brief get_offsets_lmdb_range through a session */
+int bamdb_session_get_offsets_range(offset_list_t *offset_list,
+                                    bamdb_session_t *session,
+                                    const char *index_name,
+                                    const char *min_key, const char *max_key);
+
+/** @brief get_offsets_lmdb_multi through a session */
+int bamdb_session_get_offsets_multi(offset_list_t *offset_list,
+                                    bamdb_session_t *session,
+                                    size_t num_predicates, char **index_names,
+                                    char **keys, bamdb_combine_t combine);
+
+/* A bam offset found by a batch lookup and the key it matched */
+typedef struct bamdb_key_offset {
+  int64_t offset;
+  size_t key_id;  // Position of the key in the batch
+} bamdb_key_offset_t;
+
+/** @brief Return the bam offsets matching each of many keys of one index
+ *
+ * The keys are sorted into the order of the index so a single cursor or
+ * table walk moves forward through it, and the offsets of every key are
+ * returned together in file order, ready for one pass over the bam file.
+ * An offset matching several keys is returned once for each key.
+ *
+ * @param[out] offsets Set to the offsets found, to be freed by the caller
+ * @param[out] num_offsets Set to the number of offsets found
+ * @param[in] keys Keys searched for, as for get_offsets_lmdb
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_session_get_offsets_batch(bamdb_key_offset_t **offsets,
+                                    size_t *num_offsets,
+                                    bamdb_session_t *session,
+                                    const char *index_name, size_t num_keys,
+                                    char **keys);
+
 /**
  * Get a list of the available indices in an existing lmdb database
  */
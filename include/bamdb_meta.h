@@ -0,0 +1,86 @@
+/**
+ * @file bamdb_meta.h
+ * @brief Record of what part of a bam file an index covers
+ *
+ * Every completed build stores the offset after the last indexed row together
+ * with a fingerprint of the bam file so later builds can tell whether the file
+ * has only grown since and index just the new rows.
+ *
+ * Builds in progress periodically store a checkpoint in the same format, where
+ * end_voffset is the row up to which every index has been committed.
+ */
+#ifndef BAMDB_META_H
+#define BAMDB_META_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Name of the metadata file inside the index directory */
+#define BAMDB_META_FILE "bamdb.meta"
+/* Progress of an unfinished build, removed once the build completes */
+#define BAMDB_CHECKPOINT_FILE "bamdb.checkpoint"
+
+typedef struct bamdb_fingerprint {
+  int64_t file_size;
+  uint64_t head_hash;  // Hash of the start of the file
+  uint64_t tail_hash;  // Hash of the bytes just before file_size
+} bamdb_fingerprint_t;
+
+typedef struct bamdb_meta {
+  /* Voffset right after the last indexed row */
+  int64_t end_voffset;
+  uint64_t num_rows;
+  bamdb_fingerprint_t fingerprint;
+  size_t num_indices;
+  char **indices;
+  /* Description of the row filter of the build, NULL if it kept every row */
+  char *row_filter;
+} bamdb_meta_t;
+
+/** @brief Fingerprint the first file_size bytes of a file
+ *
+ * @param[in] file_name Path of the file
+ * @param[in] file_size Length of the prefix to fingerprint or -1 for the
+ * whole file as it is now
+ * @param[out] fingerprint Location to store the result
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_fingerprint_file(const char *file_name, int64_t file_size,
+                           bamdb_fingerprint_t *fingerprint);
+
+bool bamdb_fingerprint_equal(const bamdb_fingerprint_t *a,
+                             const bamdb_fingerprint_t *b);
+
+/** @brief Read the metadata stored in an index directory
+ *
+ * On success the caller owns the index names and must release them with
+ * bamdb_free_meta.
+ *
+ * @return 0 on success or a non-zero error value if the metadata is missing or
+ * unreadable
+ */
+int bamdb_read_meta(const char *db_path, bamdb_meta_t *meta);
+
+/** @brief Atomically replace the metadata stored in an index directory */
+int bamdb_write_meta(const char *db_path, const bamdb_meta_t *meta);
+
+/** Remove the metadata, e.g. before an index is rebuilt from scratch */
+void bamdb_remove_meta(const char *db_path);
+
+/** @brief Read the checkpoint of an unfinished build
+ *
+ * @return 0 on success or a non-zero error value if there is no checkpoint
+ */
+int bamdb_read_checkpoint(const char *db_path, bamdb_meta_t *checkpoint);
+
+int bamdb_write_checkpoint(const char *db_path,
+                           const bamdb_meta_t *checkpoint);
+
+void bamdb_remove_checkpoint(const char *db_path);
+
+bool bamdb_meta_has_index(const bamdb_meta_t *meta, const char *index_name);
+
+void bamdb_free_meta(bamdb_meta_t *meta);
+
+#endif
@@ -0,0 +1,60 @@
+/**
+ * @file bamdb_postings.h
+ * @brief Delta encoded chunks of sorted bam offsets
+ *
+ * Indices built with compressed postings store the offsets of a key as a few
+ * chunks instead of one 8 byte duplicate per offset. A chunk starts with its
+ * first offset as 8 big-endian bytes, so LMDB orders the chunks of a key by
+ * offset, followed by the difference of every further offset to the one
+ * before it as a varint of 7 bits per byte, low bits first.
+ */
+#ifndef BAMDB_POSTINGS_H
+#define BAMDB_POSTINGS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* LMDB limits the duplicates of a key to its key size limit */
+#define BAMDB_MAX_POSTING_CHUNK_SIZE 511
+/* The first offset of a chunk takes 8 bytes and every other at least one */
+#define BAMDB_MAX_POSTING_CHUNK_OFFSETS (BAMDB_MAX_POSTING_CHUNK_SIZE - 7)
+/* A 64 bit value needs at most 10 bytes of 7 bits */
+#define BAMDB_MAX_VARINT_SIZE 10
+
+/** @brief Store value as a varint, see above
+ *
+ * @param[out] out At least BAMDB_MAX_VARINT_SIZE bytes
+ * @return Number of bytes written
+ */
+size_t bamdb_encode_varint(uint64_t value, unsigned char *out);
+
+/** @brief Read a varint from in, which ends before end
+ *
+ * @return Number of bytes read, 0 if the varint runs past end
+ */
+size_t bamdb_decode_varint(const unsigned char *in, const unsigned char *end,
+                           uint64_t *value);
+
+/** @brief Encode as many offsets as fit into one chunk
+ *
+ * @param[in] offsets Offsets in ascending order
+ * @param[in] num_offsets Number of offsets, at least one
+ * @param[out] chunk At least BAMDB_MAX_POSTING_CHUNK_SIZE bytes
+ * @param[out] chunk_size Size of the encoded chunk
+ * @return Number of offsets encoded, the rest go into further chunks
+ */
+size_t bamdb_encode_postings(const int64_t *offsets, size_t num_offsets,
+                             void *chunk, size_t *chunk_size);
+
+/** @brief Decode every offset of a chunk
+ *
+ * @param[out] offsets At least BAMDB_MAX_POSTING_CHUNK_OFFSETS entries
+ * @return Number of offsets decoded, 0 if the chunk is malformed
+ */
+size_t bamdb_decode_postings(const void *chunk, size_t chunk_size,
+                             int64_t *offsets);
+
+/** Number of offsets in a chunk, without decoding them */
+size_t bamdb_count_postings(const void *chunk, size_t chunk_size);
+
+#endif
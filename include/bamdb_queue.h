@@ -0,0 +1,51 @@
+/* Only build if we want write functionality */
+#ifdef BUILD_BAMDB_WRITER
+/**
+ * @file bamdb_queue.h
+ * @brief Bounded blocking queue used between index writer pipeline stages
+ *
+ * Producers block while the queue is full and consumers block while it is
+ * empty, so no stage ever has to poll. Each queue keeps track of how long its
+ * producers and consumers spent blocked, which shows where a pipeline is
+ * bottlenecked.
+ */
+#ifndef BAMDB_QUEUE_H
+#define BAMDB_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct bamdb_queue bamdb_queue_t;
+
+/** @brief Create a queue holding at most capacity items */
+bamdb_queue_t *bamdb_queue_init(size_t capacity);
+
+/** @brief Add an item, blocking while the queue is full
+ *
+ * @return 0 on success or a non-zero error value if the queue was closed
+ */
+int bamdb_queue_push(bamdb_queue_t *queue, void *item);
+
+/** @brief Remove the oldest item, blocking while the queue is empty
+ *
+ * @return true if an item was returned, false once the queue has been closed
+ * and every item has been consumed
+ */
+bool bamdb_queue_pop(bamdb_queue_t *queue, void **item);
+
+/** @brief Mark the end of input and wake up anyone blocked on the queue */
+void bamdb_queue_close(bamdb_queue_t *queue);
+
+size_t bamdb_queue_size(bamdb_queue_t *queue);
+
+/** Total nanoseconds producers spent blocked on a full queue */
+uint64_t bamdb_queue_push_wait_ns(bamdb_queue_t *queue);
+
+/** Total nanoseconds consumers spent blocked on an empty queue */
+uint64_t bamdb_queue_pop_wait_ns(bamdb_queue_t *queue);
+
+void bamdb_queue_destroy(bamdb_queue_t *queue);
+
+#endif
+#endif
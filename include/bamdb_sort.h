@@ -0,0 +1,78 @@
+/* Only build if we want write functionality */
+#ifdef BUILD_BAMDB_WRITER
+/**
+ * @file bamdb_sort.h
+ * @brief External sort of (key, voffset) pairs for bulk index loading
+ *
+ * Pairs are buffered in memory up to a fixed budget, spilled to sorted runs
+ * on disk when the budget is exceeded and finally merged back together in
+ * the same order LMDB stores them in. This lets an index be loaded with
+ * append semantics instead of random B-tree inserts.
+ */
+#ifndef BAMDB_SORT_H
+#define BAMDB_SORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default in-memory budget for a single sorter */
+#define BAMDB_DEFAULT_SORT_BUFFER_SIZE (256 * 1024 * 1024)
+
+typedef struct bamdb_sorter bamdb_sorter_t;
+
+/**
+ * Called once per pair in sorted order. new_key is false when the key is the
+ * same as the one passed in the previous call. Returning non-zero stops the
+ * merge and is passed back to the caller of bamdb_sorter_merge.
+ */
+typedef int (*bamdb_sorter_cb)(const void *key, size_t key_size,
+                               int64_t voffset, bool new_key, void *arg);
+
+/** @brief Create a new sorter
+ *
+ * @param[in] tmp_dir Directory used for spilled runs, which are removed again
+ * by bamdb_sorter_destroy
+ * @param[in] name Prefix for the run file names, usually the index name
+ * @param[in] max_memory Size of the in-memory buffer in bytes, 0 for default
+ * @return The new sorter or NULL on failure
+ */
+bamdb_sorter_t *bamdb_sorter_init(const char *tmp_dir, const char *name,
+                                  size_t max_memory);
+
+/** @brief Add a pair to the sorter, spilling a run to disk if needed
+ *
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_sorter_add(bamdb_sorter_t *sorter, const void *key, size_t key_size,
+                     int64_t voffset);
+
+/** @brief Merge all buffered pairs and runs, calling cb for each in order
+ *
+ * Keys are ordered as LMDB orders them by default (bytewise, shorter key
+ * first on a common prefix), and offsets under one key by their bytewise
+ * representation to match MDB_DUPFIXED duplicate ordering.
+ *
+ * @return 0 on success, the callback's return value if it stopped the merge,
+ * or a non-zero error value on failure
+ */
+int bamdb_sorter_merge(bamdb_sorter_t *sorter, bamdb_sorter_cb cb, void *arg);
+
+/** @brief Merge the pairs of several sorters into a single ordered stream
+ *
+ * Behaves like bamdb_sorter_merge over the union of all sorters, used to
+ * combine indices built over separate parts of a file. If there are too many
+ * runs to read at once they are first merged into fewer runs, which then
+ * belong to the first sorter. Merging the same sorters again still yields
+ * every pair.
+ */
+int bamdb_sorter_merge_many(bamdb_sorter_t **sorters, size_t num_sorters,
+                            bamdb_sorter_cb cb, void *arg);
+
+/** Number of runs spilled to disk so far */
+size_t bamdb_sorter_num_runs(const bamdb_sorter_t *sorter);
+
+void bamdb_sorter_destroy(bamdb_sorter_t *sorter);
+
+#endif
+#endif
@@ -0,0 +1,72 @@
+/**
+ * @file bamdb_stats.h
+ * @brief Key frequency statistics of an index
+ *
+ * Every completed build summarizes each index in db_path/<index name>.stats:
+ * how many distinct keys and rows it holds, a histogram of rows per key and
+ * the keys with the most rows. They are taken from the finished index, so
+ * they are exact and cover rows added by updates as well.
+ */
+#ifndef BAMDB_STATS_H
+#define BAMDB_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Appended to the index name to name its statistics file */
+#define BAMDB_STATS_SUFFIX ".stats"
+/* Number of most frequent keys kept */
+#define BAMDB_STATS_TOP_KEYS 16
+/* Bin i counts the keys with at least 2^i and fewer than 2^(i+1) rows */
+#define BAMDB_STATS_HISTOGRAM_BINS 64
+
+typedef struct bamdb_key_count {
+  char *key;
+  uint64_t num_rows;
+} bamdb_key_count_t;
+
+typedef struct bamdb_index_stats {
+  uint64_t num_keys;
+  uint64_t num_rows;
+  uint64_t histogram[BAMDB_STATS_HISTOGRAM_BINS];
+  /* Most rows first */
+  size_t num_top_keys;
+  bamdb_key_count_t top_keys[BAMDB_STATS_TOP_KEYS];
+} bamdb_index_stats_t;
+
+/** @brief Whether a key with num_rows rows would rank among the top keys
+ *
+ * Lets callers skip turning keys that will not be kept into text.
+ */
+bool bamdb_stats_is_top(const bamdb_index_stats_t *stats, uint64_t num_rows);
+
+/** @brief Count a key and its rows
+ *
+ * @param[in] key Text of the key, only needed if bamdb_stats_is_top is true
+ */
+void bamdb_stats_add_key(bamdb_index_stats_t *stats, const char *key,
+                         uint64_t num_rows);
+
+/** @brief Read the statistics of an index
+ *
+ * The caller releases them with bamdb_free_stats.
+ *
+ * @return 0 on success or a non-zero error value if there are none
+ */
+int bamdb_read_stats(const char *db_path, const char *index_name,
+                     bamdb_index_stats_t *stats);
+
+/** @brief Atomically replace the statistics of an index */
+int bamdb_write_stats(const char *db_path, const char *index_name,
+                      const bamdb_index_stats_t *stats);
+
+void bamdb_remove_stats(const char *db_path, const char *index_name);
+
+void bamdb_print_stats(FILE *fp, const char *index_name,
+                       const bamdb_index_stats_t *stats);
+
+void bamdb_free_stats(bamdb_index_stats_t *stats);
+
+#endif
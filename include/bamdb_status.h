@@ -9,6 +9,8 @@
 #define BAMDB_DESERIALIZE_ERROR -16002
 /** Error at the database level */
 #define BAMDB_DB_ERROR -16100
+/** Index does not match the sequence file it is used with */
+#define BAMDB_STALE_INDEX_ERROR -16101
 /** Inernal bamdb error */
 #define BAMDB_INTERNAL_ERROR -16300
 
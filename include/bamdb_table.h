@@ -0,0 +1,124 @@
+/**
+ * @file bamdb_table.h
+ * @brief Immutable sorted tables of keys and their offsets
+ *
+ * Indices built with the table backend are written once from the sorted
+ * pairs of a build to db_path/<index name>.table and mapped read-only by
+ * lookups, without any B-tree pages or per-duplicate overhead.
+ *
+ * A table holds one entry per key in the order LMDB would keep the keys in:
+ * the key size as a varint, the key, the number of offsets and the size of
+ * the offsets in bytes as varints, then the offsets in ascending order, the
+ * first as a varint and every further one as the varint difference to the one
+ * before it, see bamdb_postings.h. Entries are grouped into blocks of about
+ * BAMDB_TABLE_BLOCK_SIZE bytes and a sparse fence index at the end of the
+ * file holds where each block starts, so a lookup binary searches the first
+ * keys of the blocks and then scans a single block.
+ *
+ * Keys are stored as for LMDB, except that packed barcodes are stored
+ * big-endian so that they order bytewise.
+ */
+#ifndef BAMDB_TABLE_H
+#define BAMDB_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Appended to the index name to name its table file */
+#define BAMDB_TABLE_SUFFIX ".table"
+/* Entries are added to a block until it reaches this size */
+#define BAMDB_TABLE_BLOCK_SIZE 4096
+
+/* Table flags */
+#define BAMDB_TABLE_PACKED 1  // Keys are packed barcodes
+
+typedef struct bamdb_table bamdb_table_t;
+typedef struct bamdb_table_writer bamdb_table_writer_t;
+
+/* One key of a table and its offsets, pointing into the mapped file */
+typedef struct bamdb_table_entry {
+  const void *key;
+  size_t key_size;
+  uint64_t num_offsets;
+  const unsigned char *postings;
+  size_t postings_size;
+  /* Position of the entry after this one */
+  uint64_t next;
+} bamdb_table_entry_t;
+
+/** Path of the table of index_name in the database at db_path */
+void bamdb_table_path(char *path, size_t path_size, const char *db_path,
+                      const char *index_name);
+
+/** @brief Order of keys in a table, the default order of LMDB
+ *
+ * Bytewise over the common prefix, then the shorter key first.
+ */
+int bamdb_table_compare(const void *a, size_t a_size, const void *b,
+                        size_t b_size);
+
+/** @brief Start writing a table to path
+ *
+ * The table is written to a temporary file and only replaces path once
+ * bamdb_table_finish succeeds.
+ *
+ * @return The writer or NULL on failure
+ */
+bamdb_table_writer_t *bamdb_table_create(const char *path, uint32_t flags);
+
+/** @brief Add the next key of a table
+ *
+ * @param[in] key Key greater than every key added before
+ * @param[in] offsets Offsets of the key in ascending order
+ * @param[in] num_offsets Number of offsets, at least one
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_table_add(bamdb_table_writer_t *writer, const void *key,
+                    size_t key_size, const int64_t *offsets,
+                    size_t num_offsets);
+
+/** @brief Write the fence index, move the table into place and free writer
+ *
+ * @return 0 on success or a non-zero error value on failure
+ */
+int bamdb_table_finish(bamdb_table_writer_t *writer);
+
+/** Drop a table that failed to build and free writer */
+void bamdb_table_discard(bamdb_table_writer_t *writer);
+
+/** @brief Map a table written by bamdb_table_finish
+ *
+ * @return The table or NULL if there is no valid table at path
+ */
+bamdb_table_t *bamdb_table_open(const char *path);
+
+void bamdb_table_close(bamdb_table_t *table);
+
+uint32_t bamdb_table_flags(const bamdb_table_t *table);
+uint64_t bamdb_table_num_keys(const bamdb_table_t *table);
+
+/** @brief Find the first entry with a key not below key
+ *
+ * @return false if every key is below key
+ */
+bool bamdb_table_seek(const bamdb_table_t *table, const void *key,
+                      size_t key_size, bamdb_table_entry_t *entry);
+
+/** @return false if the table is empty */
+bool bamdb_table_first(const bamdb_table_t *table, bamdb_table_entry_t *entry);
+
+/** @brief Move entry on to the entry after it
+ *
+ * @return false after the last entry
+ */
+bool bamdb_table_next(const bamdb_table_t *table, bamdb_table_entry_t *entry);
+
+/** @brief Decode the offsets of an entry
+ *
+ * @param[out] offsets At least entry->num_offsets entries
+ * @return Number of offsets decoded, 0 if the entry is malformed
+ */
+size_t bamdb_table_decode(const bamdb_table_entry_t *entry, int64_t *offsets);
+
+#endif
@@ -8,6 +8,9 @@
 #include "bam_api.h"
 #include "bamdb_status.h"
 
+/* Bytes read at a time when skipping to a row further on in a block */
+#define SKIP_BUFFER_SIZE 4096
+
 #define get_int_chars(i) ((i == 0) ? 1 : floor(log10(abs(i))) + 1)
 
 const char *bam_get_rname(const bam1_t *row, const bam_hdr_t *header) {
@@ -139,6 +142,99 @@ char *bam_str_key(const bam1_t *row, const char *key, char *work_buffer) {
   return ret;
 }
 
+bool bam_int_key(const bam1_t *row, const char *key, int64_t *value) {
+  uint8_t *aux = bam_aux_get(row, key);
+
+  if (aux == NULL) {
+    return false;
+  }
+
+  switch (*aux) {
+    case 'c':
+    case 'C':
+    case 's':
+    case 'S':
+    case 'i':
+    case 'I':
+      *value = bam_aux2i(aux);
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool bam_float_key(const bam1_t *row, const char *key, double *value) {
+  uint8_t *aux = bam_aux_get(row, key);
+
+  if (aux == NULL || (*aux != 'f' && *aux != 'd')) {
+    return false;
+  }
+
+  *value = bam_aux2f(aux);
+  return true;
+}
+
+static int32_t find_target(const bam_hdr_t *header, const char *name,
+                           size_t name_len) {
+  for (int32_t i = 0; i < header->n_targets; ++i) {
+    if (strlen(header->target_name[i]) == name_len &&
+        strncmp(header->target_name[i], name, name_len) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* Parse a position, allowing thousands separators. Returns the character
+ * after the number. */
+static const char *parse_position(const char *s, int64_t *pos) {
+  const char *start = s;
+
+  *pos = 0;
+  for (; (*s >= '0' && *s <= '9') || *s == ','; ++s) {
+    if (*s != ',') {
+      *pos = *pos * 10 + (*s - '0');
+    }
+  }
+
+  return s == start ? NULL : s;
+}
+
+bool bam_parse_region(const bam_hdr_t *header, const char *region,
+                      int32_t *tid, int64_t *beg, int64_t *end) {
+  const char *colon = strrchr(region, ':');
+  const char *p;
+
+  /* Reference names may contain colons themselves */
+  *tid = find_target(header, region, strlen(region));
+  if (*tid >= 0) {
+    *beg = 0;
+    *end = header->target_len[*tid];
+    return true;
+  }
+
+  if (colon == NULL ||
+      (*tid = find_target(header, region, colon - region)) < 0) {
+    return false;
+  }
+
+  p = parse_position(colon + 1, beg);
+  if (p == NULL || *beg < 1) {
+    return false;
+  }
+  *beg -= 1;
+
+  if (*p == '\0') {
+    *end = header->target_len[*tid];
+  } else if (*p != '-' || (p = parse_position(p + 1, end)) == NULL ||
+             *p != '\0' || *end <= *beg) {
+    return false;
+  }
+
+  return true;
+}
+
 static int populate_aux_tags(aux_list_t *row_list,
                              bam_aux_header_list_t *row_set_tags,
                              const bam1_t *row) {
@@ -325,14 +421,74 @@ int deserialize_bam_row(bam_sequence_row_t **out,
   return ret;
 }
 
+int bam_seek_row(samFile *input_file, int64_t offset) {
+  BGZF *fp = input_file->fp.bgzf;
+  char skipped[SKIP_BUFFER_SIZE];
+  int64_t current = bgzf_tell(fp);
+  size_t gap, n;
+
+  if (offset == current) {
+    return 0;
+  }
+
+  /* Reading on through the block already loaded is a copy, a seek would
+   * inflate it again */
+  if ((offset >> 16) == (current >> 16) && offset > current) {
+    gap = (offset & 0xffff) - (current & 0xffff);
+    while (gap > 0) {
+      n = gap < sizeof(skipped) ? gap : sizeof(skipped);
+      if (bgzf_read(fp, skipped, n) != (ssize_t)n) {
+        break;
+      }
+      gap -= n;
+    }
+    if (gap == 0) {
+      return 0;
+    }
+  }
+
+  return bgzf_seek(fp, offset, SEEK_SET) < 0 ? -1 : 0;
+}
+
+static int compare_offset_values(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+void sort_offset_list(offset_list_t *offset_list) {
+  int64_t *offsets;
+  offset_node_t *node;
+  size_t i = 0;
+
+  if (offset_list->num_entries < 2) {
+    return;
+  }
+
+  offsets = malloc(offset_list->num_entries * sizeof(int64_t));
+  for (node = offset_list->head; node != NULL; node = node->next) {
+    offsets[i++] = node->offset;
+  }
+  qsort(offsets, i, sizeof(int64_t), compare_offset_values);
+
+  i = 0;
+  for (node = offset_list->head; node != NULL; node = node->next) {
+    node->offset = offsets[i++];
+  }
+  free(offsets);
+}
+
 int get_bam_row(bam_sequence_row_t **out, bam_aux_header_list_t *tag_list,
                 const int64_t offset, samFile *input_file, bam_hdr_t *header) {
   int ret = BAMDB_SUCCESS;
   int rc = 0;
   bam1_t *bam_row = bam_init1();
-  int64_t src = 0;
 
-  src = bgzf_seek(input_file->fp.bgzf, offset, SEEK_SET);
+  if (bam_seek_row(input_file, offset) != 0) {
+    ret = BAMDB_SEQUENCE_FILE_ERROR;
+    goto exit;
+  }
   rc = sam_read1(input_file, header, bam_row);
   if (rc < 0) {
     ret = BAMDB_SEQUENCE_FILE_ERROR;
@@ -417,6 +573,8 @@ void destroy_bam_sequence_row(bam_sequence_row_t *row) {
   free(row->rname);
   free(row->cigar);
   free(row->rnext);
+  free(row->seq);
+  free(row->qual);
   free(row);
 }
 
@@ -424,5 +582,6 @@ void free_bamdb_row_set(bam_row_set_t *row_set) {
   for (int i = 0; i < row_set->num_entries; ++i) {
     free(row_set->rows[i]);
   }
+  free(row_set->key_ids);
   free(row_set);
 }
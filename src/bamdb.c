@@ -47,9 +47,11 @@ int write_row_subset(char *input_file_name, offset_list_t *offset_list,
 
   bam_row = bam_init1();
   if (offset_list != NULL) {
+    /* Rows are written in file order, reading each block once */
+    sort_offset_list(offset_list);
     offset_node = offset_list->head;
     while (offset_node != NULL) {
-      src = bgzf_seek(input_file->fp.bgzf, offset_node->offset, SEEK_SET);
+      src = bam_seek_row(input_file, offset_node->offset);
       if (src != 0) {
         fprintf(stderr, "Error seeking to file offset\n");
         return 1;
@@ -67,7 +69,7 @@ int write_row_subset(char *input_file_name, offset_list_t *offset_list,
   }
 
   bgzf_close(fp);
-  return rc;
+  return 0;
 }
 
 #ifdef BUILD_BAMDB_WRITER
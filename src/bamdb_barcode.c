@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bamdb_barcode.h"
+
+#define BASE_BITS 2
+#define LENGTH_BITS 5
+#define SUFFIX_SHIFT (BAMDB_MAX_PACKED_BASES * BASE_BITS + LENGTH_BITS)
+#define LENGTH_SHIFT (BAMDB_MAX_PACKED_BASES * BASE_BITS)
+
+static int base_code(char base) {
+  switch (base) {
+    case 'A':
+      return 0;
+    case 'C':
+      return 1;
+    case 'G':
+      return 2;
+    case 'T':
+      return 3;
+    default:
+      return -1;
+  }
+}
+
+bool bamdb_pack_barcode(const char *barcode, uint64_t *packed) {
+  uint64_t bases = 0;
+  uint64_t suffix = 0;
+  size_t len = 0;
+  const char *p = barcode;
+  int code;
+
+  if (strcmp(barcode, "*") == 0) {
+    *packed = 0;
+    return true;
+  }
+
+  for (; *p != '\0' && *p != '-'; ++p) {
+    if (len == BAMDB_MAX_PACKED_BASES || (code = base_code(*p)) < 0) {
+      return false;
+    }
+    bases = (bases << BASE_BITS) | code;
+    ++len;
+  }
+  /* An empty barcode would pack to the missing value */
+  if (len == 0) {
+    return false;
+  }
+
+  if (*p == '-') {
+    /* Suffixes are stored plus one so no suffix sorts first, leading zeros
+     * would not survive the round trip */
+    if (*++p == '\0' || (*p == '0' && p[1] != '\0')) {
+      return false;
+    }
+    for (; *p != '\0'; ++p) {
+      if (*p < '0' || *p > '9') {
+        return false;
+      }
+      suffix = suffix * 10 + (*p - '0');
+      if (suffix > BAMDB_MAX_PACKED_SUFFIX) {
+        return false;
+      }
+    }
+    ++suffix;
+  }
+
+  *packed = (suffix << SUFFIX_SHIFT) | ((uint64_t)len << LENGTH_SHIFT) | bases;
+  return true;
+}
+
+char *bamdb_unpack_barcode(uint64_t packed, char *buffer) {
+  uint64_t suffix = packed >> SUFFIX_SHIFT;
+  size_t len = (packed >> LENGTH_SHIFT) & ((1 << LENGTH_BITS) - 1);
+  size_t shift;
+
+  if (packed == 0) {
+    strcpy(buffer, "*");
+    return buffer;
+  }
+
+  for (size_t i = 0; i < len; ++i) {
+    shift = (len - 1 - i) * BASE_BITS;
+    buffer[i] = "ACGT"[(packed >> shift) & 3];
+  }
+  buffer[len] = '\0';
+
+  if (suffix > 0) {
+    sprintf(buffer + len, "-%u", (unsigned)(suffix - 1));
+  }
+
+  return buffer;
+}
@@ -0,0 +1,189 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bamdb_bloom.h"
+#include "bamdb_status.h"
+
+#define BLOOM_MAGIC "BAMDBBF1"
+#define BLOCK_WORDS 8
+#define BLOCK_BITS (BLOCK_WORDS * 64)
+#define NUM_HASHES 7
+#define MAX_PATH_CHARS 2048
+
+typedef struct bloom_header {
+  char magic[8];
+  uint32_t flags;
+  uint32_t num_hashes;
+  uint64_t num_blocks;
+} bloom_header_t;
+
+struct bamdb_bloom {
+  bloom_header_t *header;
+  uint64_t *blocks;
+  /* Length of the mapping, 0 for a filter in allocated memory */
+  size_t mapped_size;
+};
+
+/* FNV-1a followed by the murmur3 finalizer to spread short keys */
+static uint64_t hash_key(const void *key, size_t key_size) {
+  const unsigned char *bytes = key;
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < key_size; ++i) {
+    h = (h ^ bytes[i]) * 0x100000001b3ULL;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+/* The high half of the hash picks the block and the low half is stepped
+ * through to pick the bits within it */
+static uint64_t *key_block(const bamdb_bloom_t *bloom, uint64_t hash) {
+  return bloom->blocks + (hash >> 32) % bloom->header->num_blocks * BLOCK_WORDS;
+}
+
+void bamdb_bloom_path(char *path, size_t path_size, const char *db_path,
+                      const char *index_name) {
+  snprintf(path, path_size, "%s/%s%s", db_path, index_name,
+           BAMDB_BLOOM_SUFFIX);
+}
+
+bamdb_bloom_t *bamdb_bloom_create(uint64_t num_keys, uint32_t flags) {
+  bamdb_bloom_t *bloom = calloc(1, sizeof(bamdb_bloom_t));
+  uint64_t num_blocks =
+      (num_keys * BAMDB_BLOOM_BITS_PER_KEY + BLOCK_BITS - 1) / BLOCK_BITS;
+
+  if (num_blocks == 0) {
+    num_blocks = 1;
+  }
+
+  bloom->header = calloc(1, sizeof(bloom_header_t) +
+                                num_blocks * BLOCK_WORDS * sizeof(uint64_t));
+  memcpy(bloom->header->magic, BLOOM_MAGIC, sizeof(bloom->header->magic));
+  bloom->header->flags = flags;
+  bloom->header->num_hashes = NUM_HASHES;
+  bloom->header->num_blocks = num_blocks;
+  bloom->blocks = (uint64_t *)(bloom->header + 1);
+
+  return bloom;
+}
+
+void bamdb_bloom_add(bamdb_bloom_t *bloom, const void *key, size_t key_size) {
+  uint64_t hash = hash_key(key, key_size);
+  uint64_t *block = key_block(bloom, hash);
+  uint32_t h = (uint32_t)hash;
+  uint32_t step = (h >> 17) | (h << 15);
+
+  for (uint32_t i = 0; i < bloom->header->num_hashes; ++i) {
+    block[(h % BLOCK_BITS) / 64] |= (uint64_t)1 << (h % 64);
+    h += step;
+  }
+}
+
+bool bamdb_bloom_may_contain(const bamdb_bloom_t *bloom, const void *key,
+                             size_t key_size) {
+  uint64_t hash = hash_key(key, key_size);
+  const uint64_t *block = key_block(bloom, hash);
+  uint32_t h = (uint32_t)hash;
+  uint32_t step = (h >> 17) | (h << 15);
+
+  for (uint32_t i = 0; i < bloom->header->num_hashes; ++i) {
+    if (!(block[(h % BLOCK_BITS) / 64] & ((uint64_t)1 << (h % 64)))) {
+      return false;
+    }
+    h += step;
+  }
+
+  return true;
+}
+
+uint32_t bamdb_bloom_flags(const bamdb_bloom_t *bloom) {
+  return bloom->header->flags;
+}
+
+int bamdb_bloom_write(const bamdb_bloom_t *bloom, const char *path) {
+  char tmp_path[MAX_PATH_CHARS];
+  size_t size = sizeof(bloom_header_t) +
+                bloom->header->num_blocks * BLOCK_WORDS * sizeof(uint64_t);
+  FILE *fp;
+  int rc;
+
+  snprintf(tmp_path, MAX_PATH_CHARS, "%s.tmp", path);
+  if ((fp = fopen(tmp_path, "wb")) == NULL) {
+    fprintf(stderr, "Unable to write %s\n", tmp_path);
+    return BAMDB_DB_ERROR;
+  }
+
+  rc = fwrite(bloom->header, 1, size, fp) == size ? 0 : -1;
+  if (fclose(fp) != 0 || rc != 0 || rename(tmp_path, path) != 0) {
+    fprintf(stderr, "Unable to write %s\n", path);
+    remove(tmp_path);
+    return BAMDB_DB_ERROR;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+bamdb_bloom_t *bamdb_bloom_open(const char *path) {
+  bamdb_bloom_t *bloom;
+  bloom_header_t *header;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(bloom_header_t)) {
+    close(fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  /* A filter that does not look right is ignored rather than trusted */
+  header = map;
+  if (memcmp(header->magic, BLOOM_MAGIC, sizeof(header->magic)) != 0 ||
+      header->num_blocks == 0 ||
+      (size_t)st.st_size != sizeof(bloom_header_t) + header->num_blocks *
+                                                         BLOCK_WORDS *
+                                                         sizeof(uint64_t)) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  bloom = calloc(1, sizeof(bamdb_bloom_t));
+  bloom->header = header;
+  bloom->blocks = (uint64_t *)(header + 1);
+  bloom->mapped_size = st.st_size;
+
+  return bloom;
+}
+
+void bamdb_bloom_destroy(bamdb_bloom_t *bloom) {
+  if (bloom == NULL) {
+    return;
+  }
+
+  if (bloom->mapped_size > 0) {
+    munmap(bloom->header, bloom->mapped_size);
+  } else {
+    free(bloom->header);
+  }
+  free(bloom);
+}
@@ -0,0 +1,263 @@
+#ifdef BUILD_BAMDB_WRITER
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* HTSlib */
+#include "bgzf.h"
+#include "sam.h"
+
+#include "bamdb_chunk.h"
+#include "bamdb_status.h"
+
+/* Compressed bytes searched for a BGZF block header after each cut */
+#define BLOCK_SEARCH_SIZE (2 * BGZF_MAX_BLOCK_SIZE)
+/* Uncompressed bytes used to validate candidate record starts */
+#define RECORD_SEARCH_SIZE (16 * BGZF_MAX_BLOCK_SIZE)
+/* Consecutive records that must parse before a position is accepted */
+#define MIN_VALID_RECORDS 2
+#define MAX_VALID_RECORDS 8
+/* Fixed part of a record following block_size */
+#define BAM_CORE_SIZE 32
+#define BGZF_HEADER_SIZE 18
+
+static int32_t le_int32(const uint8_t *p) {
+  return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                   (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static uint16_t le_uint16(const uint8_t *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+/* A BGZF block is a gzip member with a 'BC' extra field holding its size */
+static bool is_bgzf_header(const uint8_t *p) {
+  return p[0] == 0x1f && p[1] == 0x8b && p[2] == 0x08 && p[3] == 0x04 &&
+         p[10] == 6 && p[11] == 0 && p[12] == 'B' && p[13] == 'C' &&
+         p[14] == 2 && p[15] == 0;
+}
+
+/* Return the compressed offset of the first BGZF block at or after target,
+ * or -1 if there is none */
+static int64_t find_block_start(FILE *fp, int64_t target, int64_t file_size) {
+  uint8_t *buffer = malloc(BLOCK_SEARCH_SIZE + BGZF_HEADER_SIZE);
+  int64_t ret = -1;
+  size_t n;
+
+  if (fseeko(fp, target, SEEK_SET) != 0) {
+    goto exit;
+  }
+  n = fread(buffer, 1, BLOCK_SEARCH_SIZE + BGZF_HEADER_SIZE, fp);
+
+  for (size_t i = 0; i + BGZF_HEADER_SIZE <= n; ++i) {
+    if (!is_bgzf_header(buffer + i)) {
+      continue;
+    }
+
+    /* Confirm by checking that the block is followed by another block or by
+     * the end of the file */
+    int64_t next = target + i + le_uint16(buffer + i + 16) + 1;
+    if (next == file_size) {
+      ret = target + i;
+      break;
+    }
+
+    if (next - target + BGZF_HEADER_SIZE <= (int64_t)n) {
+      if (is_bgzf_header(buffer + (next - target))) {
+        ret = target + i;
+        break;
+      }
+    } else {
+      uint8_t next_header[BGZF_HEADER_SIZE];
+      if (fseeko(fp, next, SEEK_SET) == 0 &&
+          fread(next_header, 1, BGZF_HEADER_SIZE, fp) == BGZF_HEADER_SIZE &&
+          is_bgzf_header(next_header)) {
+        ret = target + i;
+        break;
+      }
+    }
+  }
+
+exit:
+  free(buffer);
+  return ret;
+}
+
+/* Check whether a plausible record starts at data[0]. Returns the record's
+ * total size, 0 if it is not a record and -1 if it does not fit in size. */
+static int64_t check_record(const uint8_t *data, size_t size,
+                            const bam_hdr_t *header) {
+  if (size < 4 + BAM_CORE_SIZE) {
+    return -1;
+  }
+
+  int32_t block_size = le_int32(data);
+  int32_t ref_id = le_int32(data + 4);
+  int32_t pos = le_int32(data + 8);
+  uint8_t l_read_name = data[12];
+  uint16_t n_cigar = le_uint16(data + 16);
+  int32_t l_seq = le_int32(data + 20);
+  int32_t next_ref_id = le_int32(data + 24);
+  int32_t next_pos = le_int32(data + 28);
+
+  if (ref_id < -1 || ref_id >= header->n_targets || next_ref_id < -1 ||
+      next_ref_id >= header->n_targets || pos < -1 || next_pos < -1 ||
+      l_read_name < 1 || l_seq < 0) {
+    return 0;
+  }
+
+  if (ref_id >= 0 && pos > (int64_t)header->target_len[ref_id]) {
+    return 0;
+  }
+
+  int64_t min_size = BAM_CORE_SIZE + l_read_name + 4 * (int64_t)n_cigar +
+                     ((int64_t)l_seq + 1) / 2 + l_seq;
+  if (block_size < min_size) {
+    return 0;
+  }
+
+  if (4 + BAM_CORE_SIZE + (size_t)l_read_name > size) {
+    return -1;
+  }
+
+  /* Read names are NULL terminated printable strings */
+  const uint8_t *read_name = data + 4 + BAM_CORE_SIZE;
+  if (read_name[l_read_name - 1] != '\0') {
+    return 0;
+  }
+  for (int i = 0; i < l_read_name - 1; ++i) {
+    if (read_name[i] < '!' || read_name[i] > '~') {
+      return 0;
+    }
+  }
+
+  return 4 + (int64_t)block_size;
+}
+
+/* Accept a position only if it starts a chain of plausible records */
+static bool is_record_start(const uint8_t *data, size_t size,
+                            const bam_hdr_t *header) {
+  size_t pos = 0;
+  int valid = 0;
+
+  while (valid < MAX_VALID_RECORDS) {
+    int64_t record_size = check_record(data + pos, size - pos, header);
+    if (record_size == 0) {
+      return false;
+    } else if (record_size < 0) {
+      break;
+    }
+
+    valid++;
+    pos += record_size;
+    if (pos >= size) {
+      break;
+    }
+  }
+
+  return valid >= MIN_VALID_RECORDS;
+}
+
+/* Find the first record starting inside the block at block_address */
+static int64_t find_record_start(BGZF *fp, int64_t block_address,
+                                 const bam_hdr_t *header) {
+  uint8_t *buffer = malloc(RECORD_SEARCH_SIZE);
+  int64_t ret = -1;
+  int block_length;
+  ssize_t n;
+
+  if (bgzf_seek(fp, block_address << 16, SEEK_SET) != 0 ||
+      bgzf_read_block(fp) != 0) {
+    goto exit;
+  }
+  block_length = fp->block_length;
+
+  if (bgzf_seek(fp, block_address << 16, SEEK_SET) != 0) {
+    goto exit;
+  }
+  n = bgzf_read(fp, buffer, RECORD_SEARCH_SIZE);
+  if (n <= 0) {
+    goto exit;
+  }
+
+  for (int i = 0; i < block_length && i < n; ++i) {
+    if (is_record_start(buffer + i, n - i, header)) {
+      ret = (block_address << 16) | i;
+      break;
+    }
+  }
+
+exit:
+  free(buffer);
+  return ret;
+}
+
+int bam_find_chunks(const char *input_file_name, size_t num_chunks,
+                    int64_t **starts, size_t *num_starts) {
+  struct stat file_stat;
+  FILE *raw_fp = NULL;
+  BGZF *fp = NULL;
+  bam_hdr_t *header = NULL;
+  int ret = BAMDB_SUCCESS;
+
+  *starts = calloc(num_chunks > 0 ? num_chunks : 1, sizeof(int64_t));
+  *num_starts = 0;
+
+  if (stat(input_file_name, &file_stat) != 0 ||
+      (raw_fp = fopen(input_file_name, "rb")) == NULL ||
+      (fp = bgzf_open(input_file_name, "r")) == NULL) {
+    fprintf(stderr, "Unable to open file %s\n", input_file_name);
+    ret = BAMDB_SEQUENCE_FILE_ERROR;
+    goto exit;
+  }
+
+  /* The first chunk starts after the header */
+  header = bam_hdr_read(fp);
+  if (header == NULL) {
+    fprintf(stderr, "Unable to read the header from %s\n", input_file_name);
+    ret = BAMDB_SEQUENCE_FILE_ERROR;
+    goto exit;
+  }
+  (*starts)[(*num_starts)++] = bgzf_tell(fp);
+
+  for (size_t i = 1; i < num_chunks; ++i) {
+    int64_t target = (int64_t)file_stat.st_size * i / num_chunks;
+    int64_t previous = (*starts)[*num_starts - 1];
+    int64_t block_address;
+    int64_t start;
+
+    /* Never cut inside the block the previous chunk starts in */
+    if (target <= previous >> 16) {
+      target = (previous >> 16) + 1;
+    }
+
+    block_address = find_block_start(raw_fp, target, file_stat.st_size);
+    if (block_address < 0) {
+      break;
+    }
+
+    start = find_record_start(fp, block_address, header);
+    /* Small files or very long records can leave fewer useful cuts */
+    if (start > previous) {
+      (*starts)[(*num_starts)++] = start;
+    }
+  }
+
+exit:
+  if (header != NULL) {
+    bam_hdr_destroy(header);
+  }
+  if (fp != NULL) {
+    bgzf_close(fp);
+  }
+  if (raw_fp != NULL) {
+    fclose(raw_fp);
+  }
+
+  return ret;
+}
+
+#endif
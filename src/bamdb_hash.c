@@ -0,0 +1,521 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bamdb_hash.h"
+#include "bamdb_status.h"
+
+#define HASH_MAGIC "BAMDBPH1"
+#define MAX_PATH_CHARS 2048
+/* Average number of keys per bucket, each bucket costs a 4 byte pilot */
+#define KEYS_PER_BUCKET 4
+/* One spare table position per this many keys keeps the last buckets cheap
+ * to place */
+#define KEYS_PER_SPARE_POSITION 99
+/* Pilots tried per bucket before starting over with another seed */
+#define MAX_PILOT (1 << 20)
+#define MAX_SEEDS 16
+#define GOLDEN_RATIO 0x9e3779b97f4a7c15ULL
+
+typedef struct hash_header {
+  char magic[8];
+  uint32_t seed;
+  uint32_t flags;
+  uint64_t num_keys;
+  /* Positions of the hash function, the ones from num_keys on are remapped
+   * to free positions below it */
+  uint64_t table_size;
+  uint64_t num_buckets;
+  uint64_t num_overflow;
+} hash_header_t;
+
+typedef struct hash_slot {
+  uint32_t fingerprint;
+  uint32_t num_offsets;
+  /* The offset itself for keys with a single offset, otherwise the position
+   * of the first offset in the overflow area */
+  int64_t offset;
+} hash_slot_t;
+
+/* File positions of the parts of a hash, in the order they are stored */
+typedef struct hash_layout {
+  uint64_t pilots;
+  uint64_t remap;
+  uint64_t slots;
+  uint64_t overflow;
+  uint64_t end;
+} hash_layout_t;
+
+struct bamdb_hash_builder {
+  /* Two hashes per added key, freed once the hash function is found */
+  uint64_t *key_hashes;
+  size_t num_keys;
+  size_t capacity;
+  hash_header_t header;
+  uint32_t *pilots;
+  uint64_t *remap;
+  hash_slot_t *slots;
+  FILE *fp;
+  char path[MAX_PATH_CHARS];
+  char tmp_path[MAX_PATH_CHARS];
+};
+
+struct bamdb_hash {
+  const hash_header_t *header;
+  const uint32_t *pilots;
+  const uint64_t *remap;
+  const hash_slot_t *slots;
+  const int64_t *overflow;
+  size_t mapped_size;
+};
+
+static uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+/* Two FNV-1a hashes of a key with different bases and primes */
+static void hash_key(const void *key, size_t key_size, uint64_t hashes[2]) {
+  const unsigned char *bytes = key;
+  uint64_t a = 0xcbf29ce484222325ULL;
+  uint64_t b = 0x84222325cbf29ce4ULL;
+
+  for (size_t i = 0; i < key_size; ++i) {
+    a = (a ^ bytes[i]) * 0x100000001b3ULL;
+    b = (b ^ bytes[i]) * GOLDEN_RATIO;
+  }
+
+  hashes[0] = mix64(a);
+  hashes[1] = mix64(b);
+}
+
+/* The bucket and fingerprint of a key come from a, its position from b */
+static void seed_hashes(const uint64_t hashes[2], uint32_t seed, uint64_t *a,
+                        uint64_t *b) {
+  *a = mix64(hashes[0] + seed * GOLDEN_RATIO);
+  *b = mix64(hashes[1] + seed * GOLDEN_RATIO);
+}
+
+static uint64_t bucket_of(uint64_t a, uint64_t num_buckets) {
+  return ((a & 0xffffffff) * num_buckets) >> 32;
+}
+
+static uint64_t pilot_mix(uint32_t pilot) {
+  return mix64(pilot + GOLDEN_RATIO);
+}
+
+/* Slot of a key and its fingerprint */
+static uint64_t slot_of(const hash_header_t *header, const uint32_t *pilots,
+                        const uint64_t *remap, const uint64_t hashes[2],
+                        uint32_t *fingerprint) {
+  uint64_t a, b, pos;
+
+  seed_hashes(hashes, header->seed, &a, &b);
+  pos = (b ^ pilot_mix(pilots[bucket_of(a, header->num_buckets)])) %
+        header->table_size;
+  if (pos >= header->num_keys) {
+    pos = remap[pos - header->num_keys];
+  }
+
+  *fingerprint = (uint32_t)(a >> 32);
+  return pos;
+}
+
+static void get_layout(const hash_header_t *header, hash_layout_t *layout) {
+  uint64_t pilots_size = header->num_buckets * sizeof(uint32_t);
+
+  layout->pilots = sizeof(hash_header_t);
+  /* Keep the arrays after the pilots 8 byte aligned */
+  layout->remap = layout->pilots + (pilots_size + 7) / 8 * 8;
+  layout->slots = layout->remap + (header->table_size - header->num_keys) *
+                                      sizeof(uint64_t);
+  layout->overflow = layout->slots + header->num_keys * sizeof(hash_slot_t);
+  layout->end = layout->overflow + header->num_overflow * sizeof(int64_t);
+}
+
+void bamdb_hash_path(char *path, size_t path_size, const char *db_path,
+                     const char *index_name) {
+  snprintf(path, path_size, "%s/%s%s", db_path, index_name,
+           BAMDB_HASH_SUFFIX);
+}
+
+bamdb_hash_builder_t *bamdb_hash_create(void) {
+  bamdb_hash_builder_t *builder = calloc(1, sizeof(bamdb_hash_builder_t));
+
+  memcpy(builder->header.magic, HASH_MAGIC, sizeof(builder->header.magic));
+  return builder;
+}
+
+void bamdb_hash_add_key(bamdb_hash_builder_t *builder, const void *key,
+                        size_t key_size) {
+  if (builder->num_keys == builder->capacity) {
+    builder->capacity = builder->capacity > 0 ? builder->capacity * 2 : 1024;
+    builder->key_hashes = realloc(builder->key_hashes,
+                                  2 * builder->capacity * sizeof(uint64_t));
+  }
+
+  hash_key(key, key_size, builder->key_hashes + 2 * builder->num_keys++);
+}
+
+#define IS_TAKEN(bits, pos) ((bits)[(pos) / 64] & ((uint64_t)1 << ((pos) % 64)))
+
+/* Give every bucket a pilot under the seed of the header, largest buckets
+ * first. Fails if some bucket cannot be placed, which only happens with keys
+ * that share both hashes. */
+static bool find_pilots(bamdb_hash_builder_t *builder) {
+  hash_header_t *header = &builder->header;
+  uint64_t n = header->num_keys;
+  uint64_t m = header->table_size;
+  uint64_t num_buckets = header->num_buckets;
+  uint64_t *bucket_start = calloc(num_buckets + 2, sizeof(uint64_t));
+  uint64_t *bucket_keys = malloc((n + 1) * sizeof(uint64_t));
+  uint64_t *order = malloc(num_buckets * sizeof(uint64_t));
+  uint64_t *taken = calloc(m / 64 + 1, sizeof(uint64_t));
+  uint64_t *size_start = NULL;
+  uint64_t *key_b = NULL;
+  uint64_t *positions = NULL;
+  uint64_t max_size = 0;
+  uint64_t a, b, size, mix, running, hole;
+  uint32_t pilot;
+  size_t j, k;
+  bool placed = false;
+
+  /* Group the keys by bucket, bucket i holds bucket_keys from
+   * bucket_start[i] to bucket_start[i + 1] */
+  for (size_t i = 0; i < n; ++i) {
+    seed_hashes(builder->key_hashes + 2 * i, header->seed, &a, &b);
+    bucket_start[bucket_of(a, num_buckets) + 2]++;
+  }
+  for (size_t i = 2; i < num_buckets + 2; ++i) {
+    bucket_start[i] += bucket_start[i - 1];
+  }
+  for (size_t i = 0; i < n; ++i) {
+    seed_hashes(builder->key_hashes + 2 * i, header->seed, &a, &b);
+    bucket_keys[bucket_start[bucket_of(a, num_buckets) + 1]++] = i;
+  }
+
+  for (size_t i = 0; i < num_buckets; ++i) {
+    size = bucket_start[i + 1] - bucket_start[i];
+    max_size = size > max_size ? size : max_size;
+  }
+
+  /* Order the buckets by size, largest first */
+  size_start = calloc(max_size + 1, sizeof(uint64_t));
+  for (size_t i = 0; i < num_buckets; ++i) {
+    size_start[bucket_start[i + 1] - bucket_start[i]]++;
+  }
+  running = 0;
+  for (size_t s = max_size + 1; s-- > 0;) {
+    size = size_start[s];
+    size_start[s] = running;
+    running += size;
+  }
+  for (size_t i = 0; i < num_buckets; ++i) {
+    order[size_start[bucket_start[i + 1] - bucket_start[i]]++] = i;
+  }
+
+  key_b = malloc((max_size + 1) * sizeof(uint64_t));
+  positions = malloc((max_size + 1) * sizeof(uint64_t));
+  for (size_t i = 0; i < num_buckets; ++i) {
+    uint64_t bucket = order[i];
+    const uint64_t *keys = bucket_keys + bucket_start[bucket];
+
+    size = bucket_start[bucket + 1] - bucket_start[bucket];
+    if (size == 0) {
+      break;
+    }
+    for (j = 0; j < size; ++j) {
+      seed_hashes(builder->key_hashes + 2 * keys[j], header->seed, &a,
+                  &key_b[j]);
+    }
+
+    for (pilot = 0; pilot < MAX_PILOT; ++pilot) {
+      mix = pilot_mix(pilot);
+      for (j = 0; j < size; ++j) {
+        positions[j] = (key_b[j] ^ mix) % m;
+        if (IS_TAKEN(taken, positions[j])) {
+          break;
+        }
+        for (k = 0; k < j && positions[k] != positions[j]; ++k) {
+        }
+        if (k < j) {
+          break;
+        }
+      }
+      if (j == size) {
+        break;
+      }
+    }
+    if (pilot == MAX_PILOT) {
+      goto exit;
+    }
+
+    builder->pilots[bucket] = pilot;
+    for (j = 0; j < size; ++j) {
+      taken[positions[j] / 64] |= (uint64_t)1 << (positions[j] % 64);
+    }
+  }
+
+  /* Exactly as many keys land past n as positions below n are left free */
+  hole = 0;
+  for (uint64_t pos = n; pos < m; ++pos) {
+    if (!IS_TAKEN(taken, pos)) {
+      builder->remap[pos - n] = 0;
+      continue;
+    }
+    while (IS_TAKEN(taken, hole)) {
+      ++hole;
+    }
+    builder->remap[pos - n] = hole++;
+  }
+  placed = true;
+
+exit:
+  free(bucket_start);
+  free(bucket_keys);
+  free(order);
+  free(taken);
+  free(size_start);
+  free(key_b);
+  free(positions);
+  return placed;
+}
+
+int bamdb_hash_build(bamdb_hash_builder_t *builder, const char *path) {
+  hash_header_t *header = &builder->header;
+  hash_layout_t layout;
+  uint64_t n = builder->num_keys;
+
+  header->num_keys = n;
+  header->table_size = n + n / KEYS_PER_SPARE_POSITION + 1;
+  header->num_buckets = n / KEYS_PER_BUCKET + 1;
+  builder->pilots = calloc(header->num_buckets, sizeof(uint32_t));
+  builder->remap = calloc(header->table_size - n, sizeof(uint64_t));
+  builder->slots = calloc(n + 1, sizeof(hash_slot_t));
+
+  for (header->seed = 0; header->seed < MAX_SEEDS; ++header->seed) {
+    if (find_pilots(builder)) {
+      break;
+    }
+  }
+  if (header->seed == MAX_SEEDS) {
+    fprintf(stderr, "Unable to find a perfect hash of %" PRIu64 " keys\n", n);
+    return BAMDB_INTERNAL_ERROR;
+  }
+  free(builder->key_hashes);
+  builder->key_hashes = NULL;
+
+  snprintf(builder->path, MAX_PATH_CHARS, "%s", path);
+  snprintf(builder->tmp_path, MAX_PATH_CHARS, "%s.tmp", path);
+  if ((builder->fp = fopen(builder->tmp_path, "wb")) == NULL) {
+    fprintf(stderr, "Unable to write %s\n", builder->tmp_path);
+    return BAMDB_DB_ERROR;
+  }
+
+  /* Offsets of keys with several of them are written as they come, the
+   * parts in front are written once every slot is filled */
+  get_layout(header, &layout);
+  if (fseek(builder->fp, layout.overflow, SEEK_SET) != 0) {
+    fprintf(stderr, "Unable to write %s\n", builder->tmp_path);
+    return BAMDB_DB_ERROR;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+int bamdb_hash_set(bamdb_hash_builder_t *builder, const void *key,
+                   size_t key_size, const int64_t *offsets,
+                   size_t num_offsets) {
+  hash_slot_t *slot;
+  uint64_t hashes[2];
+  uint32_t fingerprint;
+
+  hash_key(key, key_size, hashes);
+  slot = &builder->slots[slot_of(&builder->header, builder->pilots,
+                                 builder->remap, hashes, &fingerprint)];
+  if (slot->num_offsets != 0 || num_offsets > UINT32_MAX) {
+    fprintf(stderr, "Unable to store %.*s in %s\n", (int)key_size,
+            (const char *)key, builder->path);
+    return BAMDB_INTERNAL_ERROR;
+  }
+
+  slot->fingerprint = fingerprint;
+  slot->num_offsets = (uint32_t)num_offsets;
+  if (num_offsets == 1) {
+    slot->offset = offsets[0];
+    return BAMDB_SUCCESS;
+  }
+
+  slot->offset = (int64_t)builder->header.num_overflow;
+  builder->header.num_overflow += num_offsets;
+  if (fwrite(offsets, sizeof(int64_t), num_offsets, builder->fp) !=
+      num_offsets) {
+    fprintf(stderr, "Unable to write %s\n", builder->tmp_path);
+    return BAMDB_DB_ERROR;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+static void free_builder(bamdb_hash_builder_t *builder) {
+  free(builder->key_hashes);
+  free(builder->pilots);
+  free(builder->remap);
+  free(builder->slots);
+  free(builder);
+}
+
+int bamdb_hash_finish(bamdb_hash_builder_t *builder) {
+  static const unsigned char padding[sizeof(uint64_t)] = {0};
+  hash_header_t *header = &builder->header;
+  hash_layout_t layout;
+  size_t padding_size;
+  size_t num_remap = header->table_size - header->num_keys;
+  int rc;
+
+  get_layout(header, &layout);
+  padding_size = layout.remap - layout.pilots -
+                 header->num_buckets * sizeof(uint32_t);
+
+  rc = fseek(builder->fp, 0, SEEK_SET) == 0 &&
+               fwrite(header, sizeof(hash_header_t), 1, builder->fp) == 1 &&
+               fwrite(builder->pilots, sizeof(uint32_t), header->num_buckets,
+                      builder->fp) == header->num_buckets &&
+               fwrite(padding, 1, padding_size, builder->fp) ==
+                   padding_size &&
+               fwrite(builder->remap, sizeof(uint64_t), num_remap,
+                      builder->fp) == num_remap &&
+               fwrite(builder->slots, sizeof(hash_slot_t), header->num_keys,
+                      builder->fp) == header->num_keys
+           ? 0
+           : -1;
+  if (fclose(builder->fp) != 0 || rc != 0 ||
+      rename(builder->tmp_path, builder->path) != 0) {
+    fprintf(stderr, "Unable to write %s\n", builder->path);
+    remove(builder->tmp_path);
+    free_builder(builder);
+    return BAMDB_DB_ERROR;
+  }
+
+  free_builder(builder);
+  return BAMDB_SUCCESS;
+}
+
+void bamdb_hash_discard(bamdb_hash_builder_t *builder) {
+  if (builder == NULL) {
+    return;
+  }
+
+  if (builder->fp != NULL) {
+    fclose(builder->fp);
+    remove(builder->tmp_path);
+  }
+  free_builder(builder);
+}
+
+bamdb_hash_t *bamdb_hash_open(const char *path) {
+  bamdb_hash_t *hash;
+  hash_header_t *header;
+  hash_layout_t layout;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    /* Only hashed indices have one */
+    if (errno != ENOENT) {
+      fprintf(stderr, "Unable to open %s\n", path);
+    }
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(hash_header_t)) {
+    fprintf(stderr, "%s is not a valid hash\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %s\n", path);
+    return NULL;
+  }
+
+  header = map;
+  get_layout(header, &layout);
+  if (memcmp(header->magic, HASH_MAGIC, sizeof(header->magic)) != 0 ||
+      header->table_size <= header->num_keys || header->num_buckets == 0 ||
+      (uint64_t)st.st_size != layout.end) {
+    fprintf(stderr, "%s is not a valid hash\n", path);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  hash = calloc(1, sizeof(bamdb_hash_t));
+  hash->header = header;
+  hash->pilots = (const uint32_t *)((const char *)map + layout.pilots);
+  hash->remap = (const uint64_t *)((const char *)map + layout.remap);
+  hash->slots = (const hash_slot_t *)((const char *)map + layout.slots);
+  hash->overflow = (const int64_t *)((const char *)map + layout.overflow);
+  hash->mapped_size = st.st_size;
+
+  return hash;
+}
+
+void bamdb_hash_close(bamdb_hash_t *hash) {
+  if (hash == NULL) {
+    return;
+  }
+
+  munmap((void *)hash->header, hash->mapped_size);
+  free(hash);
+}
+
+size_t bamdb_hash_lookup(const bamdb_hash_t *hash, const void *key,
+                         size_t key_size, const int64_t **offsets) {
+  const hash_slot_t *slot;
+  uint64_t hashes[2];
+  uint64_t pos;
+  uint32_t fingerprint;
+
+  if (hash->header->num_keys == 0) {
+    return 0;
+  }
+
+  hash_key(key, key_size, hashes);
+  pos = slot_of(hash->header, hash->pilots, hash->remap, hashes,
+                &fingerprint);
+  /* A remap entry of a corrupt file could point anywhere */
+  if (pos >= hash->header->num_keys) {
+    return 0;
+  }
+
+  slot = &hash->slots[pos];
+  if (slot->num_offsets == 0 || slot->fingerprint != fingerprint) {
+    return 0;
+  }
+
+  if (slot->num_offsets == 1) {
+    *offsets = &slot->offset;
+  } else {
+    if ((uint64_t)slot->offset + slot->num_offsets >
+        hash->header->num_overflow) {
+      return 0;
+    }
+    *offsets = hash->overflow + slot->offset;
+  }
+
+  return slot->num_offsets;
+}
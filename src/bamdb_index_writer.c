@@ -4,13 +4,12 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
-#include <unistd.h>
 
 /* TODO: Finish abstracting away the dabase interactions */
 #include <lmdb.h>
 
-#include <ck_fifo.h>
 #include <ck_pr.h>
 
 /* HTSLib includes */
@@ -18,264 +17,1968 @@
 #include "hts.h"
 
 #include "bam_api.h"
+#include "bamdb_barcode.h"
+#include "bamdb_bloom.h"
+#include "bamdb_chunk.h"
+#include "bamdb_hash.h"
 #include "bamdb_index_writer.h"
+#include "bamdb_key.h"
 #include "bamdb_lmdb.h"
+#include "bamdb_meta.h"
+#include "bamdb_postings.h"
+#include "bamdb_queue.h"
+#include "bamdb_sort.h"
+#include "bamdb_stats.h"
 #include "bamdb_status.h"
+#include "bamdb_table.h"
 
 /* How many rows to write before forcing a database commit */
 #define DB_COMMIT_FREQ 500000
-#define MAX_DESERIALIZE_QUEUE_SIZE 16384
-#define MAX_WRITE_QUEUE_SIZE 16384
 #define MAX_PATH_CHARS 2048
 
-typedef struct _bam_data {
-  bam1_t *bam_row;
-  int64_t voffset;
-} bam_data_t;
-
-typedef struct write_entry {
-  char *key;
-  int64_t voffset;
-} write_entry_t;
-
+/* Rows move between pipeline stages in batches. Batches are preallocated and
+ * recycled through free pools, which also bounds how much data is in flight:
+ * a stage blocks when its pool runs dry. */
+#define ROW_BATCH_SIZE 4096
+#define ROW_BATCHES_PER_THREAD 4
+#define WRITE_BATCHES_PER_INDEX 4
+/* Initial key storage per write batch, grown as needed and then kept */
+#define INIT_KEY_ARENA_SIZE (ROW_BATCH_SIZE * 32)
+/* Lower bound on each chunk's share of the sort buffer in chunked builds */
+#define MIN_CHUNK_SORT_BUFFER_SIZE (16 * 1024 * 1024)
+
+typedef struct row_batch {
+  size_t num_rows;
+  bam1_t *rows[ROW_BATCH_SIZE];
+  int64_t voffsets[ROW_BATCH_SIZE];
+  /* Where the row after the batch starts and rows read up to there */
+  int64_t end_voffset;
+  uint64_t end_row;
+} row_batch_t;
+
+typedef struct write_batch {
+  size_t num_entries;
+  int64_t voffsets[ROW_BATCH_SIZE];
+  uint32_t key_offsets[ROW_BATCH_SIZE];
+  uint32_t key_sizes[ROW_BATCH_SIZE];
+  /* All keys of the batch back to back, each NULL terminated */
+  char *keys;
+  size_t keys_used;
+  size_t keys_capacity;
+  /* Taken from the row batch, which may hold rows without an entry */
+  int64_t end_voffset;
+  uint64_t end_row;
+  /* Free pool the batch goes back to once written */
+  bamdb_queue_t *pool;
+} write_batch_t;
+
+/* Each index has one queue per deserialize thread. Rows are dealt to the
+ * deserialize threads round-robin and the writer drains the queues in the same
+ * order, so every index still sees the rows in file order. */
 typedef struct writer_q {
   char *key;
-  ck_fifo_mpmc_t *write_q;
+  bool packed;
+  /* Rows left out because their value cannot be stored in this index */
+  uint64_t num_skipped;
+  size_t num_queues;
+  bamdb_queue_t **write_qs;
 } writer_q_t;
 
+/* A bamdb_row_filter_t with its contigs resolved against the header */
+typedef struct row_filter {
+  const bamdb_row_filter_t *spec;
+  /* Indexed by reference id, NULL to keep rows on any reference */
+  bool *keep_contig;
+  int32_t num_targets;
+} row_filter_t;
+
 typedef struct _deserialize_thread_data {
   bam_hdr_t *header;
+  size_t thread_id;
+  bamdb_queue_t *read_q;
+  bamdb_queue_t *row_pool;
+  bamdb_queue_t *write_pool;
   size_t num_keys;
   writer_q_t **write_queues;
 } deserialize_thread_data_t;
 
+/* Shared by the writers of a pipelined build. Each writer reports how far into
+ * the file it has committed, every row before the earliest of those is durable
+ * in all indices and the build can be resumed from there. */
+typedef struct checkpoint {
+  pthread_mutex_t lock;
+  char *db_path;
+  size_t num_writers;
+  /* Voffset after the last committed batch and rows read up to it per
+   * writer, -1 before the first commit */
+  int64_t *voffsets;
+  uint64_t *num_rows;
+  /* Rows indexed by earlier runs */
+  uint64_t base_rows;
+  /* Fingerprint and indices of the build, end_voffset and num_rows hold the
+   * last checkpoint written */
+  bamdb_meta_t meta;
+} checkpoint_t;
+
 typedef struct _writer_thread_data {
-  ck_fifo_mpmc_t *write_q;
+  writer_q_t *queue;
   char *key_name;
   char *db_path;
+  /* Only set for sorted builds */
+  bamdb_sorter_t *sorter;
+  /* Whether the sorted pairs can be appended, i.e. the index starts empty */
+  bool append;
+  /* Write the sorted pairs to a table instead of LMDB */
+  bool table;
+  /* Write the sorted pairs to a minimal perfect hash, takes precedence over
+   * table */
+  bool hash;
+  /* Only set for unsorted builds, which commit as they go */
+  checkpoint_t *checkpoint;
+  size_t writer_id;
+  int ret;
 } writer_thread_data_t;
 
-ck_fifo_mpmc_t *deserialize_q;
-
-int reader_running;
-int deserialize_running;
+typedef struct _chunk_thread_data {
+  const char *input_file_name;
+  int64_t start;
+  /* Start of the next chunk or -1 for the end of the file */
+  int64_t end;
+  /* Starts of every later chunk. When the next start turns out not to be a
+   * record boundary the chunk reads on to the one after, dropping the chunk
+   * in between. */
+  const int64_t *later_starts;
+  size_t num_later_starts;
+  size_t num_dropped;
+  /* Set once an earlier chunk read this one's rows instead */
+  bool dropped;
+  size_t num_keys;
+  char **keys;
+  /* One per key */
+  bool *packed;
+  bamdb_sorter_t **sorters;
+  const bamdb_row_filter_t *row_filter;
+  /* Rows indexed and rows left out by the row filter */
+  uint64_t num_rows;
+  uint64_t num_filtered;
+  uint64_t num_skipped;
+  /* Voffset the chunk stopped at */
+  int64_t end_voffset;
+  int ret;
+} chunk_thread_data_t;
+
+typedef struct _loader_thread_data {
+  char *db_path;
+  char *key_name;
+  bool packed;
+  bool table;
+  bool hash;
+  bamdb_sorter_t **sorters;
+  size_t num_sorters;
+  int ret;
+} loader_thread_data_t;
+
+typedef struct _bulk_load_state {
+  MDB_env *env;
+  const char *db_name;
+  MDB_txn *txn;
+  MDB_dbi dbi;
+  MDB_cursor *cur;
+  /* MDB_DUPFIXED unless the index holds compressed postings, MDB_INTEGERKEY
+   * for packed indices */
+  unsigned int db_flags;
+  /* Whether packed keys arrive in their big-endian sort form */
+  bool packed;
+  bool append;
+  uint64_t n;
+} bulk_load_state_t;
+
+/* Gathers the offsets of each key of a merge for a table or hash */
+typedef struct _key_load_state {
+  /* Called with every key and its offsets in ascending order */
+  int (*add_key)(struct _key_load_state *state);
+  bamdb_table_writer_t *writer;
+  bamdb_hash_builder_t *hash;
+  /* Only set while the hash is filled */
+  bamdb_index_stats_t *stats;
+  /* Key whose offsets are being gathered */
+  unsigned char key[BAMDB_MAX_KEY_SIZE];
+  size_t key_size;
+  int64_t *offsets;
+  size_t num_offsets;
+  size_t capacity;
+  uint64_t n;
+} key_load_state_t;
+
+/* Only used for progress reporting, counted in batches */
 int write_queue_size;
 int deserialize_queue_size;
 
+static row_batch_t *init_row_batch(void) {
+  row_batch_t *batch = malloc(sizeof(row_batch_t));
+
+  batch->num_rows = 0;
+  for (size_t i = 0; i < ROW_BATCH_SIZE; ++i) {
+    batch->rows[i] = bam_init1();
+  }
+
+  return batch;
+}
+
+static void destroy_row_batch(row_batch_t *batch) {
+  for (size_t i = 0; i < ROW_BATCH_SIZE; ++i) {
+    bam_destroy1(batch->rows[i]);
+  }
+  free(batch);
+}
+
+static write_batch_t *init_write_batch(bamdb_queue_t *pool) {
+  write_batch_t *batch = malloc(sizeof(write_batch_t));
+
+  batch->num_entries = 0;
+  batch->keys_used = 0;
+  batch->keys_capacity = INIT_KEY_ARENA_SIZE;
+  batch->keys = malloc(batch->keys_capacity);
+  batch->pool = pool;
+
+  return batch;
+}
+
+static void destroy_write_batch(write_batch_t *batch) {
+  free(batch->keys);
+  free(batch);
+}
+
+static void write_batch_add(write_batch_t *batch, const char *key,
+                            size_t key_size, int64_t voffset) {
+  size_t i = batch->num_entries++;
+
+  if (batch->keys_used + key_size + 1 > batch->keys_capacity) {
+    while (batch->keys_used + key_size + 1 > batch->keys_capacity) {
+      batch->keys_capacity *= 2;
+    }
+    batch->keys = realloc(batch->keys, batch->keys_capacity);
+  }
+
+  memcpy(batch->keys + batch->keys_used, key, key_size);
+  batch->keys[batch->keys_used + key_size] = '\0';
+
+  batch->voffsets[i] = voffset;
+  batch->key_offsets[i] = batch->keys_used;
+  batch->key_sizes[i] = key_size;
+  batch->keys_used += key_size + 1;
+}
+
+/* Close a pool and free every batch in it */
+static void destroy_row_pool(bamdb_queue_t *pool) {
+  row_batch_t *batch;
+
+  if (pool == NULL) {
+    return;
+  }
+
+  bamdb_queue_close(pool);
+  while (bamdb_queue_pop(pool, (void **)&batch)) {
+    destroy_row_batch(batch);
+  }
+  bamdb_queue_destroy(pool);
+}
+
+static void destroy_write_pool(bamdb_queue_t *pool) {
+  write_batch_t *batch;
+
+  if (pool == NULL) {
+    return;
+  }
+
+  bamdb_queue_close(pool);
+  while (bamdb_queue_pop(pool, (void **)&batch)) {
+    destroy_write_batch(batch);
+  }
+  bamdb_queue_destroy(pool);
+}
+
+static bool is_valid_field(const char *field) {
+  return strlen(field) == 2 || bamdb_key_type(field) != BAMDB_KEY_STRING ||
+         strncmp("QNAME", field, 5) == 0 || strcmp("RNAME", field) == 0;
+}
+
+static bool is_valid_index_key(const char *key) {
+  char field[BAMDB_MAX_FIELD_CHARS];
+
+  if (bamdb_key_type(key) != BAMDB_KEY_COMPOSITE) {
+    return is_valid_field(key);
+  }
+
+  /* Region keys only make sense on their own */
+  while (key != NULL) {
+    key = bamdb_next_field(key, field);
+    if (!is_valid_field(field) ||
+        bamdb_key_type(field) == BAMDB_KEY_REGION) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool is_packed_index(const bamdb_indices_t *target_indices, size_t i) {
+  return target_indices->packed_key_indices != NULL &&
+         target_indices->packed_key_indices[i];
+}
+
+static bool is_hashed_index(const bamdb_indices_t *target_indices,
+                            const char *key) {
+  return target_indices->hash_qname && strcmp(key, "QNAME") == 0;
+}
+
+static bool is_row_filter_set(const bamdb_row_filter_t *spec) {
+  return spec->require_flags != 0 || spec->exclude_flags != 0 ||
+         spec->min_mapq != 0 || spec->num_contigs > 0;
+}
+
+/* Text the metadata records a row filter as, NULL if it keeps every row */
+static char *describe_row_filter(const bamdb_row_filter_t *spec) {
+  size_t size = 64;
+  size_t used;
+  char *text;
+
+  if (!is_row_filter_set(spec)) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < spec->num_contigs; ++i) {
+    size += strlen(spec->contigs[i]) + 1;
+  }
+  text = malloc(size);
+  used = snprintf(text, size, "require 0x%x exclude 0x%x min_mapq %u",
+                  spec->require_flags, spec->exclude_flags, spec->min_mapq);
+  if (spec->num_contigs > 0) {
+    used += snprintf(text + used, size - used, " contigs");
+  }
+  for (size_t i = 0; i < spec->num_contigs; ++i) {
+    used += snprintf(text + used, size - used, " %s", spec->contigs[i]);
+  }
+
+  return text;
+}
+
+/* Resolve the contigs of a row filter against the header of the file */
+static int init_row_filter(row_filter_t *filter,
+                           const bamdb_row_filter_t *spec,
+                           const bam_hdr_t *header) {
+  int32_t tid;
+
+  filter->spec = spec;
+  filter->keep_contig = NULL;
+  filter->num_targets = header->n_targets;
+  if (spec->num_contigs == 0) {
+    return BAMDB_SUCCESS;
+  }
+
+  filter->keep_contig = calloc(header->n_targets + 1, sizeof(bool));
+  for (size_t i = 0; i < spec->num_contigs; ++i) {
+    for (tid = 0; tid < header->n_targets &&
+                  strcmp(header->target_name[tid], spec->contigs[i]) != 0;
+         ++tid) {
+    }
+    if (tid == header->n_targets) {
+      fprintf(stderr, "Reference %s is not in the header\n",
+              spec->contigs[i]);
+      free(filter->keep_contig);
+      filter->keep_contig = NULL;
+      return BAMDB_SEQUENCE_FILE_ERROR;
+    }
+    filter->keep_contig[tid] = true;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+static void destroy_row_filter(row_filter_t *filter) {
+  free(filter->keep_contig);
+  filter->keep_contig = NULL;
+}
+
+/* Whether a row passes the filter, from its fixed fields alone */
+static bool keep_row(const row_filter_t *filter, const bam1_t *row) {
+  const bamdb_row_filter_t *spec = filter->spec;
+
+  if ((row->core.flag & spec->require_flags) != spec->require_flags ||
+      (row->core.flag & spec->exclude_flags) != 0 ||
+      row->core.qual < spec->min_mapq) {
+    return false;
+  }
+
+  return filter->keep_contig == NULL ||
+         (row->core.tid >= 0 && row->core.tid < filter->num_targets &&
+          filter->keep_contig[row->core.tid]);
+}
+
+/* Point value at the value of one field of a row and store its size, without
+ * the terminator of strings. The value is either stored in out or left where
+ * it is in the row or header. Returns false if the row has no value that can
+ * be stored in the field. */
+static bool extract_field(const bam1_t *row, const bam_hdr_t *header,
+                          const char *field, char *out, const char **value,
+                          size_t *value_size) {
+  int64_t int_value;
+  double float_value;
+
+  *value = out;
+  switch (bamdb_key_type(field)) {
+    case BAMDB_KEY_INT:
+      if (!bam_int_key(row, field, &int_value)) {
+        return false;
+      }
+      bamdb_encode_int_key(int_value, out);
+      *value_size = BAMDB_TYPED_KEY_SIZE;
+      return true;
+    case BAMDB_KEY_FLOAT:
+      if (!bam_float_key(row, field, &float_value)) {
+        return false;
+      }
+      bamdb_encode_float_key(float_value, out);
+      *value_size = BAMDB_TYPED_KEY_SIZE;
+      return true;
+    case BAMDB_KEY_REGION:
+      /* Unplaced reads cannot overlap any region */
+      if (row->core.tid < 0 || row->core.pos < 0) {
+        return false;
+      }
+      bamdb_encode_region_key(
+          row->core.tid, bamdb_region_bin(row->core.pos, bam_endpos(row)),
+          row->core.pos, bam_endpos(row), out);
+      *value_size = BAMDB_REGION_KEY_SIZE;
+      return true;
+    case BAMDB_KEY_COMPOSITE:
+      return false;
+    case BAMDB_KEY_STRING:
+      break;
+  }
+
+  if (strncmp(field, "QNAME", 5) == 0) {
+    *value = bam_get_qname(row);
+  } else if (strcmp(field, "RNAME") == 0) {
+    *value = bam_get_rname(row, header);
+  } else {
+    *value = bam_str_key(row, field, out);
+  }
+
+  *value_size = strlen(*value);
+  return true;
+}
+
+/* Point key at the index value of a row and store its size. The value may
+ * be stored in work_buffer. Returns false if the row has no value that can be
+ * stored in the index.
+ * Packed keys pass through write batches and sorters big-endian, so their
+ * byte order matches the numeric order LMDB keeps integer keys in. */
+static bool extract_key(const bam1_t *row, const bam_hdr_t *header,
+                        const char *target_key, bool packed,
+                        char *work_buffer, const char **key,
+                        size_t *key_size) {
+  char field[BAMDB_MAX_FIELD_CHARS];
+  const char *next = target_key;
+  const char *value;
+  size_t value_size;
+  uint64_t packed_key;
+
+  if (bamdb_key_type(target_key) == BAMDB_KEY_COMPOSITE) {
+    /* Strings keep their terminator so every field ends where the next one
+     * starts and a shorter value sorts first */
+    *key = work_buffer;
+    *key_size = 0;
+    while (next != NULL) {
+      next = bamdb_next_field(next, field);
+      if (!extract_field(row, header, field, work_buffer + *key_size, &value,
+                         &value_size)) {
+        return false;
+      }
+      if (bamdb_key_type(field) == BAMDB_KEY_STRING) {
+        memmove(work_buffer + *key_size, value, value_size + 1);
+        value_size++;
+      }
+      *key_size += value_size;
+      if (*key_size > BAMDB_MAX_KEY_SIZE) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  if (!extract_field(row, header, target_key, work_buffer, key, key_size)) {
+    return false;
+  }
+
+  if (packed) {
+    if (!bamdb_pack_barcode(*key, &packed_key)) {
+      return false;
+    }
+    bamdb_store_be64(packed_key, work_buffer);
+    *key = work_buffer;
+    *key_size = sizeof(uint64_t);
+  }
+
+  /* LMDB would refuse the key */
+  return *key_size <= BAMDB_MAX_KEY_SIZE;
+}
+
 static void *deserialize_func(void *arg) {
   deserialize_thread_data_t *data = (deserialize_thread_data_t *)arg;
   char *work_buffer = malloc(WORK_BUFFER_SIZE);
-  char *buffer_pos = work_buffer;
-
-  ck_fifo_mpmc_entry_t *garbage;
-  bam_data_t *deserialize_entry;
-
-  while (ck_pr_load_int(&reader_running) ||
-         CK_FIFO_MPMC_ISEMPTY(deserialize_q) == false) {
-    while (ck_fifo_mpmc_trydequeue(deserialize_q, &deserialize_entry,
-                                   &garbage) == true) {
-      buffer_pos = work_buffer;
-
-      for (size_t i = 0; i < data->num_keys; ++i) {
-        write_entry_t *w_entry = malloc(sizeof(write_entry_t));
-        ck_fifo_mpmc_entry_t *fifo_entry = malloc(sizeof(ck_fifo_mpmc_entry_t));
-        char *target_key = data->write_queues[i]->key;
-
-        if (strncmp(target_key, "QNAME", 5) == 0) {
-          w_entry->key = strdup(bam_get_qname(deserialize_entry->bam_row));
-        } else {
-          w_entry->key = strdup(
-              bam_str_key(deserialize_entry->bam_row, target_key, buffer_pos));
+  const char *key;
+  size_t key_size;
+
+  row_batch_t *rows;
+  write_batch_t *batch;
+
+  while (bamdb_queue_pop(data->read_q, (void **)&rows)) {
+    ck_pr_dec_int(&deserialize_queue_size);
+
+    for (size_t i = 0; i < data->num_keys; ++i) {
+      writer_q_t *queue = data->write_queues[i];
+
+      /* Blocks until a writer hands a batch back */
+      bamdb_queue_pop(data->write_pool, (void **)&batch);
+      batch->num_entries = 0;
+      batch->keys_used = 0;
+      batch->end_voffset = rows->end_voffset;
+      batch->end_row = rows->end_row;
+
+      for (size_t j = 0; j < rows->num_rows; ++j) {
+        if (!extract_key(rows->rows[j], data->header, queue->key,
+                         queue->packed, work_buffer, &key, &key_size)) {
+          ck_pr_inc_64(&queue->num_skipped);
+          continue;
+        }
+        write_batch_add(batch, key, key_size, rows->voffsets[j]);
+      }
+
+      bamdb_queue_push(queue->write_qs[data->thread_id], batch);
+      ck_pr_inc_int(&write_queue_size);
+    }
+
+    bamdb_queue_push(data->row_pool, rows);
+  }
+
+  /* Let the writers know this thread will not produce anything else */
+  for (size_t i = 0; i < data->num_keys; ++i) {
+    bamdb_queue_close(data->write_queues[i]->write_qs[data->thread_id]);
+  }
+
+  free(work_buffer);
+  pthread_exit(NULL);
+}
+
+/* db_name is NULL for the unnamed database of a per-index environment,
+ * db_flags are added to the MDB_DUPSORT every index is opened with */
+static int begin_write_txn(MDB_env *env, const char *db_name,
+                           unsigned int db_flags, MDB_txn **txn, MDB_dbi *dbi,
+                           MDB_cursor **cur) {
+  int rc;
+
+  rc = mdb_txn_begin(env, NULL, 0, txn);
+  if (rc != MDB_SUCCESS) {
+    fprintf(stderr, "Error starting transaction: %s\n", mdb_strerror(rc));
+    return BAMDB_DB_ERROR;
+  }
+
+  rc = mdb_dbi_open(*txn, db_name,
+                    MDB_DUPSORT | MDB_CREATE | db_flags, dbi);
+  if (rc != MDB_SUCCESS) {
+    fprintf(stderr, "Error opening database: %s\n", mdb_strerror(rc));
+    return BAMDB_DB_ERROR;
+  }
+
+  rc = mdb_cursor_open(*txn, *dbi, cur);
+  if (rc != MDB_SUCCESS) {
+    fprintf(stderr, "Error getting cursor: %s\n", mdb_strerror(rc));
+    return BAMDB_DB_ERROR;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+/* Count loaded offsets and commit every DB_COMMIT_FREQ of them */
+static int bulk_load_progress(bulk_load_state_t *state, uint64_t num_loaded) {
+  uint64_t last_commit = state->n / DB_COMMIT_FREQ;
+
+  state->n += num_loaded;
+  if (state->n / DB_COMMIT_FREQ == last_commit) {
+    return BAMDB_SUCCESS;
+  }
+
+  mdb_cursor_close(state->cur);
+  commit_lmdb_transaction(state->txn);
+  printf("%" PRIu64 " sorted records loaded\n", state->n);
+
+  return begin_write_txn(state->env, state->db_name, state->db_flags,
+                         &state->txn, &state->dbi, &state->cur);
+}
+
+/* Merge callback for sorted builds. Pairs arrive in exactly the order LMDB
+ * stores them so every insert into an empty index is an append to the last
+ * leaf page. Updates of an existing index still insert in key order. */
+static int bulk_load_func(const void *key_data, size_t key_size,
+                          int64_t voffset, bool new_key, void *arg) {
+  bulk_load_state_t *state = (bulk_load_state_t *)arg;
+  MDB_val key, val;
+  uint64_t packed_key;
+  int rc;
+
+  key.mv_size = key_size;
+  key.mv_data = (void *)key_data;
+  if (state->packed) {
+    packed_key = bamdb_load_be64(key_data);
+    key.mv_size = sizeof(uint64_t);
+    key.mv_data = &packed_key;
+  }
+  val.mv_size = sizeof(int64_t);
+  val.mv_data = &voffset;
+
+  if (state->append) {
+    rc = mdb_cursor_put(state->cur, &key, &val,
+                        new_key ? MDB_APPEND : MDB_APPENDDUP);
+  } else {
+    rc = mdb_cursor_put(state->cur, &key, &val, 0);
+  }
+  if (rc != MDB_SUCCESS) {
+    fprintf(stderr, "Error appending data: %s\n", mdb_strerror(rc));
+    return BAMDB_DB_ERROR;
+  }
+
+  return bulk_load_progress(state, 1);
+}
+
+/* Load an index from one or more sorters and commit it. append requires the
+ * index to be empty. */
+static int bulk_load_lmdb(MDB_env *env, const char *key_name,
+                          bool packed, bamdb_sorter_t **sorters,
+                          size_t num_sorters, bool append) {
+  bulk_load_state_t state = {.env = env,
+                             .db_flags = MDB_DUPFIXED |
+                                         (packed ? MDB_INTEGERKEY : 0),
+                             .packed = packed,
+                             .append = append,
+                             .n = 0};
+  size_t num_runs = 0;
+  int rc;
+
+  for (size_t i = 0; i < num_sorters; ++i) {
+    num_runs += bamdb_sorter_num_runs(sorters[i]) + 1;
+  }
+  printf("Loading %s index from %zu sorted runs\n", key_name, num_runs);
+
+  rc = begin_write_txn(env, NULL, state.db_flags, &state.txn, &state.dbi,
+                       &state.cur);
+  if (rc != BAMDB_SUCCESS) {
+    return rc;
+  }
+
+  rc = bamdb_sorter_merge_many(sorters, num_sorters, bulk_load_func, &state);
+  if (rc != BAMDB_SUCCESS) {
+    fprintf(stderr, "Error loading sorted %s index\n", key_name);
+    mdb_cursor_close(state.cur);
+    mdb_txn_abort(state.txn);
+    return rc;
+  }
+
+  mdb_cursor_close(state.cur);
+  return commit_lmdb_transaction(state.txn);
+}
+
+static checkpoint_t *init_checkpoint(char *db_path, size_t num_writers,
+                                     uint64_t base_rows,
+                                     const bamdb_fingerprint_t *fingerprint,
+                                     char **keys, char *row_filter) {
+  checkpoint_t *checkpoint = calloc(1, sizeof(checkpoint_t));
+
+  pthread_mutex_init(&checkpoint->lock, NULL);
+  checkpoint->db_path = db_path;
+  checkpoint->num_writers = num_writers;
+  checkpoint->voffsets = malloc(num_writers * sizeof(int64_t));
+  checkpoint->num_rows = calloc(num_writers, sizeof(uint64_t));
+  for (size_t i = 0; i < num_writers; ++i) {
+    checkpoint->voffsets[i] = -1;
+  }
+  checkpoint->base_rows = base_rows;
+  checkpoint->meta.end_voffset = -1;
+  checkpoint->meta.fingerprint = *fingerprint;
+  checkpoint->meta.num_indices = num_writers;
+  checkpoint->meta.indices = keys;
+  checkpoint->meta.row_filter = row_filter;
+
+  return checkpoint;
+}
+
+static void destroy_checkpoint(checkpoint_t *checkpoint) {
+  pthread_mutex_destroy(&checkpoint->lock);
+  free(checkpoint->voffsets);
+  free(checkpoint->num_rows);
+  free(checkpoint);
+}
+
+/* Called by a writer after each commit with the end of the last batch it
+ * committed */
+static void record_checkpoint(checkpoint_t *checkpoint, size_t writer_id,
+                              int64_t voffset, uint64_t num_rows) {
+  size_t earliest = 0;
+
+  pthread_mutex_lock(&checkpoint->lock);
+  checkpoint->voffsets[writer_id] = voffset;
+  checkpoint->num_rows[writer_id] = num_rows;
+
+  for (size_t i = 0; i < checkpoint->num_writers; ++i) {
+    if (checkpoint->voffsets[i] < checkpoint->voffsets[earliest]) {
+      earliest = i;
+    }
+  }
+
+  /* Every writer sees every batch, so the earliest writer's count matches its
+   * voffset and a resumed build starts right after the rows it counts */
+  if (checkpoint->voffsets[earliest] > checkpoint->meta.end_voffset) {
+    checkpoint->meta.end_voffset = checkpoint->voffsets[earliest];
+    checkpoint->meta.num_rows =
+        checkpoint->base_rows + checkpoint->num_rows[earliest];
+    bamdb_write_checkpoint(checkpoint->db_path, &checkpoint->meta);
+  }
+  pthread_mutex_unlock(&checkpoint->lock);
+}
+
+static int compare_offsets(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Load every offset of a key as compressed posting chunks. offsets are
+ * sorted in place. */
+static int bulk_load_postings(bulk_load_state_t *state, MDB_val *key,
+                              int64_t *offsets, size_t num_offsets) {
+  unsigned char chunk[BAMDB_MAX_POSTING_CHUNK_SIZE];
+  MDB_val val;
+  size_t num_encoded;
+  bool new_key = true;
+  int rc;
+
+  /* Chunks hold ascending offsets, which is not the bytewise order the
+   * duplicates of a plain index are kept in */
+  qsort(offsets, num_offsets, sizeof(int64_t), compare_offsets);
+
+  while (num_offsets > 0) {
+    num_encoded =
+        bamdb_encode_postings(offsets, num_offsets, chunk, &val.mv_size);
+    val.mv_data = chunk;
+
+    if (state->append) {
+      rc = mdb_cursor_put(state->cur, key, &val,
+                          new_key ? MDB_APPEND : MDB_APPENDDUP);
+    } else {
+      rc = mdb_cursor_put(state->cur, key, &val, 0);
+    }
+    if (rc != MDB_SUCCESS) {
+      fprintf(stderr, "Error appending data: %s\n", mdb_strerror(rc));
+      return BAMDB_DB_ERROR;
+    }
+
+    rc = bulk_load_progress(state, num_encoded);
+    if (rc != BAMDB_SUCCESS) {
+      return rc;
+    }
+    offsets += num_encoded;
+    num_offsets -= num_encoded;
+    new_key = false;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+static int add_table_key(key_load_state_t *state) {
+  return bamdb_table_add(state->writer, state->key, state->key_size,
+                         state->offsets, state->num_offsets);
+}
+
+/* Hand the gathered key on with its offsets in ascending order */
+static int flush_loaded_key(key_load_state_t *state) {
+  uint64_t last_report = state->n / DB_COMMIT_FREQ;
+
+  if (state->num_offsets == 0) {
+    return BAMDB_SUCCESS;
+  }
+
+  qsort(state->offsets, state->num_offsets, sizeof(int64_t), compare_offsets);
+  state->n += state->num_offsets;
+  if (state->n / DB_COMMIT_FREQ != last_report) {
+    printf("%" PRIu64 " sorted records loaded\n", state->n);
+  }
+
+  return state->add_key(state);
+}
+
+/* Merge callback for table and hash builds, gathers the offsets of each key */
+static int key_load_func(const void *key_data, size_t key_size,
+                         int64_t voffset, bool new_key, void *arg) {
+  key_load_state_t *state = (key_load_state_t *)arg;
+  int rc;
+
+  if (new_key) {
+    rc = flush_loaded_key(state);
+    if (rc != BAMDB_SUCCESS) {
+      return rc;
+    }
+    memcpy(state->key, key_data, key_size);
+    state->key_size = key_size;
+    state->num_offsets = 0;
+  }
+
+  if (state->num_offsets == state->capacity) {
+    state->capacity = state->capacity > 0 ? state->capacity * 2 : 1024;
+    state->offsets =
+        realloc(state->offsets, state->capacity * sizeof(int64_t));
+  }
+  state->offsets[state->num_offsets++] = voffset;
+
+  return BAMDB_SUCCESS;
+}
+
+/* Write an index from one or more sorters to its table in db_path. Packed
+ * keys stay in their big-endian sort form. */
+static int bulk_load_table(const char *db_path, const char *key_name,
+                           bool packed, bamdb_sorter_t **sorters,
+                           size_t num_sorters) {
+  char target_path[MAX_PATH_CHARS];
+  key_load_state_t state = {.add_key = add_table_key, .num_offsets = 0,
+                           .n = 0};
+  size_t num_runs = 0;
+  int rc;
+
+  for (size_t i = 0; i < num_sorters; ++i) {
+    num_runs += bamdb_sorter_num_runs(sorters[i]) + 1;
+  }
+  printf("Writing %s table from %zu sorted runs\n", key_name, num_runs);
+
+  bamdb_table_path(target_path, MAX_PATH_CHARS, db_path, key_name);
+  state.writer = bamdb_table_create(target_path, packed ? BAMDB_TABLE_PACKED
+                                                        : 0);
+  if (state.writer == NULL) {
+    return BAMDB_DB_ERROR;
+  }
+
+  rc = bamdb_sorter_merge_many(sorters, num_sorters, key_load_func, &state);
+  if (rc == BAMDB_SUCCESS) {
+    rc = flush_loaded_key(&state);
+  }
+  free(state.offsets);
+  if (rc != BAMDB_SUCCESS) {
+    fprintf(stderr, "Error writing %s table\n", key_name);
+    bamdb_table_discard(state.writer);
+    return rc;
+  }
+
+  return bamdb_table_finish(state.writer);
+}
+
+/* Drop the named database key_name of a rebuild so it is created again with
+ * the flags of this build. An update keeps the existing database and its
+ * posting format. */
+static int prepare_pack_destination(MDB_env *env, const char *key_name,
+                                    bool replace, bool *compress) {
+  MDB_txn *txn = NULL;
+  MDB_dbi dbi;
+  unsigned int flags;
+  int rc;
+
+  rc = mdb_txn_begin(env, NULL, 0, &txn);
+  if (rc != MDB_SUCCESS) {
+    fprintf(stderr, "Error starting transaction: %s\n", mdb_strerror(rc));
+    return BAMDB_DB_ERROR;
+  }
+
+  rc = mdb_dbi_open(txn, key_name, 0, &dbi);
+  if (rc == MDB_NOTFOUND) {
+    mdb_txn_abort(txn);
+    return BAMDB_SUCCESS;
+  }
+  if (rc == MDB_SUCCESS && replace) {
+    rc = mdb_drop(txn, dbi, 1);
+    if (rc == MDB_SUCCESS) {
+      return commit_lmdb_transaction(txn);
+    }
+  } else if (rc == MDB_SUCCESS) {
+    rc = mdb_dbi_flags(txn, dbi, &flags);
+    *compress = !(flags & MDB_DUPFIXED);
+  }
+
+  mdb_txn_abort(txn);
+  if (rc != MDB_SUCCESS) {
+    fprintf(stderr, "Error opening %s index: %s\n", key_name,
+            mdb_strerror(rc));
+    return BAMDB_DB_ERROR;
+  }
+  return BAMDB_SUCCESS;
+}
+
+/* Delete the per-index environment of key_name, if there is one */
+static void remove_index_env(const char *db_path, const char *key_name) {
+  char target_path[MAX_PATH_CHARS];
+
+  snprintf(target_path, MAX_PATH_CHARS, "%s/%s/%s", db_path, key_name,
+           LMDB_DATA_FILE);
+  remove(target_path);
+  snprintf(target_path, MAX_PATH_CHARS, "%s/%s/lock.mdb", db_path, key_name);
+  remove(target_path);
+  snprintf(target_path, MAX_PATH_CHARS, "%s/%s", db_path, key_name);
+  remove(target_path);
+}
+
+/* Copy the per-index environment of key_name into the named database of the
+ * same name in dest_env and delete it. Pairs are read back in key order, so
+ * an empty destination is loaded with appends. With compress the offsets of
+ * each key are stored as delta encoded chunks, see bamdb_postings.h. */
+static int pack_lmdb_index(MDB_env *dest_env, const char *db_path,
+                           const char *key_name, bool replace, bool compress) {
+  char target_path[MAX_PATH_CHARS];
+  bulk_load_state_t state = {.env = dest_env, .db_name = key_name, .n = 0};
+  MDB_env *env = NULL;
+  MDB_txn *txn = NULL;
+  MDB_dbi dbi;
+  MDB_cursor *cur = NULL;
+  MDB_val key, val;
+  MDB_stat stat;
+  int64_t *offsets = NULL;
+  size_t num_offsets = 0;
+  size_t max_offsets = 0;
+  int rc;
+  int ret = BAMDB_DB_ERROR;
+
+  snprintf(target_path, MAX_PATH_CHARS, "%s/%s", db_path, key_name);
+  rc = get_lmdb_env(&env, target_path, true);
+  if (rc != BAMDB_SUCCESS) {
+    return rc;
+  }
+
+  rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+  if (rc == MDB_SUCCESS) {
+    rc = mdb_dbi_open(txn, NULL, MDB_DUPSORT | MDB_DUPFIXED, &dbi);
+  }
+  if (rc == MDB_SUCCESS) {
+    rc = mdb_dbi_flags(txn, dbi, &state.db_flags);
+  }
+  if (rc == MDB_SUCCESS) {
+    rc = mdb_cursor_open(txn, dbi, &cur);
+  }
+  if (rc != MDB_SUCCESS) {
+    fprintf(stderr, "Error reading %s index: %s\n", key_name, mdb_strerror(rc));
+    goto exit;
+  }
+
+  if (prepare_pack_destination(dest_env, key_name, replace, &compress) !=
+      BAMDB_SUCCESS) {
+    goto exit;
+  }
+  /* Packed keys are already in their native form here */
+  state.db_flags = (state.db_flags & MDB_INTEGERKEY) |
+                   (compress ? 0 : MDB_DUPFIXED);
+  if (begin_write_txn(dest_env, key_name, state.db_flags, &state.txn,
+                      &state.dbi, &state.cur) != BAMDB_SUCCESS) {
+    goto exit;
+  }
+  mdb_stat(state.txn, state.dbi, &stat);
+  state.append = stat.ms_entries == 0;
+
+  printf("Packing %s index%s\n", key_name,
+         compress ? " with compressed postings" : "");
+  for (rc = mdb_cursor_get(cur, &key, &val, MDB_FIRST); rc == MDB_SUCCESS;
+       rc = mdb_cursor_get(cur, &key, &val, MDB_NEXT_NODUP)) {
+    if (compress) {
+      /* Gather the offsets of the key a page at a time */
+      num_offsets = 0;
+      rc = mdb_cursor_get(cur, &key, &val, MDB_GET_MULTIPLE);
+      while (rc == MDB_SUCCESS) {
+        size_t n = val.mv_size / sizeof(int64_t);
+        if (num_offsets + n > max_offsets) {
+          max_offsets = (num_offsets + n) * 2;
+          offsets = realloc(offsets, max_offsets * sizeof(int64_t));
         }
+        memcpy(offsets + num_offsets, val.mv_data, val.mv_size);
+        num_offsets += n;
+        rc = mdb_cursor_get(cur, &key, &val, MDB_NEXT_MULTIPLE);
+      }
+      rc = bulk_load_postings(&state, &key, offsets, num_offsets);
+    } else {
+      bool new_key = true;
+
+      do {
+        rc = bulk_load_func(key.mv_data, key.mv_size, *(int64_t *)val.mv_data,
+                            new_key, &state);
+        new_key = false;
+      } while (rc == BAMDB_SUCCESS &&
+               mdb_cursor_get(cur, &key, &val, MDB_NEXT_DUP) == MDB_SUCCESS);
+    }
+
+    if (rc != BAMDB_SUCCESS) {
+      mdb_cursor_close(state.cur);
+      mdb_txn_abort(state.txn);
+      goto exit;
+    }
+  }
+
+  mdb_cursor_close(state.cur);
+  if (rc != MDB_NOTFOUND) {
+    fprintf(stderr, "Error reading %s index: %s\n", key_name, mdb_strerror(rc));
+    mdb_txn_abort(state.txn);
+    goto exit;
+  }
+  ret = commit_lmdb_transaction(state.txn);
+
+exit:
+  free(offsets);
+  if (cur != NULL) {
+    mdb_cursor_close(cur);
+  }
+  if (txn != NULL) {
+    mdb_txn_abort(txn);
+  }
+  mdb_env_close(env);
+
+  /* Only remove the source once its pairs are safely committed */
+  if (ret == BAMDB_SUCCESS) {
+    remove_index_env(db_path, key_name);
+  }
+
+  return ret;
+}
+
+/* Move the indices of a build into a single environment in db_path */
+static int pack_lmdb_indices(char *db_path, char **keys, size_t num_keys,
+                             bool replace, bool compress) {
+  MDB_env *env = NULL;
+  int ret;
+
+  ret = get_lmdb_env(&env, db_path, false);
+  if (ret != BAMDB_SUCCESS) {
+    return ret;
+  }
+
+  for (size_t i = 0; i < num_keys && ret == BAMDB_SUCCESS; ++i) {
+    ret = pack_lmdb_index(env, db_path, keys[i], replace, compress);
+  }
+
+  mdb_env_sync(env, 1);
+  mdb_env_close(env);
+  return ret;
+}
+
+/* Turn a key as stored in the index back into the text it is queried with,
+ * truncated to text_size */
+static void format_stored_key(const char *key_name, bool packed,
+                              const MDB_val *key, char *text,
+                              size_t text_size) {
+  const unsigned char *data = key->mv_data;
+  const char *next = key_name;
+  char field[BAMDB_MAX_FIELD_CHARS];
+  size_t pos = 0;
+  size_t used = 0;
+  size_t len;
+  uint64_t packed_key;
+
+  if (packed && text_size >= BAMDB_MAX_BARCODE_CHARS) {
+    memcpy(&packed_key, data, sizeof(uint64_t));
+    bamdb_unpack_barcode(packed_key, text);
+    return;
+  }
 
-        w_entry->voffset = deserialize_entry->voffset;
+  text[0] = '\0';
+  while (next != NULL && pos < key->mv_size && used < text_size) {
+    next = bamdb_next_field(next, field);
+    switch (bamdb_key_type(field)) {
+      case BAMDB_KEY_INT:
+        used += snprintf(text + used, text_size - used, "%" PRId64,
+                         bamdb_decode_int_key(data + pos));
+        pos += BAMDB_TYPED_KEY_SIZE;
+        break;
+      case BAMDB_KEY_FLOAT:
+        used += snprintf(text + used, text_size - used, "%g",
+                         bamdb_decode_float_key(data + pos));
+        pos += BAMDB_TYPED_KEY_SIZE;
+        break;
+      default:
+        /* Strings end at their terminator inside composite keys and at the
+         * end of the key otherwise */
+        len = strnlen((const char *)data + pos, key->mv_size - pos);
+        used += snprintf(text + used, text_size - used, "%.*s", (int)len,
+                         data + pos);
+        pos += len + 1;
+        break;
+    }
+    if (next != NULL && used < text_size) {
+      used += snprintf(text + used, text_size - used, "%c",
+                       BAMDB_FIELD_SEPARATOR);
+    }
+  }
+}
+
+/* Count the rows of a key, its text is only needed for the most frequent */
+static void add_key_stats(bamdb_index_stats_t *stats, const char *key_name,
+                          bool packed, const MDB_val *key, uint64_t num_rows) {
+  char key_text[BAMDB_MAX_KEY_SIZE * 4];
+
+  if (bamdb_stats_is_top(stats, num_rows)) {
+    format_stored_key(key_name, packed, key, key_text, sizeof(key_text));
+    bamdb_stats_add_key(stats, key_text, num_rows);
+  } else {
+    bamdb_stats_add_key(stats, NULL, num_rows);
+  }
+}
+
+/* Write the bloom filter and statistics of an index from the keys it holds
+ * once built. Keys are read twice, first to size the filter and count rows,
+ * then to fill the filter. */
+static int write_index_summary(const char *db_path, const char *key_name,
+                               bool single_env) {
+  char target_path[MAX_PATH_CHARS];
+  bamdb_bloom_t *bloom = NULL;
+  bamdb_index_stats_t stats;
+  MDB_env *env = NULL;
+  MDB_txn *txn = NULL;
+  MDB_dbi dbi;
+  MDB_cursor *cur = NULL;
+  MDB_val key, val;
+  unsigned int flags = 0;
+  size_t num_dups;
+  uint64_t num_rows;
+  bool packed;
+  int rc;
+  int ret = BAMDB_DB_ERROR;
+
+  /* Coordinates are neither looked up as single keys nor worth counting */
+  if (bamdb_key_type(key_name) == BAMDB_KEY_REGION) {
+    return BAMDB_SUCCESS;
+  }
+
+  if (single_env) {
+    snprintf(target_path, MAX_PATH_CHARS, "%s", db_path);
+  } else {
+    snprintf(target_path, MAX_PATH_CHARS, "%s/%s", db_path, key_name);
+  }
+  if (get_lmdb_env(&env, target_path, true) != BAMDB_SUCCESS) {
+    return BAMDB_DB_ERROR;
+  }
+
+  memset(&stats, 0, sizeof(stats));
+  rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+  if (rc == MDB_SUCCESS) {
+    rc = mdb_dbi_open(txn, single_env ? key_name : NULL, MDB_DUPSORT, &dbi);
+  }
+  if (rc == MDB_SUCCESS) {
+    rc = mdb_dbi_flags(txn, dbi, &flags);
+  }
+  if (rc == MDB_SUCCESS) {
+    rc = mdb_cursor_open(txn, dbi, &cur);
+  }
+  packed = flags & MDB_INTEGERKEY;
+
+  for (int pass = 0; pass < 2 && rc == MDB_SUCCESS; ++pass) {
+    if (pass == 1) {
+      bloom = bamdb_bloom_create(stats.num_keys,
+                                 packed ? BAMDB_BLOOM_PACKED : 0);
+    }
+    for (rc = mdb_cursor_get(cur, &key, &val, MDB_FIRST); rc == MDB_SUCCESS;
+         rc = mdb_cursor_get(cur, &key, &val, MDB_NEXT_NODUP)) {
+      if (pass == 1) {
+        bamdb_bloom_add(bloom, key.mv_data, key.mv_size);
+        continue;
+      }
+
+      if (flags & MDB_DUPFIXED) {
+        mdb_cursor_count(cur, &num_dups);
+        num_rows = num_dups;
+      } else {
+        /* Compressed postings, count the offsets of every chunk */
+        num_rows = 0;
+        do {
+          num_rows += bamdb_count_postings(val.mv_data, val.mv_size);
+        } while (mdb_cursor_get(cur, &key, &val, MDB_NEXT_DUP) ==
+                 MDB_SUCCESS);
+      }
 
-        ck_fifo_mpmc_enqueue(data->write_queues[i]->write_q, fifo_entry,
-                             w_entry);
-        ck_pr_inc_int(&write_queue_size);
+      add_key_stats(&stats, key_name, packed, &key, num_rows);
+    }
+    if (rc == MDB_NOTFOUND) {
+      rc = MDB_SUCCESS;
+    }
+  }
+
+  if (rc != MDB_SUCCESS) {
+    fprintf(stderr, "Error reading %s index: %s\n", key_name, mdb_strerror(rc));
+  } else {
+    bamdb_bloom_path(target_path, MAX_PATH_CHARS, db_path, key_name);
+    ret = bamdb_bloom_write(bloom, target_path);
+  }
+  if (ret == BAMDB_SUCCESS) {
+    ret = bamdb_write_stats(db_path, key_name, &stats);
+  }
+
+  bamdb_free_stats(&stats);
+  bamdb_bloom_destroy(bloom);
+  if (cur != NULL) {
+    mdb_cursor_close(cur);
+  }
+  if (txn != NULL) {
+    mdb_txn_abort(txn);
+  }
+  mdb_env_close(env);
+  return ret;
+}
+
+/* Write the bloom filter and statistics of an index built as a table. The
+ * table knows how many keys it holds, so a single pass fills both. */
+static int write_table_summary(const char *db_path, const char *key_name) {
+  char target_path[MAX_PATH_CHARS];
+  bamdb_table_t *table;
+  bamdb_table_entry_t entry;
+  bamdb_bloom_t *bloom;
+  bamdb_index_stats_t stats;
+  MDB_val key;
+  uint64_t packed_key;
+  bool packed, more;
+  int ret;
+
+  if (bamdb_key_type(key_name) == BAMDB_KEY_REGION) {
+    return BAMDB_SUCCESS;
+  }
+
+  bamdb_table_path(target_path, MAX_PATH_CHARS, db_path, key_name);
+  if ((table = bamdb_table_open(target_path)) == NULL) {
+    return BAMDB_DB_ERROR;
+  }
+  packed = bamdb_table_flags(table) & BAMDB_TABLE_PACKED;
+
+  memset(&stats, 0, sizeof(stats));
+  bloom = bamdb_bloom_create(bamdb_table_num_keys(table),
+                             packed ? BAMDB_BLOOM_PACKED : 0);
+  for (more = bamdb_table_first(table, &entry); more;
+       more = bamdb_table_next(table, &entry)) {
+    key.mv_size = entry.key_size;
+    key.mv_data = (void *)entry.key;
+    /* Filters and statistics take packed keys in their native form */
+    if (packed) {
+      packed_key = bamdb_load_be64(entry.key);
+      key.mv_size = sizeof(uint64_t);
+      key.mv_data = &packed_key;
+    }
+    bamdb_bloom_add(bloom, key.mv_data, key.mv_size);
+    add_key_stats(&stats, key_name, packed, &key, entry.num_offsets);
+  }
+
+  bamdb_bloom_path(target_path, MAX_PATH_CHARS, db_path, key_name);
+  ret = bamdb_bloom_write(bloom, target_path);
+  if (ret == BAMDB_SUCCESS) {
+    ret = bamdb_write_stats(db_path, key_name, &stats);
+  }
+
+  bamdb_free_stats(&stats);
+  bamdb_bloom_destroy(bloom);
+  bamdb_table_close(table);
+  return ret;
+}
+
+/* Collects the keys of the first merge of a hash build, stores the keys with
+ * their offsets and counts them in the second */
+static int add_hash_key(key_load_state_t *state) {
+  MDB_val key;
+
+  if (state->stats == NULL) {
+    bamdb_hash_add_key(state->hash, state->key, state->key_size);
+    return BAMDB_SUCCESS;
+  }
+
+  key.mv_size = state->key_size;
+  key.mv_data = state->key;
+  add_key_stats(state->stats, "QNAME", false, &key, state->num_offsets);
+  return bamdb_hash_set(state->hash, state->key, state->key_size,
+                        state->offsets, state->num_offsets);
+}
 
-        while (ck_pr_load_int(&write_queue_size) > MAX_WRITE_QUEUE_SIZE) {
-          usleep(100);
+/* Write an index from one or more sorters to its minimal perfect hash in
+ * db_path along with its statistics. The sorters are merged twice, the hash
+ * function has to be known before any offsets can be stored. No bloom filter
+ * is written, a lookup already rules out most missing keys by their
+ * fingerprint. */
+static int bulk_load_hash(const char *db_path, const char *key_name,
+                          bamdb_sorter_t **sorters, size_t num_sorters) {
+  char target_path[MAX_PATH_CHARS];
+  key_load_state_t state = {.add_key = add_hash_key, .num_offsets = 0,
+                            .n = 0};
+  bamdb_index_stats_t stats;
+  size_t num_runs = 0;
+  int rc;
+
+  for (size_t i = 0; i < num_sorters; ++i) {
+    num_runs += bamdb_sorter_num_runs(sorters[i]) + 1;
+  }
+  printf("Writing %s hash from %zu sorted runs\n", key_name, num_runs);
+
+  memset(&stats, 0, sizeof(stats));
+  bamdb_hash_path(target_path, MAX_PATH_CHARS, db_path, key_name);
+  state.hash = bamdb_hash_create();
+
+  rc = bamdb_sorter_merge_many(sorters, num_sorters, key_load_func, &state);
+  if (rc == BAMDB_SUCCESS) {
+    rc = flush_loaded_key(&state);
+  }
+  if (rc == BAMDB_SUCCESS) {
+    rc = bamdb_hash_build(state.hash, target_path);
+  }
+
+  if (rc == BAMDB_SUCCESS) {
+    state.stats = &stats;
+    state.num_offsets = 0;
+    state.n = 0;
+    rc = bamdb_sorter_merge_many(sorters, num_sorters, key_load_func,
+                                 &state);
+  }
+  if (rc == BAMDB_SUCCESS) {
+    rc = flush_loaded_key(&state);
+  }
+  free(state.offsets);
+  if (rc != BAMDB_SUCCESS) {
+    fprintf(stderr, "Error writing %s hash\n", key_name);
+    bamdb_hash_discard(state.hash);
+    bamdb_free_stats(&stats);
+    return rc;
+  }
+
+  rc = bamdb_hash_finish(state.hash);
+  if (rc == BAMDB_SUCCESS) {
+    rc = bamdb_write_stats(db_path, key_name, &stats);
+  }
+  bamdb_free_stats(&stats);
+  return rc;
+}
+
+/* Commit what a writer has inserted so far and carry on in a new transaction */
+static int restart_write_txn(MDB_env *env, MDB_dbi dbi, MDB_txn **txn,
+                             MDB_cursor **cur) {
+  int rc;
+
+  mdb_cursor_close(*cur);
+  *cur = NULL;
+  rc = commit_lmdb_transaction(*txn);
+  *txn = NULL;
+  if (rc != BAMDB_SUCCESS) {
+    return rc;
+  }
+
+  rc = mdb_txn_begin(env, NULL, 0, txn);
+  if (rc != MDB_SUCCESS) {
+    fprintf(stderr, "Error starting transaction: %s\n", mdb_strerror(rc));
+    return BAMDB_DB_ERROR;
+  }
+
+  rc = mdb_cursor_open(*txn, dbi, cur);
+  if (rc != MDB_SUCCESS) {
+    fprintf(stderr, "Error getting cursor: %s\n", mdb_strerror(rc));
+    return BAMDB_DB_ERROR;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+static void *writer_func(void *arg) {
+  writer_thread_data_t *data = (writer_thread_data_t *)arg;
+
+  MDB_env *env = NULL;
+  MDB_val key, val;
+  MDB_txn *txn = NULL;
+  MDB_dbi dbi;
+  MDB_cursor *cur = NULL;
+  char target_path[MAX_PATH_CHARS];
+  uint64_t packed_key;
+  uint64_t n = 0;
+  uint64_t last_commit_row = 0;
+  size_t next_q = 0;
+  int rc;
+  int ret = BAMDB_SUCCESS;
+
+  write_batch_t *batch;
+
+  /* Tables and hashes are written straight from the sorter once all pairs
+   * are in */
+  if (!data->table && !data->hash) {
+    snprintf(target_path, MAX_PATH_CHARS, "%s/%s", data->db_path,
+             data->key_name);
+    mkdir(target_path, 0777);
+    ret = get_lmdb_env(&env, target_path, false);
+  }
+
+  /* Sorted builds only touch the database once all pairs have been seen */
+  if (ret == BAMDB_SUCCESS && data->sorter == NULL) {
+    ret = begin_write_txn(env, NULL,
+                          MDB_DUPFIXED |
+                              (data->queue->packed ? MDB_INTEGERKEY : 0),
+                          &txn, &dbi, &cur);
+  }
+
+  /* The next row in file order always comes from next_q, so once that queue
+   * is closed and drained every other queue is as well. After an error the
+   * batches are still taken and handed back, otherwise the deserialize
+   * threads would block forever waiting for them. */
+  while (bamdb_queue_pop(data->queue->write_qs[next_q], (void **)&batch)) {
+    ck_pr_dec_int(&write_queue_size);
+    next_q = (next_q + 1) % data->queue->num_queues;
+
+    for (size_t i = 0; i < batch->num_entries && ret == BAMDB_SUCCESS; ++i) {
+      char *entry_key = batch->keys + batch->key_offsets[i];
+
+      if (data->sorter != NULL) {
+        ret = bamdb_sorter_add(data->sorter, entry_key, batch->key_sizes[i],
+                               batch->voffsets[i]);
+        if (ret != BAMDB_SUCCESS) {
+          fprintf(stderr, "Error sorting %s index\n", data->key_name);
         }
+        continue;
       }
 
-      ck_pr_dec_int(&deserialize_queue_size);
-      bam_destroy1(deserialize_entry->bam_row);
-      free(garbage);
-      free(deserialize_entry);
-    }
+      val.mv_size = sizeof(int64_t);
+      val.mv_data = &batch->voffsets[i];
+
+      /* insert voffset under bx */
+      key.mv_size = batch->key_sizes[i];
+      key.mv_data = entry_key;
+      if (data->queue->packed) {
+        packed_key = bamdb_load_be64(entry_key);
+        key.mv_data = &packed_key;
+      }
+
+      rc = mdb_cursor_put(cur, &key, &val, 0);
+
+      if (rc != MDB_SUCCESS) {
+        fprintf(stderr, "Error inserting data: %s\n", mdb_strerror(rc));
+        ret = BAMDB_DB_ERROR;
+        break;
+      }
+
+      ++n;
+    }
+
+    /* Commit every so often for safety. Rows read are counted rather than
+     * records written so an index of a rare value is checkpointed as often as
+     * any other, and always at the end of a batch. */
+    if (ret == BAMDB_SUCCESS && data->sorter == NULL &&
+        batch->end_row - last_commit_row >= DB_COMMIT_FREQ) {
+      ret = restart_write_txn(env, dbi, &txn, &cur);
+      if (ret == BAMDB_SUCCESS && data->checkpoint != NULL) {
+        record_checkpoint(data->checkpoint, data->writer_id,
+                          batch->end_voffset, batch->end_row);
+      }
+      last_commit_row = batch->end_row;
+      printf("%" PRIu64 " rows read, %" PRIu64
+             " records written. Deserialize queue: %d Write queue: %d "
+             "batches\n",
+             batch->end_row, n, ck_pr_load_int(&deserialize_queue_size),
+             ck_pr_load_int(&write_queue_size));
+    }
+
+    bamdb_queue_push(batch->pool, batch);
+  }
+
+  if (ret != BAMDB_SUCCESS) {
+    fprintf(stderr, "Unable to write the %s index\n", data->key_name);
+    if (cur != NULL) {
+      mdb_cursor_close(cur);
+    }
+    if (txn != NULL) {
+      mdb_txn_abort(txn);
+    }
+  } else if (data->hash) {
+    ret = bulk_load_hash(data->db_path, data->key_name, &data->sorter, 1);
+  } else if (data->table) {
+    ret = bulk_load_table(data->db_path, data->key_name, data->queue->packed,
+                          &data->sorter, 1);
+  } else if (data->sorter != NULL) {
+    ret = bulk_load_lmdb(env, data->key_name, data->queue->packed,
+                         &data->sorter, 1, data->append);
+  } else {
+    mdb_cursor_close(cur);
+    ret = commit_lmdb_transaction(txn);
+    mdb_dbi_close(env, dbi);
+  }
+
+  if (env != NULL) {
+    if (ret == BAMDB_SUCCESS) {
+      mdb_env_sync(env, 1);
+    }
+    mdb_env_close(env);
+  }
+
+  data->ret = ret;
+  pthread_exit(NULL);
+}
+
+static writer_q_t *init_writer_q(char *key, bool packed, size_t num_queues,
+                                 size_t capacity) {
+  if (!is_valid_index_key(key)) {
+    fprintf(stderr, "Target indices must be QNAME, RNAME, POS or a two letter "
+                    "tag optionally typed as XX:i or XX:f, or such fields "
+                    "joined by +\n");
+    return NULL;
+  }
+
+  writer_q_t *new_queue = malloc(sizeof(writer_q_t));
+  new_queue->key = strdup(key);
+  new_queue->packed = packed;
+  new_queue->num_skipped = 0;
+  new_queue->num_queues = num_queues;
+  new_queue->write_qs = calloc(num_queues, sizeof(bamdb_queue_t *));
+  for (size_t i = 0; i < num_queues; ++i) {
+    /* Large enough to hold a deserialize thread's whole write pool, so
+     * pushing never blocks; the pool is what applies backpressure */
+    new_queue->write_qs[i] = bamdb_queue_init(capacity);
+  }
+
+  return new_queue;
+}
+
+static void destroy_writer_q(writer_q_t *queue) {
+  if (queue == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < queue->num_queues; ++i) {
+    bamdb_queue_destroy(queue->write_qs[i]);
+  }
+  free(queue->write_qs);
+  free(queue->key);
+  free(queue);
+}
+
+/* Index one chunk of the file into per-index sorters */
+static void *chunk_func(void *arg) {
+  chunk_thread_data_t *data = (chunk_thread_data_t *)arg;
+  char *work_buffer = malloc(WORK_BUFFER_SIZE);
+  samFile *input_file = NULL;
+  bam_hdr_t *header = NULL;
+  bam1_t *row = bam_init1();
+  row_filter_t filter = {NULL, NULL, 0};
+  const char *key;
+  size_t key_size;
+  int64_t voffset;
+  int r;
+
+  data->ret = BAMDB_SEQUENCE_FILE_ERROR;
+
+  if ((input_file = sam_open(data->input_file_name, "r")) == 0) {
+    fprintf(stderr, "Unable to open file %s\n", data->input_file_name);
+    goto exit;
+  }
+
+  header = sam_hdr_read(input_file);
+  if (header == NULL ||
+      bgzf_seek(input_file->fp.bgzf, data->start, SEEK_SET) != 0) {
+    fprintf(stderr, "Unable to seek to chunk at %" PRId64 "\n", data->start);
+    goto exit;
+  }
+  if (init_row_filter(&filter, data->row_filter, header) != BAMDB_SUCCESS) {
+    goto exit;
+  }
+
+  for (;;) {
+    voffset = bgzf_tell(input_file->fp.bgzf);
+    if (data->end >= 0 && voffset >= data->end) {
+      /* Chunk starts are found heuristically; landing exactly on the next
+       * one proves it really was a record boundary */
+      if (voffset == data->end) {
+        break;
+      }
+      fprintf(stderr,
+              "Chunk boundary at %" PRId64 " is not a record boundary, "
+              "reading on to the next one\n",
+              data->end);
+      data->num_dropped++;
+      data->end = data->num_dropped < data->num_later_starts
+                      ? data->later_starts[data->num_dropped]
+                      : -1;
+      continue;
+    }
+
+    data->end_voffset = voffset;
+    r = sam_read1(input_file, header, row);
+    if (r < 0) {
+      if (r < -1 || data->end >= 0) {
+        fprintf(stderr, "Attempting to process truncated file.\n");
+        goto exit;
+      }
+      break;
+    }
+    if (!keep_row(&filter, row)) {
+      data->num_filtered++;
+      continue;
+    }
+
+    for (size_t i = 0; i < data->num_keys; ++i) {
+      if (!extract_key(row, header, data->keys[i], data->packed[i],
+                       work_buffer, &key, &key_size)) {
+        data->num_skipped++;
+        continue;
+      }
+      if (bamdb_sorter_add(data->sorters[i], key, key_size, voffset) !=
+          BAMDB_SUCCESS) {
+        fprintf(stderr, "Error sorting %s index\n", data->keys[i]);
+        data->ret = BAMDB_INTERNAL_ERROR;
+        goto exit;
+      }
+    }
+    data->num_rows++;
+  }
+
+  data->ret = BAMDB_SUCCESS;
 
-    usleep(100);
+exit:
+  bam_destroy1(row);
+  destroy_row_filter(&filter);
+  if (header != NULL) {
+    bam_hdr_destroy(header);
   }
-
-  ck_pr_dec_int(&deserialize_running);
+  if (input_file != NULL) {
+    sam_close(input_file);
+  }
+  free(work_buffer);
   pthread_exit(NULL);
 }
 
-static void *writer_func(void *arg) {
-  writer_thread_data_t *data = (writer_thread_data_t *)arg;
-
-  MDB_env *env = NULL;
-  MDB_val key, val;
-  MDB_txn *txn = NULL;
-  MDB_dbi dbi;
-  MDB_cursor *cur = NULL;
+/* Merge the sorted chunks of one index into its LMDB directory, table or
+ * hash */
+static void *loader_func(void *arg) {
+  loader_thread_data_t *data = (loader_thread_data_t *)arg;
   char target_path[MAX_PATH_CHARS];
-  uint64_t n = 0;
-  int rc;
+  MDB_env *env = NULL;
 
-  write_entry_t *entry;
-  ck_fifo_mpmc_entry_t *garbage;
+  if (data->hash) {
+    data->ret = bulk_load_hash(data->db_path, data->key_name, data->sorters,
+                               data->num_sorters);
+    pthread_exit(NULL);
+  }
+  if (data->table) {
+    data->ret = bulk_load_table(data->db_path, data->key_name, data->packed,
+                                data->sorters, data->num_sorters);
+    pthread_exit(NULL);
+  }
 
   snprintf(target_path, MAX_PATH_CHARS, "%s/%s", data->db_path, data->key_name);
   mkdir(target_path, 0777);
-  rc = get_lmdb_env(&env, target_path, false);
-  if (rc != BAMDB_SUCCESS) {
-    return NULL;
+  data->ret = get_lmdb_env(&env, target_path, false);
+  if (data->ret != BAMDB_SUCCESS) {
+    pthread_exit(NULL);
   }
 
-  rc = mdb_txn_begin(env, NULL, 0, &txn);
-  if (rc != MDB_SUCCESS) {
-    fprintf(stderr, "Error starting transaction: %s\n", mdb_strerror(rc));
-    return NULL;
-  }
+  data->ret = bulk_load_lmdb(env, data->key_name, data->packed, data->sorters,
+                             data->num_sorters, true);
+  mdb_env_sync(env, 1);
+  mdb_env_close(env);
 
-  rc = mdb_dbi_open(txn, NULL, MDB_DUPSORT | MDB_CREATE | MDB_DUPFIXED, &dbi);
-  if (rc != MDB_SUCCESS) {
-    fprintf(stderr, "Error opening database: %s\n", mdb_strerror(rc));
-    return NULL;
-  }
+  pthread_exit(NULL);
+}
 
-  rc = mdb_cursor_open(txn, dbi, &cur);
-  if (rc != MDB_SUCCESS) {
-    fprintf(stderr, "Error getting cursor: %s\n", mdb_strerror(rc));
-    return NULL;
+/* Index every chunk on its own thread, then merge the chunks of each index on
+ * one thread per index */
+static int generate_chunked_lmdb_index(const char *input_file_name,
+                                       char *db_path, char **keys,
+                                       bool *packed, size_t num_keys,
+                                       bamdb_indices_t *target_indices,
+                                       int64_t *starts, size_t num_chunks,
+                                       int64_t *end_voffset,
+                                       uint64_t *num_rows) {
+  int rc;
+  int ret = BAMDB_SUCCESS;
+  chunk_thread_data_t *chunk_args =
+      calloc(num_chunks, sizeof(chunk_thread_data_t));
+  loader_thread_data_t *loader_args =
+      calloc(num_keys, sizeof(loader_thread_data_t));
+  pthread_t *threads = calloc(num_chunks > num_keys ? num_chunks : num_keys,
+                              sizeof(pthread_t));
+  size_t launched = 0;
+  /* Chunks left once those with a bad start were dropped */
+  size_t num_kept = 0;
+  uint64_t total_rows = 0;
+  uint64_t num_filtered = 0;
+  uint64_t num_skipped = 0;
+  char sorter_name[MAX_PATH_CHARS];
+  size_t sort_buffer_size = target_indices->sort_buffer_size > 0
+                                ? target_indices->sort_buffer_size
+                                : BAMDB_DEFAULT_SORT_BUFFER_SIZE;
+
+  /* Every chunk keeps its own sorter per index, share the budget */
+  sort_buffer_size /= num_chunks;
+  if (sort_buffer_size < MIN_CHUNK_SORT_BUFFER_SIZE) {
+    sort_buffer_size = MIN_CHUNK_SORT_BUFFER_SIZE;
   }
 
-  while (ck_pr_load_int(&deserialize_running) ||
-         CK_FIFO_MPMC_ISEMPTY(data->write_q) == false) {
-    while (ck_fifo_mpmc_trydequeue(data->write_q, &entry, &garbage) == true) {
-      free(garbage);
+  for (size_t i = 0; i < num_chunks; ++i) {
+    chunk_args[i].input_file_name = input_file_name;
+    chunk_args[i].start = starts[i];
+    chunk_args[i].end = i + 1 < num_chunks ? starts[i + 1] : -1;
+    chunk_args[i].later_starts = starts + i + 1;
+    chunk_args[i].num_later_starts = num_chunks - i - 1;
+    chunk_args[i].num_keys = num_keys;
+    chunk_args[i].keys = keys;
+    chunk_args[i].packed = packed;
+    chunk_args[i].row_filter = &target_indices->row_filter;
+    chunk_args[i].sorters = calloc(num_keys, sizeof(bamdb_sorter_t *));
+
+    for (size_t j = 0; j < num_keys; ++j) {
+      snprintf(sorter_name, MAX_PATH_CHARS, "%s.%zu", keys[j], i);
+      chunk_args[i].sorters[j] = bamdb_sorter_init(
+          target_indices->tmp_dir != NULL ? target_indices->tmp_dir : db_path,
+          sorter_name, sort_buffer_size);
+      if (chunk_args[i].sorters[j] == NULL) {
+        ret = BAMDB_INTERNAL_ERROR;
+        goto exit;
+      }
+    }
+  }
 
-      val.mv_size = sizeof(int64_t);
-      val.mv_data = &entry->voffset;
+  printf("Indexing %zu chunks in parallel\n", num_chunks);
+  for (launched = 0; launched < num_chunks; ++launched) {
+    rc = pthread_create(&threads[launched], NULL, chunk_func,
+                        &chunk_args[launched]);
+    if (rc != 0) {
+      fprintf(stderr,
+              "Received non-zero return code when launching chunk thread: "
+              "%d\n",
+              rc);
+      ret = BAMDB_INTERNAL_ERROR;
+      break;
+    }
+  }
 
-      /* insert voffset under bx */
-      key.mv_size = strlen(entry->key);
-      key.mv_data = entry->key;
+  for (size_t i = 0; i < launched; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  if (ret != BAMDB_SUCCESS) {
+    goto exit;
+  }
 
-      rc = mdb_cursor_put(cur, &key, &val, 0);
+  /* The rows of a dropped chunk were read by the chunk before it, whatever
+   * the dropped chunk made of them is discarded */
+  for (size_t i = 0; i < num_chunks; ++i) {
+    if (chunk_args[i].dropped) {
+      continue;
+    }
+    for (size_t j = 1; j <= chunk_args[i].num_dropped; ++j) {
+      chunk_args[i + j].dropped = true;
+    }
 
-      if (rc != MDB_SUCCESS) {
-        fprintf(stderr, "Error inserting data: %s\n", mdb_strerror(rc));
-        return NULL;
+    total_rows += chunk_args[i].num_rows;
+    num_filtered += chunk_args[i].num_filtered;
+    num_skipped += chunk_args[i].num_skipped;
+    if (chunk_args[i].ret != BAMDB_SUCCESS) {
+      ret = chunk_args[i].ret;
+    }
+    *end_voffset = chunk_args[i].end_voffset;
+    num_kept++;
+  }
+  if (ret != BAMDB_SUCCESS) {
+    goto exit;
+  }
+  printf("%" PRIu64 " records read\n", total_rows + num_filtered);
+  if (num_filtered > 0) {
+    printf("%" PRIu64 " rows were left out by the row filter\n",
+           num_filtered);
+  }
+  if (num_skipped > 0) {
+    fprintf(stderr,
+            "%" PRIu64 " values were missing or of the wrong type for their "
+            "index and were left out\n",
+            num_skipped);
+  }
+  *num_rows = total_rows;
+
+  for (launched = 0; launched < num_keys; ++launched) {
+    loader_thread_data_t *loader = &loader_args[launched];
+
+    loader->db_path = db_path;
+    loader->key_name = keys[launched];
+    loader->packed = packed[launched];
+    loader->table = target_indices->backend == BAMDB_BACKEND_TABLE;
+    loader->hash = is_hashed_index(target_indices, keys[launched]);
+    loader->sorters = calloc(num_kept, sizeof(bamdb_sorter_t *));
+    for (size_t i = 0; i < num_chunks; ++i) {
+      if (!chunk_args[i].dropped) {
+        loader->sorters[loader->num_sorters++] =
+            chunk_args[i].sorters[launched];
       }
+    }
 
-      free(entry->key);
-      free(entry);
+    rc = pthread_create(&threads[launched], NULL, loader_func, loader);
+    if (rc != 0) {
+      fprintf(stderr,
+              "Received non-zero return code when launching writer thread: "
+              "%d\n",
+              rc);
+      ret = BAMDB_INTERNAL_ERROR;
+      break;
+    }
+  }
 
-      ++n;
-      ck_pr_dec_int(&write_queue_size);
-      /* commit every so often for safety */
-      if (n % DB_COMMIT_FREQ == 0) {
-        mdb_cursor_close(cur);
-        commit_lmdb_transaction(txn);
-        printf("%" PRIu64
-               " records written. Deserialize queue: %d Write queue: %d\n",
-               n, ck_pr_load_int(&deserialize_queue_size),
-               ck_pr_load_int(&write_queue_size));
-        rc = mdb_txn_begin(env, NULL, 0, &txn);
-        if (rc != MDB_SUCCESS) {
-          fprintf(stderr, "Error starting transaction: %s\n", mdb_strerror(rc));
-          return NULL;
-        }
+  for (size_t i = 0; i < launched; ++i) {
+    pthread_join(threads[i], NULL);
+    if (loader_args[i].ret != BAMDB_SUCCESS) {
+      ret = loader_args[i].ret;
+    }
+  }
 
-        rc = mdb_cursor_open(txn, dbi, &cur);
-        if (rc != MDB_SUCCESS) {
-          fprintf(stderr, "Error getting cursor: %s\n", mdb_strerror(rc));
-          return NULL;
-        }
+exit:
+  for (size_t i = 0; i < num_chunks; ++i) {
+    if (chunk_args[i].sorters != NULL) {
+      for (size_t j = 0; j < num_keys; ++j) {
+        bamdb_sorter_destroy(chunk_args[i].sorters[j]);
       }
+      free(chunk_args[i].sorters);
     }
-
-    usleep(100);
   }
+  for (size_t i = 0; i < num_keys; ++i) {
+    free(loader_args[i].sorters);
+  }
+  free(loader_args);
+  free(chunk_args);
+  free(threads);
 
-  mdb_cursor_close(cur);
-  commit_lmdb_transaction(txn);
-  mdb_env_sync(env, 1);
-  mdb_dbi_close(env, dbi);
-  mdb_env_close(env);
-
-  pthread_exit(NULL);
+  return ret;
 }
 
-static writer_q_t *init_writer_q(char *key) {
-  if (strlen(key) != 2 && strncmp("QNAME", key, 5) != 0) {
-    fprintf(stderr, "Target indices must be QNAME or a two letter string key");
-    return NULL;
+#define NS_TO_SEC(ns) ((double)(ns) / 1e9)
+
+/* Report how long each stage spent waiting on its neighbours. A stage that
+ * rarely waits for input while the others do is the bottleneck. */
+static void print_blocked_times(bamdb_queue_t *row_pool,
+                                deserialize_thread_data_t *deserialize_args,
+                                size_t n_deserialize,
+                                writer_q_t **write_queues,
+                                size_t total_indices) {
+  /* Producers wait on their free pools, consumers on their input queues */
+  uint64_t reader_blocked = bamdb_queue_pop_wait_ns(row_pool);
+  uint64_t deserialize_starved = 0;
+  uint64_t deserialize_blocked = 0;
+
+  for (size_t i = 0; i < n_deserialize; ++i) {
+    deserialize_starved += bamdb_queue_pop_wait_ns(deserialize_args[i].read_q);
+    deserialize_blocked +=
+        bamdb_queue_pop_wait_ns(deserialize_args[i].write_pool);
   }
 
-  writer_q_t *new_queue = malloc(sizeof(writer_q_t));
-  new_queue->key = strndup(key, 5);
-  new_queue->write_q = calloc(1, sizeof(ck_fifo_mpmc_t));
-  ck_fifo_mpmc_init(new_queue->write_q, malloc(sizeof(ck_fifo_mpmc_entry_t)));
-
-  return new_queue;
+  printf("Time blocked (seconds, summed over threads):\n");
+  printf("  reader waiting on deserialize: %.2f\n", NS_TO_SEC(reader_blocked));
+  printf("  deserialize waiting on reader: %.2f\n",
+         NS_TO_SEC(deserialize_starved));
+  printf("  deserialize waiting on writers: %.2f\n",
+         NS_TO_SEC(deserialize_blocked));
+
+  for (size_t i = 0; i < total_indices; ++i) {
+    uint64_t writer_starved = 0;
+    for (size_t j = 0; j < write_queues[i]->num_queues; ++j) {
+      writer_starved += bamdb_queue_pop_wait_ns(write_queues[i]->write_qs[j]);
+    }
+    printf("  %s writer waiting on deserialize: %.2f\n", write_queues[i]->key,
+           NS_TO_SEC(writer_starved));
+  }
 }
 
-int generate_lmdb_index(samFile *input_file, char *db_path,
-                        bamdb_indices_t *target_indices) {
+/* Index the rows from start_voffset (or the first row if negative) to the end
+ * of the file with a single reader feeding the deserialize and writer threads.
+ * Existing indices are added to unless the build starts from the first row. */
+static int generate_pipelined_lmdb_index(samFile *input_file, char *db_path,
+                                         bamdb_indices_t *target_indices,
+                                         checkpoint_t *checkpoint,
+                                         int64_t start_voffset,
+                                         int64_t *end_voffset,
+                                         uint64_t *num_rows) {
   int rc;
   int r = 0;
   int ret = BAMDB_SUCCESS;
   bam_hdr_t *header = NULL;
-  bool default_db_path = false;
-
-  deserialize_thread_data_t deserialize_thread_args;
-
+  row_filter_t filter = {NULL, NULL, 0};
+  uint64_t num_filtered = 0;
+  size_t next_thread = 0;
+  bamdb_queue_t *row_pool = NULL;
+  row_batch_t *rows;
+  /* Threads started so far, always the first slots of threads */
+  size_t n_launched = 0;
+
+  size_t n_deserialize = target_indices->num_deserialize_threads > 0
+                             ? target_indices->num_deserialize_threads
+                             : 1;
   size_t total_indices = target_indices->num_key_indices +
                          (target_indices->includes_qname ? 1 : 0);
-  /* One writer thread per index, one for deserialization */
-  size_t n_threads = 1 + total_indices;
+  /* One writer thread per index, the rest deserialize */
+  size_t n_threads = n_deserialize + total_indices;
   pthread_t *threads = calloc(n_threads, sizeof(pthread_t));
-
-  deserialize_thread_args.num_keys = total_indices;
-  deserialize_thread_args.write_queues =
-      calloc(total_indices, sizeof(writer_q_t));
+  writer_q_t **write_queues = calloc(total_indices, sizeof(writer_q_t *));
+  writer_thread_data_t **writer_args =
+      calloc(total_indices, sizeof(writer_thread_data_t *));
+  deserialize_thread_data_t *deserialize_args =
+      calloc(n_deserialize, sizeof(deserialize_thread_data_t));
+  size_t n_row_batches = ROW_BATCHES_PER_THREAD * n_deserialize;
+  size_t n_write_batches = WRITE_BATCHES_PER_INDEX * total_indices;
 
   for (size_t i = 0; i < target_indices->num_key_indices; ++i) {
-    writer_q_t *new_queue = init_writer_q(target_indices->key_indices[i]);
+    writer_q_t *new_queue =
+        init_writer_q(target_indices->key_indices[i],
+                      is_packed_index(target_indices, i), n_deserialize,
+                      n_write_batches);
 
     if (new_queue == NULL) {
       ret = 1;
       goto exit;
     }
 
-    deserialize_thread_args.write_queues[i] = new_queue;
+    write_queues[i] = new_queue;
   }
 
   if (target_indices->includes_qname) {
-    deserialize_thread_args.write_queues[target_indices->num_key_indices] =
-        init_writer_q("QNAME");
+    write_queues[target_indices->num_key_indices] =
+        init_writer_q("QNAME", false, n_deserialize, n_write_batches);
+    if (write_queues[target_indices->num_key_indices] == NULL) {
+      ret = 1;
+      goto exit;
+    }
+  }
+
+  row_pool = bamdb_queue_init(n_row_batches);
+  for (size_t i = 0; i < n_row_batches; ++i) {
+    bamdb_queue_push(row_pool, init_row_batch());
   }
 
-  deserialize_q = calloc(1, sizeof(ck_fifo_mpmc_t));
-  ck_fifo_mpmc_init(deserialize_q, malloc(sizeof(ck_fifo_mpmc_entry_t)));
+  for (size_t i = 0; i < n_deserialize; ++i) {
+    deserialize_args[i].thread_id = i;
+    deserialize_args[i].num_keys = total_indices;
+    deserialize_args[i].write_queues = write_queues;
+    deserialize_args[i].read_q = bamdb_queue_init(n_row_batches);
+    deserialize_args[i].row_pool = row_pool;
+    deserialize_args[i].write_pool = bamdb_queue_init(n_write_batches);
+    for (size_t j = 0; j < n_write_batches; ++j) {
+      bamdb_queue_push(deserialize_args[i].write_pool,
+                       init_write_batch(deserialize_args[i].write_pool));
+    }
+  }
 
-  reader_running = 1;
-  deserialize_running = 1;
   write_queue_size = 0;
   deserialize_queue_size = 0;
+  *num_rows = 0;
 
-  if (db_path == NULL) {
-    db_path = get_default_dbname(input_file->fn);
-    default_db_path = true;
+  /* HTSlib inflates BGZF blocks ahead of us on its own thread pool but still
+   * hands them over in file order, so bgzf_tell stays exact for every row */
+  if (target_indices->num_decompress_threads > 0) {
+    rc = hts_set_threads(input_file, target_indices->num_decompress_threads);
+    if (rc != 0) {
+      fprintf(stderr,
+              "Unable to start %zu decompression threads, continuing with "
+              "single threaded decompression\n",
+              target_indices->num_decompress_threads);
+    }
   }
-  mkdir(db_path, 0777);
-  fprintf(stdout,
-          "Attempting to convert bam file %s into lmdb database at path %s\n",
-          input_file->fn, db_path);
 
   header = sam_hdr_read(input_file);
   if (header == NULL) {
@@ -283,75 +1986,504 @@ int generate_lmdb_index(samFile *input_file, char *db_path,
     ret = 1;
     goto exit;
   }
+  ret = init_row_filter(&filter, &target_indices->row_filter, header);
+  if (ret != BAMDB_SUCCESS) {
+    goto exit;
+  }
 
-  deserialize_thread_args.header = header;
-  rc = pthread_create(&threads[0], NULL, deserialize_func,
-                      &deserialize_thread_args);
-  if (rc != 0) {
-    fprintf(stderr,
-            "Received non-zero return code when launching deserialize "
-            "thread: %d\n",
-            rc);
-    ret = BAMDB_INTERNAL_ERROR;
+  if (start_voffset >= 0 &&
+      bgzf_seek(input_file->fp.bgzf, start_voffset, SEEK_SET) != 0) {
+    fprintf(stderr, "Unable to seek to %" PRId64 " in %s\n", start_voffset,
+            input_file->fn);
+    ret = BAMDB_SEQUENCE_FILE_ERROR;
     goto exit;
   }
 
-  /* Init writer threads, one per key */
-  for (size_t i = 0; i < deserialize_thread_args.num_keys; ++i) {
-    // TODO: free these after we're done
+  /* Set up every writer before any thread starts, so only a failed launch
+   * has threads to stop */
+  for (size_t i = 0; i < total_indices; ++i) {
     writer_thread_data_t *new_writer_args =
         malloc(sizeof(writer_thread_data_t));
-    new_writer_args->write_q = deserialize_thread_args.write_queues[i]->write_q;
-    new_writer_args->key_name = deserialize_thread_args.write_queues[i]->key;
+    writer_args[i] = new_writer_args;
+    new_writer_args->queue = write_queues[i];
+    new_writer_args->key_name = write_queues[i]->key;
     new_writer_args->db_path = db_path;
+    new_writer_args->sorter = NULL;
+    new_writer_args->append = start_voffset < 0;
+    new_writer_args->table = target_indices->backend == BAMDB_BACKEND_TABLE;
+    new_writer_args->hash =
+        is_hashed_index(target_indices, new_writer_args->key_name);
+    new_writer_args->checkpoint = checkpoint;
+    new_writer_args->writer_id = i;
+    new_writer_args->ret = BAMDB_SUCCESS;
+    /* Tables and hashes can only be written in key order */
+    if (target_indices->sorted_build || new_writer_args->table ||
+        new_writer_args->hash) {
+      new_writer_args->sorter = bamdb_sorter_init(
+          target_indices->tmp_dir != NULL ? target_indices->tmp_dir : db_path,
+          new_writer_args->key_name, target_indices->sort_buffer_size);
+      if (new_writer_args->sorter == NULL) {
+        ret = BAMDB_INTERNAL_ERROR;
+        goto exit;
+      }
+      /* Nothing is committed until every row has been sorted */
+      new_writer_args->checkpoint = NULL;
+    }
+  }
+
+  for (size_t i = 0; i < n_deserialize; ++i) {
+    deserialize_args[i].header = header;
+    rc = pthread_create(&threads[i], NULL, deserialize_func,
+                        &deserialize_args[i]);
+    if (rc != 0) {
+      fprintf(stderr,
+              "Received non-zero return code when launching deserialize "
+              "thread: %d\n",
+              rc);
+      ret = BAMDB_INTERNAL_ERROR;
+      goto stop_threads;
+    }
+    ++n_launched;
+  }
 
-    /* Slot 0 is deserialize threads */
-    rc = pthread_create(&threads[i + 1], NULL, writer_func, new_writer_args);
+  /* Init writer threads, one per key */
+  for (size_t i = 0; i < total_indices; ++i) {
+    /* The first slots are deserialize threads */
+    rc = pthread_create(&threads[n_deserialize + i], NULL, writer_func,
+                        writer_args[i]);
     if (rc != 0) {
       fprintf(
           stderr,
           "Received non-zero return code when launching writer thread: %d\n",
           rc);
       ret = BAMDB_INTERNAL_ERROR;
-      goto exit;
+      goto stop_threads;
     }
+    ++n_launched;
   }
 
   /* This thread serves as the reader thread */
   while (r >= 0) {
-    bam_data_t *entry = malloc(sizeof(bam_data_t));
-    ck_fifo_mpmc_entry_t *fifo_entry = malloc(sizeof(ck_fifo_mpmc_entry_t));
-    entry->bam_row = bam_init1();
-
-    while (ck_pr_load_int(&deserialize_queue_size) >
-           MAX_DESERIALIZE_QUEUE_SIZE) {
-      usleep(100);
+    /* Blocks until a deserialize thread hands a batch back */
+    bamdb_queue_pop(row_pool, (void **)&rows);
+    rows->num_rows = 0;
+
+    while (rows->num_rows < ROW_BATCH_SIZE) {
+      rows->voffsets[rows->num_rows] = bgzf_tell(input_file->fp.bgzf);
+      r = sam_read1(input_file, header, rows->rows[rows->num_rows]);
+      if (r < 0) {
+        *end_voffset = rows->voffsets[rows->num_rows];
+        break;
+      }
+      /* Rows left out are never handed on, their slot is simply reused */
+      if (!keep_row(&filter, rows->rows[rows->num_rows])) {
+        ++num_filtered;
+        continue;
+      }
+      rows->num_rows++;
     }
+    *num_rows += rows->num_rows;
+    /* Lets writers checkpoint between batches, where nothing they committed
+     * has to be read again on resume */
+    rows->end_voffset = r < 0 ? *end_voffset : bgzf_tell(input_file->fp.bgzf);
+    rows->end_row = *num_rows;
 
-    entry->voffset = bgzf_tell(input_file->fp.bgzf);
-    r = sam_read1(input_file, header, entry->bam_row);
-    if (r >= 0) {
-      ck_fifo_mpmc_enqueue(deserialize_q, fifo_entry, entry);
+    if (rows->num_rows > 0) {
       ck_pr_inc_int(&deserialize_queue_size);
+      bamdb_queue_push(deserialize_args[next_thread].read_q, rows);
+      /* Writers rely on batches being dealt out strictly in turn */
+      next_thread = (next_thread + 1) % n_deserialize;
+    } else {
+      bamdb_queue_push(row_pool, rows);
     }
   }
-  ck_pr_dec_int(&reader_running);
 
+stop_threads:
+  for (size_t i = 0; i < n_deserialize; ++i) {
+    bamdb_queue_close(deserialize_args[i].read_q);
+  }
+  /* If a thread failed to launch no row was read, so the writers started can
+   * be stopped straight away whichever deserialize threads are running */
+  if (n_launched < n_threads) {
+    for (size_t i = 0; i < total_indices; ++i) {
+      for (size_t j = 0; j < n_deserialize; ++j) {
+        bamdb_queue_close(write_queues[i]->write_qs[j]);
+      }
+    }
+  }
+
+  /* Still wait for the other stages, they have already been told there is no
+   * more input */
   if (r < -1) {
     fprintf(stderr, "Attempting to process truncated file.\n");
     ret = BAMDB_SEQUENCE_FILE_ERROR;
-    goto exit;
   }
 
-  /* Wait for deserialize thread */
-  pthread_join(threads[0], NULL);
+  /* Wait for deserialize threads */
+  for (size_t i = 0; i < n_launched && i < n_deserialize; ++i) {
+    pthread_join(threads[i], NULL);
+  }
 
   /* Wait for writers */
-  for (size_t i = 1; i < deserialize_thread_args.num_keys + 1; ++i) {
+  for (size_t i = n_deserialize; i < n_launched; ++i) {
     pthread_join(threads[i], NULL);
+    if (writer_args[i - n_deserialize]->ret != BAMDB_SUCCESS) {
+      ret = writer_args[i - n_deserialize]->ret;
+    }
+  }
+  if (n_launched < n_threads) {
+    goto exit;
+  }
+
+  if (num_filtered > 0) {
+    printf("%" PRIu64 " rows were left out by the row filter\n",
+           num_filtered);
+  }
+  for (size_t i = 0; i < total_indices; ++i) {
+    if (write_queues[i]->num_skipped > 0) {
+      fprintf(stderr,
+              "%" PRIu64 " rows had no value that fits the %s index and were "
+              "left out\n",
+              write_queues[i]->num_skipped, write_queues[i]->key);
+    }
   }
+
+  print_blocked_times(row_pool, deserialize_args, n_deserialize, write_queues,
+                      total_indices);
+
 exit:
+  /* Every batch is back in its pool once all threads are done. Whatever was
+   * not set up yet is still NULL. */
+  destroy_row_pool(row_pool);
+  for (size_t i = 0; i < n_deserialize; ++i) {
+    bamdb_queue_destroy(deserialize_args[i].read_q);
+    destroy_write_pool(deserialize_args[i].write_pool);
+  }
+  for (size_t i = 0; i < total_indices; ++i) {
+    destroy_writer_q(write_queues[i]);
+  }
+  free(deserialize_args);
+  free(write_queues);
+  if (header != NULL) {
+    bam_hdr_destroy(header);
+  }
+  destroy_row_filter(&filter);
   free(threads);
+  for (size_t i = 0; i < total_indices; ++i) {
+    if (writer_args[i] != NULL) {
+      bamdb_sorter_destroy(writer_args[i]->sorter);
+      free(writer_args[i]);
+    }
+  }
+  free(writer_args);
+
+  return ret;
+}
+
+/* Check that metadata or a checkpoint was written for a prefix of the file
+ * and holds every requested index */
+static int check_meta(const char *db_path, const char *input_file_name,
+                      char **keys, size_t num_keys, const char *row_filter,
+                      const bamdb_meta_t *meta) {
+  bamdb_fingerprint_t prefix;
+  int rc;
+
+  for (size_t i = 0; i < num_keys; ++i) {
+    if (!bamdb_meta_has_index(meta, keys[i])) {
+      fprintf(stderr,
+              "The %s index is not part of %s, rebuild the index instead\n",
+              keys[i], db_path);
+      return BAMDB_STALE_INDEX_ERROR;
+    }
+  }
+
+  /* New rows have to be filtered the way the existing ones were */
+  if ((row_filter == NULL) != (meta->row_filter == NULL) ||
+      (row_filter != NULL && strcmp(row_filter, meta->row_filter) != 0)) {
+    fprintf(stderr,
+            "%s was built with a different row filter, rebuild the index "
+            "instead\n",
+            db_path);
+    return BAMDB_STALE_INDEX_ERROR;
+  }
+
+  rc = bamdb_fingerprint_file(input_file_name, meta->fingerprint.file_size,
+                              &prefix);
+  if (rc != BAMDB_SUCCESS) {
+    return rc;
+  }
+
+  if (!bamdb_fingerprint_equal(&prefix, &meta->fingerprint)) {
+    fprintf(stderr,
+            "%s has changed since %s was built, rebuild the index instead\n",
+            input_file_name, db_path);
+    return BAMDB_STALE_INDEX_ERROR;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+/* Whether an index is stored as a table or hash, which never take more
+ * rows */
+static bool is_immutable_index(const char *db_path, const char *key_name) {
+  char target_path[MAX_PATH_CHARS];
+  struct stat st;
+
+  bamdb_table_path(target_path, MAX_PATH_CHARS, db_path, key_name);
+  if (stat(target_path, &st) == 0) {
+    return true;
+  }
+
+  bamdb_hash_path(target_path, MAX_PATH_CHARS, db_path, key_name);
+  return stat(target_path, &st) == 0;
+}
+
+int generate_lmdb_index(samFile *input_file, char *db_path,
+                        bamdb_indices_t *target_indices) {
+  int rc;
+  int ret = BAMDB_SUCCESS;
+  bool default_db_path = false;
+  bool table = target_indices->backend == BAMDB_BACKEND_TABLE;
+  bamdb_meta_t meta = {0};
+  bamdb_meta_t new_meta = {0};
+  checkpoint_t *checkpoint = NULL;
+  uint64_t base_rows = 0;
+  int64_t start_voffset = -1;
+  int64_t end_voffset = -1;
+  uint64_t num_rows = 0;
+  size_t total_indices = target_indices->num_key_indices +
+                         (target_indices->includes_qname ? 1 : 0);
+  char **keys = calloc(total_indices, sizeof(char *));
+  bool *packed = calloc(total_indices, sizeof(bool));
+  /* Names recorded in the metadata, which tell packed indices apart */
+  char **index_names = calloc(total_indices, sizeof(char *));
+
+  for (size_t i = 0; i < target_indices->num_key_indices; ++i) {
+    if (!is_valid_index_key(target_indices->key_indices[i])) {
+      fprintf(stderr, "Target indices must be QNAME, RNAME, POS or a two "
+                      "letter tag optionally typed as XX:i or XX:f, or such "
+                      "fields joined by +\n");
+      ret = 1;
+      goto exit;
+    }
+    keys[i] = target_indices->key_indices[i];
+    packed[i] = is_packed_index(target_indices, i);
+    if (packed[i] && bamdb_key_type(keys[i]) != BAMDB_KEY_STRING) {
+      fprintf(stderr, "Only string indices can be packed, not %s\n", keys[i]);
+      ret = 1;
+      goto exit;
+    }
+  }
+  if (target_indices->includes_qname) {
+    keys[target_indices->num_key_indices] = "QNAME";
+  }
+  if (table && (target_indices->update || target_indices->resume ||
+                target_indices->single_env ||
+                target_indices->compress_postings)) {
+    fprintf(stderr, "Table indices are written once from a sorted build and "
+                    "cannot be updated, resumed, compressed or stored in a "
+                    "single environment\n");
+    ret = 1;
+    goto exit;
+  }
+  if (target_indices->hash_qname &&
+      (target_indices->update || target_indices->resume)) {
+    fprintf(stderr, "A hashed QNAME index is written once from a sorted "
+                    "build and cannot be updated or resumed\n");
+    ret = 1;
+    goto exit;
+  }
+
+  for (size_t i = 0; i < total_indices; ++i) {
+    index_names[i] =
+        malloc(strlen(keys[i]) + sizeof(BAMDB_PACKED_INDEX_SUFFIX));
+    sprintf(index_names[i], "%s%s", keys[i],
+            packed[i] ? BAMDB_PACKED_INDEX_SUFFIX : "");
+  }
+
+  if (db_path == NULL) {
+    db_path = get_default_dbname(input_file->fn);
+    default_db_path = true;
+  }
+  mkdir(db_path, 0777);
+  fprintf(stdout,
+          "Attempting to convert bam file %s into lmdb database at path %s\n",
+          input_file->fn, db_path);
+
+  /* Taken before any row is read, rows appended while we index are simply
+   * picked up again by the next update */
+  ret = bamdb_fingerprint_file(input_file->fn, -1, &new_meta.fingerprint);
+  new_meta.row_filter = describe_row_filter(&target_indices->row_filter);
+  if (ret != BAMDB_SUCCESS) {
+    goto exit;
+  }
+
+  for (size_t i = 0; i < total_indices; ++i) {
+    if ((target_indices->update || target_indices->resume) &&
+        is_immutable_index(db_path, keys[i])) {
+      fprintf(stderr,
+              "The %s index of %s is a table or hash, rebuild the index "
+              "instead\n",
+              keys[i], db_path);
+      ret = BAMDB_STALE_INDEX_ERROR;
+      goto exit;
+    }
+  }
+
+  /* A checkpoint is always further along than the metadata of the previous
+   * build, so it is preferred when resuming an interrupted update as well */
+  if (target_indices->resume &&
+      bamdb_read_checkpoint(db_path, &meta) == BAMDB_SUCCESS) {
+    ret = check_meta(db_path, input_file->fn, index_names, total_indices,
+                     new_meta.row_filter, &meta);
+    if (ret != BAMDB_SUCCESS) {
+      fprintf(stderr, "Unable to resume from the checkpoint in %s\n", db_path);
+      goto exit;
+    }
+
+    printf("Resuming after the %" PRIu64 " rows indexed before the "
+           "checkpoint\n",
+           meta.num_rows);
+    start_voffset = meta.end_voffset;
+    base_rows = meta.num_rows;
+  } else if (target_indices->update) {
+    ret = bamdb_read_meta(db_path, &meta);
+    if (ret == BAMDB_SUCCESS) {
+      ret = check_meta(db_path, input_file->fn, index_names, total_indices,
+                       new_meta.row_filter, &meta);
+    }
+    if (ret != BAMDB_SUCCESS) {
+      fprintf(stderr, "Unable to update %s, rebuild the index instead\n",
+              db_path);
+      goto exit;
+    }
+
+    if (bamdb_fingerprint_equal(&new_meta.fingerprint, &meta.fingerprint)) {
+      printf("%s is already up to date\n", db_path);
+      goto exit;
+    }
+
+    printf("Indexing rows appended after the %" PRIu64 " already indexed\n",
+           meta.num_rows);
+    start_voffset = meta.end_voffset;
+    base_rows = meta.num_rows;
+  } else {
+    /* A partial rebuild must not look like a complete index */
+    bamdb_remove_meta(db_path);
+  }
+
+  if (target_indices->resume && start_voffset < 0) {
+    printf("No checkpoint found in %s, starting from the beginning\n",
+           db_path);
+  }
+  if (!target_indices->resume) {
+    bamdb_remove_checkpoint(db_path);
+  }
+
+  /* A filter that misses keys added below would hide them from lookups, and
+   * lookups prefer a table or hash left by an earlier build over a new LMDB
+   * index. A build from the first row also starts each index from an empty
+   * environment, as sorted builds append to it and stale pairs would
+   * otherwise outlive the rebuild. */
+  for (size_t i = 0; i < total_indices; ++i) {
+    char target_path[MAX_PATH_CHARS];
+
+    if (start_voffset < 0) {
+      remove_index_env(db_path, keys[i]);
+    }
+
+    bamdb_bloom_path(target_path, MAX_PATH_CHARS, db_path, keys[i]);
+    remove(target_path);
+    bamdb_table_path(target_path, MAX_PATH_CHARS, db_path, keys[i]);
+    remove(target_path);
+    bamdb_hash_path(target_path, MAX_PATH_CHARS, db_path, keys[i]);
+    remove(target_path);
+    bamdb_remove_stats(db_path, keys[i]);
+  }
+
+  if (target_indices->num_chunks > 1 && start_voffset < 0) {
+    int64_t *starts = NULL;
+    size_t num_starts = 0;
+
+    rc = bam_find_chunks(input_file->fn, target_indices->num_chunks, &starts,
+                         &num_starts);
+    if (rc == BAMDB_SUCCESS && num_starts > 1) {
+      ret = generate_chunked_lmdb_index(input_file->fn, db_path, keys, packed,
+                                        total_indices, target_indices, starts,
+                                        num_starts, &end_voffset, &num_rows);
+      free(starts);
+      goto write_meta;
+    }
+
+    free(starts);
+    fprintf(stderr,
+            "Unable to split %s into chunks, indexing it with a single "
+            "reader\n",
+            input_file->fn);
+  }
+
+  checkpoint = init_checkpoint(db_path, total_indices, base_rows,
+                               &new_meta.fingerprint, index_names,
+                               new_meta.row_filter);
+  ret = generate_pipelined_lmdb_index(input_file, db_path, target_indices,
+                                      checkpoint, start_voffset, &end_voffset,
+                                      &num_rows);
+
+write_meta:
+  /* Indices are always built in their own environments so the writers never
+   * contend for LMDB's single write transaction, and are moved over after */
+  if (ret == BAMDB_SUCCESS && !table &&
+      (target_indices->single_env || target_indices->compress_postings ||
+       is_single_env(db_path))) {
+    /* A hash has no environment to move */
+    char **lmdb_keys = calloc(total_indices, sizeof(char *));
+    size_t num_lmdb_keys = 0;
+
+    for (size_t i = 0; i < total_indices; ++i) {
+      if (!is_hashed_index(target_indices, keys[i])) {
+        lmdb_keys[num_lmdb_keys++] = keys[i];
+      }
+    }
+    ret = pack_lmdb_indices(db_path, lmdb_keys, num_lmdb_keys,
+                            start_voffset < 0,
+                            target_indices->compress_postings);
+    free(lmdb_keys);
+  }
+  for (size_t i = 0; i < total_indices && ret == BAMDB_SUCCESS; ++i) {
+    /* Hashes write their statistics as they are filled */
+    if (is_hashed_index(target_indices, keys[i])) {
+      continue;
+    }
+    if (table) {
+      ret = write_table_summary(db_path, keys[i]);
+    } else {
+      ret = write_index_summary(db_path, keys[i], is_single_env(db_path));
+    }
+  }
+  if (ret == BAMDB_SUCCESS) {
+    new_meta.end_voffset = end_voffset;
+    new_meta.num_rows = base_rows + num_rows;
+    new_meta.num_indices = total_indices;
+    new_meta.indices = index_names;
+    ret = bamdb_write_meta(db_path, &new_meta);
+  }
+  /* Keep the checkpoint of a failed build around for --resume */
+  if (ret == BAMDB_SUCCESS) {
+    bamdb_remove_checkpoint(db_path);
+  }
+
+exit:
+  if (checkpoint != NULL) {
+    destroy_checkpoint(checkpoint);
+  }
+  bamdb_free_meta(&meta);
+  free(new_meta.row_filter);
+  for (size_t i = 0; i < total_indices; ++i) {
+    free(index_names[i]);
+  }
+  free(index_names);
+  free(packed);
+  free(keys);
   if (default_db_path) {
     free(db_path);
   }
@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bamdb_key.h"
+
+#define SIGN_BIT ((uint64_t)1 << 63)
+
+/* Binning scheme of the SAM specification, 16kb bins at the finest level and
+ * each level above 8 times as wide */
+#define BIN_MIN_SHIFT 14
+#define BIN_LEVELS 5
+
+bamdb_key_type_t bamdb_key_type(const char *index_name) {
+  if (strchr(index_name, BAMDB_FIELD_SEPARATOR) != NULL) {
+    return BAMDB_KEY_COMPOSITE;
+  }
+  if (strcmp(index_name, BAMDB_REGION_INDEX) == 0) {
+    return BAMDB_KEY_REGION;
+  }
+  if (strlen(index_name) == 4 && index_name[2] == ':') {
+    switch (index_name[3]) {
+      case 'i':
+        return BAMDB_KEY_INT;
+      case 'f':
+        return BAMDB_KEY_FLOAT;
+    }
+  }
+
+  return BAMDB_KEY_STRING;
+}
+
+void bamdb_store_be64(uint64_t value, void *buffer) {
+  unsigned char *bytes = buffer;
+
+  for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+    bytes[i] = (unsigned char)(value >> (8 * (sizeof(uint64_t) - 1 - i)));
+  }
+}
+
+uint64_t bamdb_load_be64(const void *buffer) {
+  const unsigned char *bytes = buffer;
+  uint64_t value = 0;
+
+  for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+    value = (value << 8) | bytes[i];
+  }
+
+  return value;
+}
+
+/* Flipping the sign bit moves negative values below positive ones */
+void bamdb_encode_int_key(int64_t value, void *buffer) {
+  bamdb_store_be64((uint64_t)value ^ SIGN_BIT, buffer);
+}
+
+int64_t bamdb_decode_int_key(const void *buffer) {
+  return (int64_t)(bamdb_load_be64(buffer) ^ SIGN_BIT);
+}
+
+/* Positive doubles already order like their bits once the sign bit is set,
+ * negative ones need every bit flipped to reverse their order */
+void bamdb_encode_float_key(double value, void *buffer) {
+  uint64_t bits;
+
+  /* -0.0 and 0.0 are the same key */
+  if (value == 0) {
+    value = 0;
+  }
+  memcpy(&bits, &value, sizeof(bits));
+  bamdb_store_be64((bits & SIGN_BIT) ? ~bits : bits ^ SIGN_BIT, buffer);
+}
+
+double bamdb_decode_float_key(const void *buffer) {
+  uint64_t bits = bamdb_load_be64(buffer);
+  double value;
+
+  bits = (bits & SIGN_BIT) ? bits ^ SIGN_BIT : ~bits;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+bool bamdb_parse_typed_key(bamdb_key_type_t type, const char *text,
+                           void *buffer) {
+  char *end;
+
+  errno = 0;
+  if (type == BAMDB_KEY_INT) {
+    int64_t value = strtoll(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0') {
+      return false;
+    }
+    bamdb_encode_int_key(value, buffer);
+    return true;
+  } else if (type == BAMDB_KEY_FLOAT) {
+    double value = strtod(text, &end);
+    if (errno != 0 || end == text || *end != '\0') {
+      return false;
+    }
+    bamdb_encode_float_key(value, buffer);
+    return true;
+  }
+
+  return false;
+}
+
+const char *bamdb_next_field(const char *name,
+                             char field[BAMDB_MAX_FIELD_CHARS]) {
+  const char *separator = strchr(name, BAMDB_FIELD_SEPARATOR);
+  size_t len = separator != NULL ? (size_t)(separator - name) : strlen(name);
+
+  if (len >= BAMDB_MAX_FIELD_CHARS) {
+    len = BAMDB_MAX_FIELD_CHARS - 1;
+  }
+  memcpy(field, name, len);
+  field[len] = '\0';
+
+  return separator != NULL ? separator + 1 : NULL;
+}
+
+bool bamdb_encode_composite_key(const char *index_name, const char *values,
+                                void *buffer, size_t *key_size, bool *prefix) {
+  char field[BAMDB_MAX_FIELD_CHARS];
+  char value[BAMDB_MAX_KEY_SIZE];
+  unsigned char *out = buffer;
+  const char *separator;
+  size_t len;
+  bamdb_key_type_t type;
+
+  *key_size = 0;
+  while (index_name != NULL && values != NULL) {
+    index_name = bamdb_next_field(index_name, field);
+
+    separator = strchr(values, BAMDB_FIELD_SEPARATOR);
+    len = separator != NULL ? (size_t)(separator - values) : strlen(values);
+    if (len >= BAMDB_MAX_KEY_SIZE) {
+      return false;
+    }
+    memcpy(value, values, len);
+    value[len] = '\0';
+    values = separator != NULL ? separator + 1 : NULL;
+
+    type = bamdb_key_type(field);
+    if (type == BAMDB_KEY_INT || type == BAMDB_KEY_FLOAT) {
+      if (*key_size + BAMDB_TYPED_KEY_SIZE > BAMDB_MAX_KEY_SIZE ||
+          !bamdb_parse_typed_key(type, value, out + *key_size)) {
+        return false;
+      }
+      *key_size += BAMDB_TYPED_KEY_SIZE;
+    } else {
+      if (*key_size + len + 1 > BAMDB_MAX_KEY_SIZE) {
+        return false;
+      }
+      memcpy(out + *key_size, value, len + 1);
+      *key_size += len + 1;
+    }
+  }
+
+  /* More values than fields can never match */
+  if (values != NULL) {
+    return false;
+  }
+
+  *prefix = index_name != NULL;
+  return true;
+}
+
+/* First bin of a level, level 0 being the single bin spanning everything */
+static uint32_t level_offset(int level) {
+  return ((1 << (3 * level)) - 1) / 7;
+}
+
+static int level_shift(int level) {
+  return BIN_MIN_SHIFT + 3 * (BIN_LEVELS - level);
+}
+
+uint32_t bamdb_region_bin(int64_t beg, int64_t end) {
+  /* Empty spans still occupy their first base */
+  if (end <= beg) {
+    end = beg + 1;
+  }
+  --end;
+
+  for (int level = BIN_LEVELS; level > 0; --level) {
+    int shift = level_shift(level);
+    if (beg >> shift == end >> shift) {
+      return level_offset(level) + (uint32_t)(beg >> shift);
+    }
+  }
+
+  return 0;
+}
+
+size_t bamdb_region_bins(int64_t beg, int64_t end, uint32_t **bins) {
+  size_t num_bins = 1;
+  size_t i = 0;
+
+  if (end <= beg) {
+    end = beg + 1;
+  }
+  --end;
+
+  for (int level = 1; level <= BIN_LEVELS; ++level) {
+    int shift = level_shift(level);
+    num_bins += (end >> shift) - (beg >> shift) + 1;
+  }
+
+  *bins = malloc(num_bins * sizeof(uint32_t));
+  (*bins)[i++] = 0;
+  for (int level = 1; level <= BIN_LEVELS; ++level) {
+    int shift = level_shift(level);
+    for (int64_t k = beg >> shift; k <= end >> shift; ++k) {
+      (*bins)[i++] = level_offset(level) + (uint32_t)k;
+    }
+  }
+
+  return num_bins;
+}
+
+/* All parts are unsigned and big-endian, so keys group by reference, then by
+ * bin and order by position within a bin */
+void bamdb_encode_region_key(int32_t tid, uint32_t bin, int64_t pos,
+                             int64_t end, void *buffer) {
+  unsigned char *bytes = buffer;
+  uint32_t parts[4] = {(uint32_t)tid, bin, (uint32_t)pos,
+                       end > UINT32_MAX ? UINT32_MAX : (uint32_t)end};
+
+  for (size_t i = 0; i < 4; ++i) {
+    bytes[4 * i] = (unsigned char)(parts[i] >> 24);
+    bytes[4 * i + 1] = (unsigned char)(parts[i] >> 16);
+    bytes[4 * i + 2] = (unsigned char)(parts[i] >> 8);
+    bytes[4 * i + 3] = (unsigned char)parts[i];
+  }
+}
+
+void bamdb_decode_region_key(const void *buffer, int32_t *tid, uint32_t *bin,
+                             int64_t *pos, int64_t *end) {
+  const unsigned char *bytes = buffer;
+  uint32_t parts[4];
+
+  for (size_t i = 0; i < 4; ++i) {
+    parts[i] = (uint32_t)bytes[4 * i] << 24 | (uint32_t)bytes[4 * i + 1] << 16 |
+               (uint32_t)bytes[4 * i + 2] << 8 | bytes[4 * i + 3];
+  }
+
+  *tid = (int32_t)parts[0];
+  *bin = parts[1];
+  *pos = parts[2];
+  *end = parts[3];
+}
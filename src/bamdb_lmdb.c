@@ -1,20 +1,32 @@
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <lmdb.h>
 
 #include "bam_api.h"
+#include "bamdb_barcode.h"
+#include "bamdb_bloom.h"
+#include "bamdb_hash.h"
+#include "bamdb_key.h"
 #include "bamdb_lmdb.h"
+#include "bamdb_postings.h"
 #include "bamdb_status.h"
+#include "bamdb_table.h"
 
 #define LMDB_POSTFIX "_lmdb"
 #define WORK_BUFFER_SIZE 65536
 /* Making this huge because so we don't have to resize while running*/
 #define LMDB_INIT_MAPSIZE 100000000000
 #define MAX_PATH_CHARS 2048
+/* Fewest rows a query hands to each row fetching thread */
+#define MIN_FETCH_THREAD_ROWS 1024
+/* Rows each thread reads ahead for a row iterator */
+#define ITER_WINDOW_THREAD_ROWS (4 * MIN_FETCH_THREAD_ROWS)
 
 char *get_default_dbname(const char *filename) {
   char *db_name;
@@ -51,7 +63,7 @@ int get_lmdb_env(MDB_env **env, const char *full_db_path, bool read_only) {
     return BAMDB_DB_ERROR;
   }
 
-  rc = mdb_env_set_maxdbs(*env, 1);
+  rc = mdb_env_set_maxdbs(*env, BAMDB_MAX_INDICES);
   if (rc != MDB_SUCCESS) {
     fprintf(stderr, "Error setting maxdbs: %s\n", mdb_strerror(rc));
     return BAMDB_DB_ERROR;
@@ -78,25 +90,48 @@ int get_lmdb_env(MDB_env **env, const char *full_db_path, bool read_only) {
   return ret;
 }
 
-static int open_ro_handle(MDB_env *output, MDB_dbi *dbi, MDB_cursor **cur,
-                          MDB_txn *txn, const char *key_name,
-                          const char *db_path) {
+bool is_single_env(const char *db_path) {
   char target_path[MAX_PATH_CHARS];
-  int rc = 0;
+  struct stat st;
 
-  snprintf(target_path, MAX_PATH_CHARS, "%s/%s", db_path, key_name);
-  rc = get_lmdb_env(&output, target_path, true);
+  snprintf(target_path, MAX_PATH_CHARS, "%s/%s", db_path, LMDB_DATA_FILE);
+  return stat(target_path, &st) == 0;
+}
+
+static int begin_ro_txn(MDB_env *env, MDB_txn **txn) {
+  int rc = mdb_txn_begin(env, NULL, MDB_RDONLY, txn);
+
+  if (rc != MDB_SUCCESS) {
+    fprintf(stderr, "Error beginning LMDB transaction: %s\n", mdb_strerror(rc));
+    return BAMDB_DB_ERROR;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+static int open_ro_txn(MDB_env **env, MDB_txn **txn, const char *env_path) {
+  int rc;
+
+  rc = get_lmdb_env(env, env_path, true);
   if (rc != BAMDB_SUCCESS) {
     return BAMDB_DB_ERROR;
   }
 
-  rc = mdb_txn_begin(output, NULL, MDB_RDONLY, &txn);
-  if (rc != MDB_SUCCESS) {
-    fprintf(stderr, "Error beginning LMDB transaction: %s\n", mdb_strerror(rc));
+  if (begin_ro_txn(*env, txn) != BAMDB_SUCCESS) {
+    mdb_env_close(*env);
     return BAMDB_DB_ERROR;
   }
 
-  rc = mdb_dbi_open(txn, NULL, MDB_DUPSORT | MDB_DUPFIXED, dbi);
+  return BAMDB_SUCCESS;
+}
+
+/* dbi_name is the index name in a single environment and NULL for the
+ * unnamed database of a per-index environment */
+static int open_ro_handle(MDB_txn *txn, const char *dbi_name, MDB_dbi *dbi,
+                          MDB_cursor **cur) {
+  int rc;
+
+  rc = mdb_dbi_open(txn, dbi_name, MDB_DUPSORT | MDB_DUPFIXED, dbi);
   if (rc != MDB_SUCCESS) {
     fprintf(stderr, "Error opening LMDB database handle: %s\n",
             mdb_strerror(rc));
@@ -112,21 +147,133 @@ static int open_ro_handle(MDB_env *output, MDB_dbi *dbi, MDB_cursor **cur,
   return BAMDB_SUCCESS;
 }
 
-int get_offsets_lmdb(offset_list_t *offset_list, const char *db_path,
-                     const char *index_name, const char *key) {
-  MDB_env *env = NULL;
-  MDB_dbi dbi;
-  MDB_cursor *cur = NULL;
-  MDB_txn *txn = NULL;
-  MDB_val db_key, data;
-  int rc;
+/* Packed barcode indices are keyed by the integer form of the barcode */
+static bool is_packed_dbi(MDB_txn *txn, MDB_dbi dbi) {
+  unsigned int flags;
 
-  db_key.mv_size = strlen(key);
-  db_key.mv_data = strdup(key);
+  return mdb_dbi_flags(txn, dbi, &flags) == MDB_SUCCESS &&
+         (flags & MDB_INTEGERKEY);
+}
 
-  rc = open_ro_handle(env, &dbi, &cur, txn, index_name, db_path);
-  if (rc != MDB_SUCCESS) {
-    return BAMDB_DB_ERROR;
+/* Turn a key given as text into the form an index stores it in. key_buffer
+ * holds the encoded key if needed and must be at least BAMDB_MAX_KEY_SIZE
+ * bytes. prefix is set if the key only names the leading fields of a
+ * composite index. Returns false if the text can never match a key of the
+ * index. */
+static bool encode_query_key(const char *index_name, bool packed,
+                             const char *key, uint64_t *key_buffer,
+                             MDB_val *db_key, bool *prefix) {
+  bamdb_key_type_t type = bamdb_key_type(index_name);
+
+  *prefix = false;
+  if (type == BAMDB_KEY_COMPOSITE) {
+    db_key->mv_data = key_buffer;
+    return bamdb_encode_composite_key(index_name, key, key_buffer,
+                                      &db_key->mv_size, prefix);
+  }
+
+  if (type != BAMDB_KEY_STRING) {
+    db_key->mv_size = BAMDB_TYPED_KEY_SIZE;
+    db_key->mv_data = key_buffer;
+    return bamdb_parse_typed_key(type, key, key_buffer);
+  }
+
+  if (packed) {
+    db_key->mv_size = sizeof(uint64_t);
+    db_key->mv_data = key_buffer;
+    return bamdb_pack_barcode(key, key_buffer);
+  }
+
+  db_key->mv_size = strlen(key);
+  db_key->mv_data = (void *)key;
+  return true;
+}
+
+/* Whether the bloom filter of an index shows that key is not in it. Nothing
+ * is ruled out without a filter or for keys naming only a prefix. */
+static bool bloom_rules_out(const bamdb_bloom_t *bloom, const char *index_name,
+                            const char *key) {
+  MDB_val db_key;
+  uint64_t key_buffer[BAMDB_MAX_KEY_SIZE / sizeof(uint64_t) + 1];
+  bool prefix;
+
+  if (bloom == NULL || bamdb_key_type(index_name) == BAMDB_KEY_REGION) {
+    return false;
+  }
+
+  if (!encode_query_key(index_name,
+                        bamdb_bloom_flags(bloom) & BAMDB_BLOOM_PACKED, key,
+                        key_buffer, &db_key, &prefix)) {
+    /* Such a value was never indexed */
+    return true;
+  }
+
+  return !prefix &&
+         !bamdb_bloom_may_contain(bloom, db_key.mv_data, db_key.mv_size);
+}
+
+static bool has_prefix(const MDB_val *key, const MDB_val *prefix) {
+  return key->mv_size >= prefix->mv_size &&
+         memcmp(key->mv_data, prefix->mv_data, prefix->mv_size) == 0;
+}
+
+static void push_offset(offset_list_t *offset_list, int64_t offset) {
+  offset_node_t *new_node = calloc(1, sizeof(offset_node_t));
+  new_node->offset = offset;
+
+  if (offset_list->head == NULL) {
+    offset_list->head = new_node;
+  } else {
+    offset_list->tail->next = new_node;
+  }
+  offset_list->tail = new_node;
+  offset_list->num_entries++;
+}
+
+/* Indices built with compressed postings hold chunks of offsets instead of
+ * fixed size duplicates */
+static bool holds_chunks(MDB_txn *txn, MDB_dbi dbi) {
+  unsigned int flags;
+
+  return mdb_dbi_flags(txn, dbi, &flags) == MDB_SUCCESS &&
+         !(flags & MDB_DUPFIXED);
+}
+
+/* Add the offset, or every offset of the chunk, stored in data */
+static void append_offsets(offset_list_t *offset_list, const MDB_val *data,
+                           bool chunked) {
+  int64_t offsets[BAMDB_MAX_POSTING_CHUNK_OFFSETS];
+  size_t num_offsets;
+
+  if (!chunked) {
+    push_offset(offset_list, *(int64_t *)data->mv_data);
+    return;
+  }
+
+  num_offsets = bamdb_decode_postings(data->mv_data, data->mv_size, offsets);
+  for (size_t i = 0; i < num_offsets; ++i) {
+    push_offset(offset_list, offsets[i]);
+  }
+}
+
+/* Add the offsets stored under an encoded key, or under every key starting
+ * with it if prefix is set */
+static int read_cursor_offsets(offset_list_t *offset_list, MDB_cursor *cur,
+                               bool chunked, const MDB_val *query_key,
+                               bool prefix) {
+  MDB_val db_key = *query_key;
+  MDB_val data;
+  int rc;
+
+  if (prefix) {
+    /* Every key starting with the given fields matches */
+    for (rc = mdb_cursor_get(cur, &db_key, &data, MDB_SET_RANGE);
+         rc == MDB_SUCCESS && has_prefix(&db_key, query_key);
+         rc = mdb_cursor_get(cur, &db_key, &data, MDB_NEXT)) {
+      append_offsets(offset_list, &data, chunked);
+    }
+    return rc == MDB_SUCCESS || rc == MDB_NOTFOUND ? BAMDB_SUCCESS
+                                                   : BAMDB_DB_ERROR;
   }
 
   rc = mdb_cursor_get(cur, &db_key, &data, MDB_SET);
@@ -138,69 +285,1909 @@ int get_offsets_lmdb(offset_list_t *offset_list, const char *db_path,
     return BAMDB_DB_ERROR;
   }
   if ((rc = mdb_cursor_get(cur, &db_key, &data, MDB_FIRST_DUP)) == 0) {
-    offset_node_t *new_node = calloc(1, sizeof(offset_node_t));
-    new_node->offset = *(int64_t *)data.mv_data;
-
-    offset_list->head = new_node;
-    offset_list->tail = new_node;
-    offset_list->num_entries++;
+    append_offsets(offset_list, &data, chunked);
 
     while ((rc = mdb_cursor_get(cur, &db_key, &data, MDB_NEXT_DUP)) == 0) {
-      offset_node_t *new_node = calloc(1, sizeof(offset_node_t));
-      new_node->offset = *(int64_t *)data.mv_data;
+      append_offsets(offset_list, &data, chunked);
+    }
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+/* index_name is also the database name when single_env is set */
+static int read_offsets(offset_list_t *offset_list, MDB_txn *txn,
+                        const char *index_name, bool single_env,
+                        const char *key) {
+  MDB_dbi dbi;
+  MDB_cursor *cur = NULL;
+  MDB_val db_key;
+  uint64_t key_buffer[BAMDB_MAX_KEY_SIZE / sizeof(uint64_t) + 1];
+  bool prefix;
+  int rc;
+
+  rc = open_ro_handle(txn, single_env ? index_name : NULL, &dbi, &cur);
+  if (rc != BAMDB_SUCCESS) {
+    return BAMDB_DB_ERROR;
+  }
+
+  if (!encode_query_key(index_name, is_packed_dbi(txn, dbi), key, key_buffer,
+                        &db_key, &prefix)) {
+    /* Such a value was never indexed */
+    mdb_cursor_close(cur);
+    return BAMDB_SUCCESS;
+  }
+
+  rc = read_cursor_offsets(offset_list, cur, holds_chunks(txn, dbi), &db_key,
+                           prefix);
+  mdb_cursor_close(cur);
+  return rc;
+}
+
+/* Walk the cursor from the first key at or above min_key until a key is
+ * above max_key. Either bound may be NULL. */
+static int read_offsets_range(offset_list_t *offset_list, MDB_txn *txn,
+                              const char *index_name, bool single_env,
+                              const char *min_key, const char *max_key) {
+  MDB_dbi dbi;
+  MDB_cursor *cur = NULL;
+  MDB_val db_key, data, min_val, max_val;
+  uint64_t min_buffer[BAMDB_MAX_KEY_SIZE / sizeof(uint64_t) + 1];
+  uint64_t max_buffer[BAMDB_MAX_KEY_SIZE / sizeof(uint64_t) + 1];
+  bool min_prefix, max_prefix = false;
+  bool chunked, packed;
+  int rc;
+
+  rc = open_ro_handle(txn, single_env ? index_name : NULL, &dbi, &cur);
+  if (rc != BAMDB_SUCCESS) {
+    return BAMDB_DB_ERROR;
+  }
+  chunked = holds_chunks(txn, dbi);
+  packed = is_packed_dbi(txn, dbi);
+
+  if ((min_key != NULL &&
+       !encode_query_key(index_name, packed, min_key, min_buffer, &min_val,
+                         &min_prefix)) ||
+      (max_key != NULL &&
+       !encode_query_key(index_name, packed, max_key, max_buffer, &max_val,
+                         &max_prefix))) {
+    fprintf(stderr, "Range bounds do not match the type of the %s index\n",
+            index_name);
+    mdb_cursor_close(cur);
+    return BAMDB_DB_ERROR;
+  }
+
+  if (min_key != NULL) {
+    db_key = min_val;
+    rc = mdb_cursor_get(cur, &db_key, &data, MDB_SET_RANGE);
+  } else {
+    rc = mdb_cursor_get(cur, &db_key, &data, MDB_FIRST);
+  }
+
+  /* MDB_NEXT visits every duplicate of a key before moving on */
+  while (rc == MDB_SUCCESS) {
+    /* A bound naming only the leading fields of a composite key includes
+     * every key starting with it */
+    if (max_key != NULL && mdb_cmp(txn, dbi, &db_key, &max_val) > 0 &&
+        !(max_prefix && has_prefix(&db_key, &max_val))) {
+      break;
+    }
+    append_offsets(offset_list, &data, chunked);
+    rc = mdb_cursor_get(cur, &db_key, &data, MDB_NEXT);
+  }
+
+  mdb_cursor_close(cur);
+  if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) {
+    fprintf(stderr, "Error reading %s index: %s\n", index_name,
+            mdb_strerror(rc));
+    return BAMDB_DB_ERROR;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+/* Scan every bin that may hold reads overlapping [beg, end) of tid and keep
+ * the reads that really overlap it */
+static int read_offsets_region(offset_list_t *offset_list, MDB_txn *txn,
+                               bool single_env, int32_t tid, int64_t beg,
+                               int64_t end) {
+  MDB_dbi dbi;
+  MDB_cursor *cur = NULL;
+  MDB_val db_key, data;
+  unsigned char key_buffer[BAMDB_REGION_KEY_SIZE];
+  uint32_t *bins = NULL;
+  size_t num_bins;
+  int32_t key_tid;
+  uint32_t key_bin;
+  int64_t key_pos, key_end;
+  bool chunked;
+  int rc = MDB_SUCCESS;
+
+  if (open_ro_handle(txn, single_env ? BAMDB_REGION_INDEX : NULL, &dbi,
+                     &cur) != BAMDB_SUCCESS) {
+    return BAMDB_DB_ERROR;
+  }
+  chunked = holds_chunks(txn, dbi);
+
+  num_bins = bamdb_region_bins(beg, end, &bins);
+  for (size_t i = 0; i < num_bins; ++i) {
+    bamdb_encode_region_key(tid, bins[i], 0, 0, key_buffer);
+    db_key.mv_size = BAMDB_REGION_KEY_SIZE;
+    db_key.mv_data = key_buffer;
+
+    /* Reads of a bin are ordered by position, stop at the first one that
+     * starts after the region */
+    for (rc = mdb_cursor_get(cur, &db_key, &data, MDB_SET_RANGE);
+         rc == MDB_SUCCESS;
+         rc = mdb_cursor_get(cur, &db_key, &data, MDB_NEXT)) {
+      bamdb_decode_region_key(db_key.mv_data, &key_tid, &key_bin, &key_pos,
+                              &key_end);
+      if (key_tid != tid || key_bin != bins[i] || key_pos >= end) {
+        break;
+      }
+      if (key_end > beg) {
+        append_offsets(offset_list, &data, chunked);
+      }
+    }
 
-      offset_list->tail->next = new_node;
-      offset_list->tail = new_node;
-      offset_list->num_entries++;
+    if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) {
+      break;
     }
   }
 
+  free(bins);
   mdb_cursor_close(cur);
+  if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) {
+    fprintf(stderr, "Error reading %s index: %s\n", BAMDB_REGION_INDEX,
+            mdb_strerror(rc));
+    return BAMDB_DB_ERROR;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+/* Map the table of index_name, NULL if the index was built with LMDB */
+static bamdb_table_t *open_table(const char *db_path, const char *index_name) {
+  char path[MAX_PATH_CHARS];
+
+  bamdb_table_path(path, MAX_PATH_CHARS, db_path, index_name);
+  return bamdb_table_open(path);
+}
+
+/* Encode a key given as text like encode_query_key. Tables keep packed keys
+ * big-endian so they order bytewise. */
+static bool encode_table_key(const bamdb_table_t *table,
+                             const char *index_name, const char *key,
+                             uint64_t *key_buffer, MDB_val *db_key,
+                             bool *prefix) {
+  bool packed = bamdb_table_flags(table) & BAMDB_TABLE_PACKED;
+
+  if (!encode_query_key(index_name, packed, key, key_buffer, db_key,
+                        prefix)) {
+    return false;
+  }
+  if (packed) {
+    bamdb_store_be64(key_buffer[0], key_buffer);
+  }
+
+  return true;
+}
+
+static void entry_key(const bamdb_table_entry_t *entry, MDB_val *key) {
+  key->mv_size = entry->key_size;
+  key->mv_data = (void *)entry->key;
+}
+
+static void append_table_offsets(offset_list_t *offset_list,
+                                 const bamdb_table_entry_t *entry) {
+  int64_t *offsets = malloc(entry->num_offsets * sizeof(int64_t));
+  size_t num_offsets = bamdb_table_decode(entry, offsets);
+
+  for (size_t i = 0; i < num_offsets; ++i) {
+    push_offset(offset_list, offsets[i]);
+  }
+  free(offsets);
+}
+
+/* Add the offsets stored under an encoded key of a table, or under every key
+ * starting with it if prefix is set */
+static void read_table_key_offsets(offset_list_t *offset_list,
+                                   const bamdb_table_t *table,
+                                   const MDB_val *db_key, bool prefix) {
+  bamdb_table_entry_t entry;
+  MDB_val found_key;
+  bool more;
+
+  for (more = bamdb_table_seek(table, db_key->mv_data, db_key->mv_size,
+                               &entry);
+       more; more = bamdb_table_next(table, &entry)) {
+    entry_key(&entry, &found_key);
+    /* Every key starting with the given fields matches a prefix */
+    if (prefix ? !has_prefix(&found_key, db_key)
+               : bamdb_table_compare(found_key.mv_data, found_key.mv_size,
+                                     db_key->mv_data, db_key->mv_size) != 0) {
+      break;
+    }
+    append_table_offsets(offset_list, &entry);
+  }
+}
+
+/* read_offsets for an index built as a table */
+static int read_table_offsets(offset_list_t *offset_list,
+                              const bamdb_table_t *table,
+                              const char *index_name, const char *key) {
+  MDB_val db_key;
+  uint64_t key_buffer[BAMDB_MAX_KEY_SIZE / sizeof(uint64_t) + 1];
+  bool prefix;
+
+  if (!encode_table_key(table, index_name, key, key_buffer, &db_key,
+                        &prefix)) {
+    /* Such a value was never indexed */
+    return BAMDB_SUCCESS;
+  }
+
+  read_table_key_offsets(offset_list, table, &db_key, prefix);
+  return BAMDB_SUCCESS;
+}
+
+/* Map the hash of index_name, NULL unless the index was built as one */
+static bamdb_hash_t *open_hash(const char *db_path, const char *index_name) {
+  char path[MAX_PATH_CHARS];
+
+  bamdb_hash_path(path, MAX_PATH_CHARS, db_path, index_name);
+  return bamdb_hash_open(path);
+}
+
+/* read_offsets for an index built as a minimal perfect hash */
+static int read_hash_offsets(offset_list_t *offset_list,
+                             const bamdb_hash_t *hash, const char *index_name,
+                             const char *key) {
+  MDB_val db_key;
+  uint64_t key_buffer[BAMDB_MAX_KEY_SIZE / sizeof(uint64_t) + 1];
+  const int64_t *offsets;
+  size_t num_offsets;
+  bool prefix;
+
+  if (!encode_query_key(index_name, false, key, key_buffer, &db_key,
+                        &prefix)) {
+    /* Such a value was never indexed */
+    return BAMDB_SUCCESS;
+  }
+  if (prefix) {
+    fprintf(stderr, "The %s index is hashed and only answers exact "
+                    "lookups\n",
+            index_name);
+    return BAMDB_DB_ERROR;
+  }
+
+  num_offsets =
+      bamdb_hash_lookup(hash, db_key.mv_data, db_key.mv_size, &offsets);
+  for (size_t i = 0; i < num_offsets; ++i) {
+    push_offset(offset_list, offsets[i]);
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+/* read_offsets_range for an index built as a table */
+static int read_table_range(offset_list_t *offset_list,
+                            const bamdb_table_t *table, const char *index_name,
+                            const char *min_key, const char *max_key) {
+  bamdb_table_entry_t entry;
+  MDB_val db_key, min_val, max_val;
+  uint64_t min_buffer[BAMDB_MAX_KEY_SIZE / sizeof(uint64_t) + 1];
+  uint64_t max_buffer[BAMDB_MAX_KEY_SIZE / sizeof(uint64_t) + 1];
+  bool min_prefix, max_prefix = false;
+  bool more;
+
+  if ((min_key != NULL &&
+       !encode_table_key(table, index_name, min_key, min_buffer, &min_val,
+                         &min_prefix)) ||
+      (max_key != NULL &&
+       !encode_table_key(table, index_name, max_key, max_buffer, &max_val,
+                         &max_prefix))) {
+    fprintf(stderr, "Range bounds do not match the type of the %s index\n",
+            index_name);
+    return BAMDB_DB_ERROR;
+  }
+
+  if (min_key != NULL) {
+    more = bamdb_table_seek(table, min_val.mv_data, min_val.mv_size, &entry);
+  } else {
+    more = bamdb_table_first(table, &entry);
+  }
+
+  for (; more; more = bamdb_table_next(table, &entry)) {
+    entry_key(&entry, &db_key);
+    if (max_key != NULL &&
+        bamdb_table_compare(db_key.mv_data, db_key.mv_size, max_val.mv_data,
+                            max_val.mv_size) > 0 &&
+        !(max_prefix && has_prefix(&db_key, &max_val))) {
+      break;
+    }
+    append_table_offsets(offset_list, &entry);
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+/* read_offsets_region for a POS index built as a table */
+static int read_table_region(offset_list_t *offset_list,
+                             const bamdb_table_t *table, int32_t tid,
+                             int64_t beg, int64_t end) {
+  bamdb_table_entry_t entry;
+  unsigned char key_buffer[BAMDB_REGION_KEY_SIZE];
+  uint32_t *bins = NULL;
+  size_t num_bins;
+  int32_t key_tid;
+  uint32_t key_bin;
+  int64_t key_pos, key_end;
+  bool more;
+
+  num_bins = bamdb_region_bins(beg, end, &bins);
+  for (size_t i = 0; i < num_bins; ++i) {
+    bamdb_encode_region_key(tid, bins[i], 0, 0, key_buffer);
+
+    for (more = bamdb_table_seek(table, key_buffer, BAMDB_REGION_KEY_SIZE,
+                                 &entry);
+         more && entry.key_size == BAMDB_REGION_KEY_SIZE;
+         more = bamdb_table_next(table, &entry)) {
+      bamdb_decode_region_key(entry.key, &key_tid, &key_bin, &key_pos,
+                              &key_end);
+      if (key_tid != tid || key_bin != bins[i] || key_pos >= end) {
+        break;
+      }
+      if (key_end > beg) {
+        append_table_offsets(offset_list, &entry);
+      }
+    }
+  }
+
+  free(bins);
+  return BAMDB_SUCCESS;
+}
+
+int open_lmdb_snapshot(MDB_env **env, MDB_txn **txn, const char *db_path) {
+  if (!is_single_env(db_path)) {
+    fprintf(stderr,
+            "%s holds one environment per index, a snapshot needs a single "
+            "environment\n",
+            db_path);
+    return BAMDB_DB_ERROR;
+  }
+
+  return open_ro_txn(env, txn, db_path);
+}
+
+void close_lmdb_snapshot(MDB_env *env, MDB_txn *txn) {
   mdb_txn_abort(txn);
+  mdb_env_close(env);
+}
+
+int get_offsets_lmdb_txn(offset_list_t *offset_list, MDB_txn *txn,
+                         const char *index_name, const char *key) {
+  return read_offsets(offset_list, txn, index_name, true, key);
+}
+
+/* One index of a database, opened once for every query of a session */
+typedef struct index_handle {
+  char *name;
+  bamdb_bloom_t *bloom;  // NULL if the index has no bloom filter
+  bamdb_table_t *table;  // Set for an index built as a table
+  bamdb_hash_t *hash;    // Set for an index built as a hash
+  MDB_env *env;          // Own environment of an LMDB index, NULL in a
+                         // single environment
+} index_handle_t;
+
+struct bamdb_session {
+  /* NULL if the session was opened without a bam file */
+  char *input_file_name;
+  samFile *input_file;
+  bam_hdr_t *header;
+  /* Threads reading the rows of a query, see bamdb_session_set_threads */
+  size_t num_threads;
+  char *db_path;
+  bool single_env;
+  /* Environment holding every LMDB index of a single environment */
+  MDB_env *env;
+  /* Indices are opened the first time a query names them */
+  index_handle_t indices[BAMDB_MAX_INDICES];
+  size_t num_indices;
+};
+
+static void close_index_handle(index_handle_t *handle) {
+  bamdb_bloom_destroy(handle->bloom);
+  bamdb_table_close(handle->table);
+  bamdb_hash_close(handle->hash);
+  if (handle->env != NULL) {
+    mdb_env_close(handle->env);
+  }
+  free(handle->name);
+}
+
+static int open_index_handle(index_handle_t *handle, const char *db_path,
+                             const char *index_name, bool single_env) {
+  char path[MAX_PATH_CHARS];
+
+  memset(handle, 0, sizeof(index_handle_t));
+  handle->name = strdup(index_name);
+
+  bamdb_bloom_path(path, MAX_PATH_CHARS, db_path, index_name);
+  handle->bloom = bamdb_bloom_open(path);
+
+  if ((handle->table = open_table(db_path, index_name)) != NULL ||
+      (handle->hash = open_hash(db_path, index_name)) != NULL || single_env) {
+    return BAMDB_SUCCESS;
+  }
+
+  snprintf(path, MAX_PATH_CHARS, "%s/%s", db_path, index_name);
+  if (get_lmdb_env(&handle->env, path, true) != BAMDB_SUCCESS) {
+    /* get_lmdb_env leaves a failed environment open */
+    mdb_env_close(handle->env);
+    handle->env = NULL;
+    close_index_handle(handle);
+    return BAMDB_DB_ERROR;
+  }
+
   return BAMDB_SUCCESS;
 }
 
-int get_bam_rows(bam_row_set_t **output, const char *input_file_name,
-                 const char *db_path, const char *index_name, const char *key) {
-  samFile *input_file = 0;
-  bam_hdr_t *header = NULL;
-  offset_node_t *offset_node;
-  offset_list_t *offsets;
-  int i = 0;
-  int rc = 0;
-  int ret = BAMDB_SUCCESS;
+/* The handle of index_name, opened on first use. NULL on failure. */
+static index_handle_t *session_index(bamdb_session_t *session,
+                                     const char *index_name) {
+  index_handle_t *handle;
 
-  /* Always create an object for the caller */
-  *output = calloc(1, sizeof(bam_row_set_t));
+  for (size_t i = 0; i < session->num_indices; ++i) {
+    if (strcmp(session->indices[i].name, index_name) == 0) {
+      return &session->indices[i];
+    }
+  }
 
-  if ((input_file = sam_open(input_file_name, "r")) == 0) {
-    return BAMDB_SEQUENCE_FILE_ERROR;
+  if (session->num_indices == BAMDB_MAX_INDICES) {
+    fprintf(stderr, "A session can query at most %d indices\n",
+            BAMDB_MAX_INDICES);
+    return NULL;
   }
 
-  header = sam_hdr_read(input_file);
-  if (header == NULL) {
+  handle = &session->indices[session->num_indices];
+  if (open_index_handle(handle, session->db_path, index_name,
+                        session->single_env) != BAMDB_SUCCESS) {
+    return NULL;
+  }
+  session->num_indices++;
+  return handle;
+}
+
+/* Begin a read transaction on the environment holding an LMDB index */
+static int begin_index_txn(const bamdb_session_t *session,
+                           const index_handle_t *handle, MDB_txn **txn) {
+  return begin_ro_txn(handle->env != NULL ? handle->env : session->env, txn);
+}
+
+/* Resolve a region given as text with the reference names of the bam header
+ * of a session */
+static int parse_session_region(const bamdb_session_t *session,
+                                const char *region, int32_t *tid,
+                                int64_t *beg, int64_t *end) {
+  if (session->header == NULL) {
+    fprintf(stderr, "Regions need the reference names of the bam header, "
+                    "open the session with the bam file\n");
     return BAMDB_DB_ERROR;
   }
 
-  offsets = calloc(1, sizeof(offset_list_t));
-  rc = get_offsets_lmdb(offsets, db_path, index_name, key);
-  if (rc != 0) {
-    free(offsets);
-    return rc;
+  if (!bam_parse_region(session->header, region, tid, beg, end)) {
+    fprintf(stderr, "Invalid region %s\n", region);
+    return BAMDB_DB_ERROR;
   }
 
-  (*output)->num_entries = offsets->num_entries;
-  (*output)->rows = malloc((*output)->num_entries * sizeof(bam_row_set_t));
+  return BAMDB_SUCCESS;
+}
+
+int bamdb_session_open(bamdb_session_t **session, const char *input_file_name,
+                       const char *db_path) {
+  bamdb_session_t *new_session = calloc(1, sizeof(bamdb_session_t));
 
-  offset_node = offsets->head;
-  while (offset_node != NULL) {
-    /* TODO: make sure we don't overrun row_set */
-    ret = get_bam_row(&(*output)->rows[i], &(*output)->aux_tags,
-                      offset_node->offset, input_file, header);
-    offset_node = offset_node->next;
-    i++;
+  *session = NULL;
+  new_session->db_path = strdup(db_path);
+  new_session->single_env = is_single_env(db_path);
+  new_session->num_threads = 1;
+
+  if (input_file_name != NULL) {
+    new_session->input_file_name = strdup(input_file_name);
+    if ((new_session->input_file = sam_open(input_file_name, "r")) == 0) {
+      bamdb_session_close(new_session);
+      return BAMDB_SEQUENCE_FILE_ERROR;
+    }
+    if ((new_session->header = sam_hdr_read(new_session->input_file)) ==
+        NULL) {
+      bamdb_session_close(new_session);
+      return BAMDB_SEQUENCE_FILE_ERROR;
+    }
   }
 
-  free(offsets);
+  if (new_session->single_env &&
+      get_lmdb_env(&new_session->env, db_path, true) != BAMDB_SUCCESS) {
+    bamdb_session_close(new_session);
+    return BAMDB_DB_ERROR;
+  }
+
+  *session = new_session;
   return BAMDB_SUCCESS;
 }
+
+void bamdb_session_close(bamdb_session_t *session) {
+  if (session == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < session->num_indices; ++i) {
+    close_index_handle(&session->indices[i]);
+  }
+  if (session->env != NULL) {
+    mdb_env_close(session->env);
+  }
+  if (session->header != NULL) {
+    bam_hdr_destroy(session->header);
+  }
+  if (session->input_file != 0) {
+    sam_close(session->input_file);
+  }
+  free(session->input_file_name);
+  free(session->db_path);
+  free(session);
+}
+
+void bamdb_session_set_threads(bamdb_session_t *session, size_t num_threads) {
+  session->num_threads = num_threads > 0 ? num_threads : 1;
+}
+
+static int read_session_region(offset_list_t *offset_list,
+                               bamdb_session_t *session, int32_t tid,
+                               int64_t beg, int64_t end) {
+  index_handle_t *handle = session_index(session, BAMDB_REGION_INDEX);
+  MDB_txn *txn = NULL;
+  int rc;
+
+  if (handle == NULL) {
+    return BAMDB_DB_ERROR;
+  }
+  if (handle->table != NULL) {
+    return read_table_region(offset_list, handle->table, tid, beg, end);
+  }
+
+  if (begin_index_txn(session, handle, &txn) != BAMDB_SUCCESS) {
+    return BAMDB_DB_ERROR;
+  }
+  rc = read_offsets_region(offset_list, txn, session->single_env, tid, beg,
+                           end);
+  mdb_txn_abort(txn);
+  return rc;
+}
+
+int bamdb_session_get_offsets(offset_list_t *offset_list,
+                              bamdb_session_t *session, const char *index_name,
+                              const char *key) {
+  index_handle_t *handle;
+  MDB_txn *txn = NULL;
+  int32_t tid;
+  int64_t beg, end;
+  int rc;
+
+  if (bamdb_key_type(index_name) == BAMDB_KEY_REGION) {
+    rc = parse_session_region(session, key, &tid, &beg, &end);
+    if (rc != BAMDB_SUCCESS) {
+      return rc;
+    }
+    return read_session_region(offset_list, session, tid, beg, end);
+  }
+
+  if ((handle = session_index(session, index_name)) == NULL) {
+    return BAMDB_DB_ERROR;
+  }
+  if (bloom_rules_out(handle->bloom, index_name, key)) {
+    return BAMDB_SUCCESS;
+  }
+
+  if (handle->table != NULL) {
+    return read_table_offsets(offset_list, handle->table, index_name, key);
+  }
+  if (handle->hash != NULL) {
+    return read_hash_offsets(offset_list, handle->hash, index_name, key);
+  }
+
+  if (begin_index_txn(session, handle, &txn) != BAMDB_SUCCESS) {
+    return BAMDB_DB_ERROR;
+  }
+  rc = read_offsets(offset_list, txn, index_name, session->single_env, key);
+  mdb_txn_abort(txn);
+  return rc;
+}
+
+int bamdb_session_get_offsets_range(offset_list_t *offset_list,
+                                    bamdb_session_t *session,
+                                    const char *index_name,
+                                    const char *min_key,
+                                    const char *max_key) {
+  index_handle_t *handle;
+  MDB_txn *txn = NULL;
+  int rc;
+
+  if ((handle = session_index(session, index_name)) == NULL) {
+    return BAMDB_DB_ERROR;
+  }
+
+  if (handle->table != NULL) {
+    return read_table_range(offset_list, handle->table, index_name, min_key,
+                            max_key);
+  }
+  if (handle->hash != NULL) {
+    fprintf(stderr, "The %s index is hashed and only answers exact "
+                    "lookups\n",
+            index_name);
+    return BAMDB_DB_ERROR;
+  }
+
+  if (begin_index_txn(session, handle, &txn) != BAMDB_SUCCESS) {
+    return BAMDB_DB_ERROR;
+  }
+  rc = read_offsets_range(offset_list, txn, index_name, session->single_env,
+                          min_key, max_key);
+  mdb_txn_abort(txn);
+  return rc;
+}
+
+int get_offsets_lmdb(offset_list_t *offset_list, const char *db_path,
+                     const char *index_name, const char *key) {
+  bamdb_session_t *session;
+  int rc;
+
+  if (bamdb_key_type(index_name) == BAMDB_KEY_REGION) {
+    fprintf(stderr, "Regions need the reference names of the bam header, use "
+                    "get_region_offsets_lmdb instead\n");
+    return BAMDB_DB_ERROR;
+  }
+
+  if ((rc = bamdb_session_open(&session, NULL, db_path)) != BAMDB_SUCCESS) {
+    return rc;
+  }
+  rc = bamdb_session_get_offsets(offset_list, session, index_name, key);
+  bamdb_session_close(session);
+  return rc;
+}
+
+int get_offsets_lmdb_range(offset_list_t *offset_list, const char *db_path,
+                           const char *index_name, const char *min_key,
+                           const char *max_key) {
+  bamdb_session_t *session;
+  int rc;
+
+  if ((rc = bamdb_session_open(&session, NULL, db_path)) != BAMDB_SUCCESS) {
+    return rc;
+  }
+  rc = bamdb_session_get_offsets_range(offset_list, session, index_name,
+                                       min_key, max_key);
+  bamdb_session_close(session);
+  return rc;
+}
+
+bool is_index_present(const char *db_path, const char *index_name) {
+  char target_path[MAX_PATH_CHARS];
+  MDB_env *env = NULL;
+  MDB_txn *txn = NULL;
+  MDB_dbi dbi;
+  struct stat st;
+  bool present;
+
+  bamdb_table_path(target_path, MAX_PATH_CHARS, db_path, index_name);
+  if (stat(target_path, &st) == 0) {
+    return true;
+  }
+  bamdb_hash_path(target_path, MAX_PATH_CHARS, db_path, index_name);
+  if (stat(target_path, &st) == 0) {
+    return true;
+  }
+
+  if (!is_single_env(db_path)) {
+    snprintf(target_path, MAX_PATH_CHARS, "%s/%s/%s", db_path, index_name,
+             LMDB_DATA_FILE);
+    return stat(target_path, &st) == 0;
+  }
+
+  if (open_ro_txn(&env, &txn, db_path) != BAMDB_SUCCESS) {
+    return false;
+  }
+
+  present = mdb_dbi_open(txn, index_name, MDB_DUPSORT | MDB_DUPFIXED,
+                         &dbi) == MDB_SUCCESS;
+  close_lmdb_snapshot(env, txn);
+  return present;
+}
+
+int get_offsets_lmdb_region(offset_list_t *offset_list, const char *db_path,
+                            int32_t tid, int64_t beg, int64_t end) {
+  bamdb_session_t *session;
+  int rc;
+
+  if ((rc = bamdb_session_open(&session, NULL, db_path)) != BAMDB_SUCCESS) {
+    return rc;
+  }
+  rc = read_session_region(offset_list, session, tid, beg, end);
+  bamdb_session_close(session);
+  return rc;
+}
+
+int get_region_offsets_lmdb(offset_list_t *offset_list,
+                            const char *input_file_name, const char *db_path,
+                            const char *region) {
+  bamdb_session_t *session;
+  int rc;
+
+  rc = bamdb_session_open(&session, input_file_name, db_path);
+  if (rc != BAMDB_SUCCESS) {
+    return rc;
+  }
+  rc = bamdb_session_get_offsets(offset_list, session, BAMDB_REGION_INDEX,
+                                 region);
+  bamdb_session_close(session);
+  return rc;
+}
+
+/* Offsets matching one predicate of a multi-index query. They are kept in the
+ * order LMDB keeps the duplicates of a key in, bytewise on the stored offset,
+ * so the list of a single key comes out of the index already sorted. */
+typedef struct posting_list {
+  int64_t *offsets;
+  size_t num_offsets;
+  size_t capacity;
+} posting_list_t;
+
+static int compare_postings(const void *a, const void *b) {
+  return memcmp(a, b, sizeof(int64_t));
+}
+
+static void append_postings(posting_list_t *list, const void *offsets,
+                            size_t num_offsets) {
+  if (list->num_offsets + num_offsets > list->capacity) {
+    list->capacity = (list->num_offsets + num_offsets) * 2;
+    list->offsets = realloc(list->offsets, list->capacity * sizeof(int64_t));
+  }
+  memcpy(list->offsets + list->num_offsets, offsets,
+         num_offsets * sizeof(int64_t));
+  list->num_offsets += num_offsets;
+}
+
+/* Move an offset list spanning several keys into a sorted posting list */
+static void take_postings(posting_list_t *list, offset_list_t *offset_list) {
+  offset_node_t *node = offset_list->head;
+  offset_node_t *next;
+  size_t num_unique = 0;
+
+  while (node != NULL) {
+    next = node->next;
+    append_postings(list, &node->offset, 1);
+    free(node);
+    node = next;
+  }
+
+  if (list->num_offsets > 0) {
+    qsort(list->offsets, list->num_offsets, sizeof(int64_t),
+          compare_postings);
+    for (size_t i = 1; i < list->num_offsets; ++i) {
+      if (compare_postings(&list->offsets[i],
+                           &list->offsets[num_unique]) != 0) {
+        list->offsets[++num_unique] = list->offsets[i];
+      }
+    }
+    list->num_offsets = num_unique + 1;
+  }
+}
+
+/* Read every offset stored under a single key a page at a time */
+static int read_postings_exact(posting_list_t *list, MDB_cursor *cur,
+                               MDB_val *db_key) {
+  MDB_val data;
+  int rc;
+
+  rc = mdb_cursor_get(cur, db_key, &data, MDB_SET);
+  if (rc == MDB_SUCCESS) {
+    rc = mdb_cursor_get(cur, db_key, &data, MDB_GET_MULTIPLE);
+  }
+  while (rc == MDB_SUCCESS) {
+    append_postings(list, data.mv_data, data.mv_size / sizeof(int64_t));
+    rc = mdb_cursor_get(cur, db_key, &data, MDB_NEXT_MULTIPLE);
+  }
+
+  return rc == MDB_NOTFOUND ? BAMDB_SUCCESS : BAMDB_DB_ERROR;
+}
+
+static int read_postings(posting_list_t *list, MDB_txn *txn,
+                         const bamdb_session_t *session,
+                         const char *index_name, const char *key) {
+  offset_list_t offset_list = {0, NULL, NULL};
+  MDB_dbi dbi;
+  MDB_cursor *cur = NULL;
+  MDB_val db_key;
+  uint64_t key_buffer[BAMDB_MAX_KEY_SIZE / sizeof(uint64_t) + 1];
+  bool prefix = false;
+  bool chunked;
+  int32_t tid;
+  int64_t beg, end;
+  int rc;
+
+  if (bamdb_key_type(index_name) == BAMDB_KEY_REGION) {
+    rc = parse_session_region(session, key, &tid, &beg, &end);
+    if (rc == BAMDB_SUCCESS) {
+      rc = read_offsets_region(&offset_list, txn, session->single_env, tid,
+                               beg, end);
+    }
+    take_postings(list, &offset_list);
+    return rc;
+  }
+
+  rc = open_ro_handle(txn, session->single_env ? index_name : NULL, &dbi,
+                      &cur);
+  if (rc != BAMDB_SUCCESS) {
+    return BAMDB_DB_ERROR;
+  }
+  chunked = holds_chunks(txn, dbi);
+
+  if (!encode_query_key(index_name, is_packed_dbi(txn, dbi), key, key_buffer,
+                        &db_key, &prefix)) {
+    /* Such a value was never indexed */
+    rc = BAMDB_SUCCESS;
+  } else if (!prefix && !chunked) {
+    rc = read_postings_exact(list, cur, &db_key);
+  } else {
+    /* Chunks decode in ascending order rather than the duplicate order */
+    rc = read_offsets(&offset_list, txn, index_name, session->single_env,
+                      key);
+    take_postings(list, &offset_list);
+  }
+
+  mdb_cursor_close(cur);
+  if (rc != BAMDB_SUCCESS) {
+    fprintf(stderr, "Error reading %s index\n", index_name);
+  }
+  return rc;
+}
+
+/* read_postings for an index built as a table */
+static int read_table_postings(posting_list_t *list,
+                               const bamdb_table_t *table,
+                               const bamdb_session_t *session,
+                               const char *index_name, const char *key) {
+  offset_list_t offset_list = {0, NULL, NULL};
+  int32_t tid;
+  int64_t beg, end;
+  int rc;
+
+  if (bamdb_key_type(index_name) == BAMDB_KEY_REGION) {
+    rc = parse_session_region(session, key, &tid, &beg, &end);
+    if (rc == BAMDB_SUCCESS) {
+      rc = read_table_region(&offset_list, table, tid, beg, end);
+    }
+  } else {
+    rc = read_table_offsets(&offset_list, table, index_name, key);
+  }
+
+  /* Tables hold ascending offsets rather than the duplicate order */
+  take_postings(list, &offset_list);
+  return rc;
+}
+
+/* read_postings for an index built as a minimal perfect hash */
+static int read_hash_postings(posting_list_t *list, const bamdb_hash_t *hash,
+                              const char *index_name, const char *key) {
+  offset_list_t offset_list = {0, NULL, NULL};
+  int rc = read_hash_offsets(&offset_list, hash, index_name, key);
+
+  take_postings(list, &offset_list);
+  return rc;
+}
+
+/* First position at or after start holding an offset not below target. The
+ * step doubles until it passes target, so skipping far ahead stays cheap when
+ * one list is much longer than the other. */
+static size_t gallop(const posting_list_t *list, size_t start,
+                     const int64_t *target) {
+  size_t step = 1;
+  size_t lo = start;
+  size_t hi = start;
+  size_t mid;
+
+  while (hi < list->num_offsets &&
+         compare_postings(&list->offsets[hi], target) < 0) {
+    lo = hi + 1;
+    hi = start + step;
+    step *= 2;
+  }
+  if (hi > list->num_offsets) {
+    hi = list->num_offsets;
+  }
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (compare_postings(&list->offsets[mid], target) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/* Keep the offsets of result that are also in other */
+static void intersect_postings(posting_list_t *result,
+                               const posting_list_t *other) {
+  size_t num_kept = 0;
+  size_t pos = 0;
+
+  for (size_t i = 0; i < result->num_offsets; ++i) {
+    pos = gallop(other, pos, &result->offsets[i]);
+    if (pos == other->num_offsets) {
+      break;
+    }
+    if (compare_postings(&other->offsets[pos], &result->offsets[i]) == 0) {
+      result->offsets[num_kept++] = result->offsets[i];
+    }
+  }
+
+  result->num_offsets = num_kept;
+}
+
+/* Merge other into result, dropping offsets present in both */
+static void unite_postings(posting_list_t *result,
+                           const posting_list_t *other) {
+  posting_list_t merged = {NULL, 0, 0};
+  size_t i = 0;
+  size_t j = 0;
+  int cmp;
+
+  merged.capacity = result->num_offsets + other->num_offsets;
+  merged.offsets = malloc((merged.capacity + 1) * sizeof(int64_t));
+  while (i < result->num_offsets || j < other->num_offsets) {
+    if (i == result->num_offsets) {
+      cmp = 1;
+    } else if (j == other->num_offsets) {
+      cmp = -1;
+    } else {
+      cmp = compare_postings(&result->offsets[i], &other->offsets[j]);
+    }
+
+    if (cmp <= 0) {
+      merged.offsets[merged.num_offsets++] = result->offsets[i++];
+      j += cmp == 0;
+    } else {
+      merged.offsets[merged.num_offsets++] = other->offsets[j++];
+    }
+  }
+
+  free(result->offsets);
+  *result = merged;
+}
+
+static int compare_list_sizes(const void *a, const void *b) {
+  const posting_list_t *x = a;
+  const posting_list_t *y = b;
+
+  return (x->num_offsets > y->num_offsets) - (x->num_offsets < y->num_offsets);
+}
+
+int bamdb_session_get_offsets_multi(offset_list_t *offset_list,
+                                    bamdb_session_t *session,
+                                    size_t num_predicates, char **index_names,
+                                    char **keys, bamdb_combine_t combine) {
+  MDB_txn *txn = NULL;
+  index_handle_t **handles;
+  posting_list_t *lists;
+  int rc = BAMDB_SUCCESS;
+
+  if (num_predicates == 0) {
+    return BAMDB_SUCCESS;
+  }
+
+  handles = calloc(num_predicates, sizeof(index_handle_t *));
+  for (size_t i = 0; i < num_predicates; ++i) {
+    if ((handles[i] = session_index(session, index_names[i])) == NULL) {
+      free(handles);
+      return BAMDB_DB_ERROR;
+    }
+  }
+
+  /* A key missing from its index leaves nothing to intersect */
+  if (combine == BAMDB_COMBINE_AND) {
+    for (size_t i = 0; i < num_predicates; ++i) {
+      if (bloom_rules_out(handles[i]->bloom, index_names[i], keys[i])) {
+        free(handles);
+        return BAMDB_SUCCESS;
+      }
+    }
+  }
+
+  /* Every index is read from the same snapshot when they share one
+   * environment */
+  if (session->single_env && begin_ro_txn(session->env, &txn) != BAMDB_SUCCESS) {
+    free(handles);
+    return BAMDB_DB_ERROR;
+  }
+
+  lists = calloc(num_predicates, sizeof(posting_list_t));
+  for (size_t i = 0; i < num_predicates && rc == BAMDB_SUCCESS; ++i) {
+    if (combine == BAMDB_COMBINE_OR &&
+        bloom_rules_out(handles[i]->bloom, index_names[i], keys[i])) {
+      continue;
+    }
+    if (handles[i]->table != NULL) {
+      rc = read_table_postings(&lists[i], handles[i]->table, session,
+                               index_names[i], keys[i]);
+    } else if (handles[i]->hash != NULL) {
+      rc = read_hash_postings(&lists[i], handles[i]->hash, index_names[i],
+                              keys[i]);
+    } else if (session->single_env) {
+      rc = read_postings(&lists[i], txn, session, index_names[i], keys[i]);
+    } else {
+      MDB_txn *index_txn = NULL;
+
+      rc = begin_index_txn(session, handles[i], &index_txn);
+      if (rc != BAMDB_SUCCESS) {
+        break;
+      }
+      rc = read_postings(&lists[i], index_txn, session, index_names[i],
+                         keys[i]);
+      mdb_txn_abort(index_txn);
+    }
+    /* Nothing can match every predicate once one matches nothing */
+    if (combine == BAMDB_COMBINE_AND && lists[i].num_offsets == 0) {
+      break;
+    }
+  }
+  if (txn != NULL) {
+    mdb_txn_abort(txn);
+  }
+
+  if (rc == BAMDB_SUCCESS) {
+    /* Starting from the shortest list keeps every intersection step bounded
+     * by the size of the result so far */
+    qsort(lists, num_predicates, sizeof(posting_list_t), compare_list_sizes);
+    for (size_t i = 1; i < num_predicates; ++i) {
+      if (combine == BAMDB_COMBINE_AND) {
+        intersect_postings(&lists[0], &lists[i]);
+      } else {
+        unite_postings(&lists[0], &lists[i]);
+      }
+    }
+
+    for (size_t i = 0; i < lists[0].num_offsets; ++i) {
+      push_offset(offset_list, lists[0].offsets[i]);
+    }
+  }
+
+  for (size_t i = 0; i < num_predicates; ++i) {
+    free(lists[i].offsets);
+  }
+  free(lists);
+  free(handles);
+  return rc;
+}
+
+int get_offsets_lmdb_multi(offset_list_t *offset_list,
+                           const char *input_file_name, const char *db_path,
+                           size_t num_predicates, char **index_names,
+                           char **keys, bamdb_combine_t combine) {
+  bamdb_session_t *session;
+  int rc;
+
+  rc = bamdb_session_open(&session, input_file_name, db_path);
+  if (rc != BAMDB_SUCCESS) {
+    return rc;
+  }
+  rc = bamdb_session_get_offsets_multi(offset_list, session, num_predicates,
+                                       index_names, keys, combine);
+  bamdb_session_close(session);
+  return rc;
+}
+
+static void free_offset_nodes(offset_list_t *offset_list) {
+  offset_node_t *next;
+
+  for (offset_node_t *node = offset_list->head; node != NULL; node = next) {
+    next = node->next;
+    free(node);
+  }
+  offset_list->head = NULL;
+  offset_list->tail = NULL;
+  offset_list->num_entries = 0;
+}
+
+/* Offsets found by a batch lookup, each with the key it matched */
+typedef struct key_offset_list {
+  bamdb_key_offset_t *offsets;
+  size_t num_offsets;
+  size_t capacity;
+} key_offset_list_t;
+
+/* One key of a batch lookup as its index stores it */
+typedef struct batch_key {
+  size_t key_id;  // Position of the key in the batch
+  MDB_val db_key;
+  bool prefix;
+} batch_key_t;
+
+/* Move every offset of offset_list to list, matched by key_id */
+static void take_key_offsets(key_offset_list_t *list,
+                             offset_list_t *offset_list, size_t key_id) {
+  if (list->num_offsets + offset_list->num_entries > list->capacity) {
+    list->capacity = (list->num_offsets + offset_list->num_entries) * 2;
+    list->offsets =
+        realloc(list->offsets, list->capacity * sizeof(bamdb_key_offset_t));
+  }
+
+  for (offset_node_t *node = offset_list->head; node != NULL;
+       node = node->next) {
+    list->offsets[list->num_offsets].offset = node->offset;
+    list->offsets[list->num_offsets++].key_id = key_id;
+  }
+  free_offset_nodes(offset_list);
+}
+
+static int compare_batch_keys(const void *a, const void *b) {
+  const batch_key_t *x = a;
+  const batch_key_t *y = b;
+
+  return bamdb_table_compare(x->db_key.mv_data, x->db_key.mv_size,
+                             y->db_key.mv_data, y->db_key.mv_size);
+}
+
+/* LMDB keeps packed keys as native integers */
+static int compare_packed_batch_keys(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)((const batch_key_t *)a)->db_key.mv_data;
+  uint64_t y = *(const uint64_t *)((const batch_key_t *)b)->db_key.mv_data;
+
+  return (x > y) - (x < y);
+}
+
+/* Encode the keys of a batch that may be in the index and sort them into
+ * the order of the index, so the lookups move forward through it. packed
+ * tells whether an LMDB index holds packed keys; tables are read from
+ * handle. */
+static batch_key_t *encode_batch_keys(const index_handle_t *handle,
+                                      const char *index_name, bool packed,
+                                      size_t num_keys, char **keys,
+                                      size_t *num_batch_keys) {
+  batch_key_t *batch_keys = malloc(num_keys * sizeof(batch_key_t));
+  uint64_t key_buffer[BAMDB_MAX_KEY_SIZE / sizeof(uint64_t) + 1];
+  batch_key_t *batch_key;
+  bool valid;
+
+  *num_batch_keys = 0;
+  for (size_t i = 0; i < num_keys; ++i) {
+    if (bloom_rules_out(handle->bloom, index_name, keys[i])) {
+      continue;
+    }
+
+    batch_key = &batch_keys[*num_batch_keys];
+    if (handle->table != NULL) {
+      valid = encode_table_key(handle->table, index_name, keys[i], key_buffer,
+                               &batch_key->db_key, &batch_key->prefix);
+    } else {
+      valid = encode_query_key(index_name, packed, keys[i], key_buffer,
+                               &batch_key->db_key, &batch_key->prefix);
+    }
+    if (!valid) {
+      /* Such a value was never indexed */
+      continue;
+    }
+
+    /* The encoded key may point into key_buffer or keys */
+    batch_key->db_key.mv_data =
+        memcpy(malloc(batch_key->db_key.mv_size), batch_key->db_key.mv_data,
+               batch_key->db_key.mv_size);
+    batch_key->key_id = i;
+    (*num_batch_keys)++;
+  }
+
+  qsort(batch_keys, *num_batch_keys, sizeof(batch_key_t),
+        packed && handle->table == NULL ? compare_packed_batch_keys
+                                        : compare_batch_keys);
+  return batch_keys;
+}
+
+static void free_batch_keys(batch_key_t *batch_keys, size_t num_batch_keys) {
+  for (size_t i = 0; i < num_batch_keys; ++i) {
+    free(batch_keys[i].db_key.mv_data);
+  }
+  free(batch_keys);
+}
+
+/* Look up every key of a batch in an index built as a table */
+static void read_table_batch(key_offset_list_t *list,
+                             const index_handle_t *handle,
+                             const char *index_name, size_t num_keys,
+                             char **keys) {
+  offset_list_t offset_list = {0, NULL, NULL};
+  batch_key_t *batch_keys;
+  size_t num_batch_keys;
+
+  batch_keys = encode_batch_keys(handle, index_name, false, num_keys, keys,
+                                 &num_batch_keys);
+  for (size_t i = 0; i < num_batch_keys; ++i) {
+    read_table_key_offsets(&offset_list, handle->table,
+                           &batch_keys[i].db_key, batch_keys[i].prefix);
+    take_key_offsets(list, &offset_list, batch_keys[i].key_id);
+  }
+
+  free_batch_keys(batch_keys, num_batch_keys);
+}
+
+/* Look up every key of a batch in an LMDB index with a single cursor */
+static int read_lmdb_batch(key_offset_list_t *list, bamdb_session_t *session,
+                           const index_handle_t *handle,
+                           const char *index_name, size_t num_keys,
+                           char **keys) {
+  offset_list_t offset_list = {0, NULL, NULL};
+  MDB_txn *txn = NULL;
+  MDB_dbi dbi;
+  MDB_cursor *cur = NULL;
+  batch_key_t *batch_keys;
+  size_t num_batch_keys;
+  bool chunked;
+  int rc;
+
+  if (begin_index_txn(session, handle, &txn) != BAMDB_SUCCESS) {
+    return BAMDB_DB_ERROR;
+  }
+  rc = open_ro_handle(txn, session->single_env ? index_name : NULL, &dbi,
+                      &cur);
+  if (rc != BAMDB_SUCCESS) {
+    mdb_txn_abort(txn);
+    return BAMDB_DB_ERROR;
+  }
+  chunked = holds_chunks(txn, dbi);
+
+  batch_keys = encode_batch_keys(handle, index_name, is_packed_dbi(txn, dbi),
+                                 num_keys, keys, &num_batch_keys);
+  for (size_t i = 0; i < num_batch_keys && rc == BAMDB_SUCCESS; ++i) {
+    rc = read_cursor_offsets(&offset_list, cur, chunked,
+                             &batch_keys[i].db_key, batch_keys[i].prefix);
+    take_key_offsets(list, &offset_list, batch_keys[i].key_id);
+  }
+
+  free_batch_keys(batch_keys, num_batch_keys);
+  mdb_cursor_close(cur);
+  mdb_txn_abort(txn);
+  if (rc != BAMDB_SUCCESS) {
+    fprintf(stderr, "Error reading %s index\n", index_name);
+  }
+  return rc;
+}
+
+static int compare_key_offsets(const void *a, const void *b) {
+  const bamdb_key_offset_t *x = a;
+  const bamdb_key_offset_t *y = b;
+
+  if (x->offset != y->offset) {
+    return (x->offset > y->offset) - (x->offset < y->offset);
+  }
+  return (x->key_id > y->key_id) - (x->key_id < y->key_id);
+}
+
+int bamdb_session_get_offsets_batch(bamdb_key_offset_t **offsets,
+                                    size_t *num_offsets,
+                                    bamdb_session_t *session,
+                                    const char *index_name, size_t num_keys,
+                                    char **keys) {
+  key_offset_list_t list = {NULL, 0, 0};
+  offset_list_t offset_list = {0, NULL, NULL};
+  index_handle_t *handle = NULL;
+  int rc = BAMDB_SUCCESS;
+
+  *offsets = NULL;
+  *num_offsets = 0;
+
+  if (bamdb_key_type(index_name) != BAMDB_KEY_REGION &&
+      (handle = session_index(session, index_name)) == NULL) {
+    return BAMDB_DB_ERROR;
+  }
+
+  if (handle == NULL || handle->hash != NULL) {
+    /* Regions and hashed keys gain nothing from being looked up in order */
+    for (size_t i = 0; i < num_keys && rc == BAMDB_SUCCESS; ++i) {
+      rc = bamdb_session_get_offsets(&offset_list, session, index_name,
+                                     keys[i]);
+      take_key_offsets(&list, &offset_list, i);
+    }
+  } else if (handle->table != NULL) {
+    read_table_batch(&list, handle, index_name, num_keys, keys);
+  } else {
+    rc = read_lmdb_batch(&list, session, handle, index_name, num_keys, keys);
+  }
+
+  if (rc != BAMDB_SUCCESS) {
+    free(list.offsets);
+    return rc;
+  }
+
+  /* The rows of every key are read in a single pass over the bam file */
+  qsort(list.offsets, list.num_offsets, sizeof(bamdb_key_offset_t),
+        compare_key_offsets);
+  *offsets = list.offsets;
+  *num_offsets = list.num_offsets;
+  return BAMDB_SUCCESS;
+}
+
+/* Rows fetched by one thread from its own span of the sorted offsets */
+typedef struct fetch_args {
+  const char *input_file_name;
+  bam_hdr_t *header;
+  const int64_t *offsets;
+  size_t num_offsets;
+  bam_sequence_row_t **rows;
+  bam_aux_header_list_t aux_tags;
+  int ret;
+} fetch_args_t;
+
+static void *fetch_func(void *arg) {
+  fetch_args_t *args = (fetch_args_t *)arg;
+  samFile *input_file = 0;
+  int rc;
+
+  /* A bgzf handle keeps the block it inflated last, so every thread reads
+   * through a handle of its own */
+  if ((input_file = sam_open(args->input_file_name, "r")) == 0) {
+    args->ret = BAMDB_SEQUENCE_FILE_ERROR;
+    pthread_exit(NULL);
+  }
+
+  args->ret = BAMDB_SUCCESS;
+  for (size_t i = 0; i < args->num_offsets; ++i) {
+    rc = get_bam_row(&args->rows[i], &args->aux_tags, args->offsets[i],
+                     input_file, args->header);
+    if (rc != BAMDB_SUCCESS && args->ret == BAMDB_SUCCESS) {
+      args->ret = rc;
+    }
+  }
+
+  sam_close(input_file);
+  pthread_exit(NULL);
+}
+
+/* Move the tags seen by a fetch thread that tags does not hold yet to tags,
+ * freeing the others */
+static void merge_aux_tags(bam_aux_header_list_t *tags,
+                           bam_aux_header_list_t *thread_tags) {
+  bam_aux_header_t *tag, *next, *known;
+
+  for (tag = thread_tags->head; tag != NULL; tag = next) {
+    next = tag->next;
+    for (known = tags->head; known != NULL; known = known->next) {
+      if (known->key.key[0] == tag->key.key[0] &&
+          known->key.key[1] == tag->key.key[1]) {
+        break;
+      }
+    }
+    if (known != NULL) {
+      free(tag);
+      continue;
+    }
+
+    tag->next = NULL;
+    if (tags->tail != NULL) {
+      tags->tail->next = tag;
+    } else {
+      tags->head = tag;
+    }
+    tags->tail = tag;
+  }
+}
+
+/* Split offsets in file order into at most max_spans spans of about the same
+ * size. A span never ends inside a bgzf block, the upper 48 bits of an
+ * offset, so no block is inflated by two threads. starts is set to the first
+ * offset of every span followed by num_offsets. Returns the number of
+ * spans. */
+static size_t split_offsets(const int64_t *offsets, size_t num_offsets,
+                            size_t max_spans, size_t *starts) {
+  size_t num_spans = 0;
+  size_t start = 0;
+  size_t end;
+
+  while (start < num_offsets && num_spans < max_spans) {
+    starts[num_spans++] = start;
+    end = num_offsets * num_spans / max_spans;
+    if (end <= start) {
+      end = start + 1;
+    }
+    while (end < num_offsets && offsets[end] >> 16 == offsets[end - 1] >> 16) {
+      end++;
+    }
+    start = end;
+  }
+  starts[num_spans] = num_offsets;
+
+  return num_spans;
+}
+
+/* Read the rows at offsets, in file order, into output with up to
+ * num_threads threads. Each thread fills its own span of the rows, so they
+ * stay in file order. */
+static int fetch_rows_parallel(bam_row_set_t *output,
+                               const bamdb_session_t *session,
+                               const int64_t *offsets, size_t num_threads) {
+  size_t *starts = malloc((num_threads + 1) * sizeof(size_t));
+  fetch_args_t *fetch_args = calloc(num_threads, sizeof(fetch_args_t));
+  pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+  size_t num_spans, launched;
+  int ret = BAMDB_SUCCESS;
+  int rc;
+
+  num_spans =
+      split_offsets(offsets, output->num_entries, num_threads, starts);
+  for (launched = 0; launched < num_spans; ++launched) {
+    fetch_args[launched].input_file_name = session->input_file_name;
+    fetch_args[launched].header = session->header;
+    fetch_args[launched].offsets = offsets + starts[launched];
+    fetch_args[launched].num_offsets =
+        starts[launched + 1] - starts[launched];
+    fetch_args[launched].rows = output->rows + starts[launched];
+
+    rc = pthread_create(&threads[launched], NULL, fetch_func,
+                        &fetch_args[launched]);
+    if (rc != 0) {
+      fprintf(stderr,
+              "Received non-zero return code when launching fetch thread: "
+              "%d\n",
+              rc);
+      ret = BAMDB_INTERNAL_ERROR;
+      /* Only the rows of the spans launched are read */
+      output->num_entries = starts[launched];
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < launched; ++i) {
+    pthread_join(threads[i], NULL);
+    if (fetch_args[i].ret != BAMDB_SUCCESS && ret == BAMDB_SUCCESS) {
+      ret = fetch_args[i].ret;
+    }
+    merge_aux_tags(&output->aux_tags, &fetch_args[i].aux_tags);
+  }
+
+  free(threads);
+  free(fetch_args);
+  free(starts);
+  return ret;
+}
+
+/* Read the rows at every offset of the list into output */
+static int read_bam_rows(bam_row_set_t *output, bamdb_session_t *session,
+                         offset_list_t *offsets) {
+  offset_node_t *offset_node;
+  int64_t *sorted_offsets;
+  size_t num_threads;
+  int i = 0;
+  int ret = BAMDB_SUCCESS;
+
+  if (session->input_file == 0) {
+    fprintf(stderr, "Rows can only be read from a session opened with the bam "
+                    "file\n");
+    return BAMDB_SEQUENCE_FILE_ERROR;
+  }
+
+  output->num_entries = offsets->num_entries;
+  output->rows = calloc(output->num_entries, sizeof(bam_sequence_row_t *));
+
+  /* Rows come back in file order, reading each block once */
+  sort_offset_list(offsets);
+
+  /* Small results are not worth opening the bam file again per thread */
+  num_threads = offsets->num_entries / MIN_FETCH_THREAD_ROWS;
+  if (num_threads > session->num_threads) {
+    num_threads = session->num_threads;
+  }
+  if (num_threads > 1) {
+    sorted_offsets = malloc(offsets->num_entries * sizeof(int64_t));
+    for (offset_node = offsets->head; offset_node != NULL;
+         offset_node = offset_node->next) {
+      sorted_offsets[i++] = offset_node->offset;
+    }
+    ret = fetch_rows_parallel(output, session, sorted_offsets, num_threads);
+    free(sorted_offsets);
+    return ret;
+  }
+
+  /* Rows after the first that fails to read are left NULL */
+  offset_node = offsets->head;
+  while (offset_node != NULL && ret == BAMDB_SUCCESS) {
+    ret = get_bam_row(&output->rows[i], &output->aux_tags,
+                      offset_node->offset, session->input_file,
+                      session->header);
+    offset_node = offset_node->next;
+    i++;
+  }
+
+  return ret;
+}
+
+int bamdb_session_get_rows(bam_row_set_t **output, bamdb_session_t *session,
+                           const char *index_name, const char *key) {
+  offset_list_t offsets = {0, NULL, NULL};
+  int rc;
+
+  /* Always create an object for the caller */
+  *output = calloc(1, sizeof(bam_row_set_t));
+
+  rc = bamdb_session_get_offsets(&offsets, session, index_name, key);
+  if (rc == BAMDB_SUCCESS) {
+    rc = read_bam_rows(*output, session, &offsets);
+  }
+
+  free_offset_nodes(&offsets);
+  return rc;
+}
+
+int bamdb_session_get_rows_multi(bam_row_set_t **output,
+                                 bamdb_session_t *session,
+                                 size_t num_predicates, char **index_names,
+                                 char **keys, bamdb_combine_t combine) {
+  offset_list_t offsets = {0, NULL, NULL};
+  int rc;
+
+  /* Always create an object for the caller */
+  *output = calloc(1, sizeof(bam_row_set_t));
+
+  rc = bamdb_session_get_offsets_multi(&offsets, session, num_predicates,
+                                       index_names, keys, combine);
+  if (rc == BAMDB_SUCCESS) {
+    rc = read_bam_rows(*output, session, &offsets);
+  }
+
+  free_offset_nodes(&offsets);
+  return rc;
+}
+
+int bamdb_session_get_rows_range(bam_row_set_t **output,
+                                 bamdb_session_t *session,
+                                 const char *index_name, const char *min_key,
+                                 const char *max_key) {
+  offset_list_t offsets = {0, NULL, NULL};
+  int rc;
+
+  /* Always create an object for the caller */
+  *output = calloc(1, sizeof(bam_row_set_t));
+
+  rc = bamdb_session_get_offsets_range(&offsets, session, index_name, min_key,
+                                       max_key);
+  if (rc == BAMDB_SUCCESS) {
+    rc = read_bam_rows(*output, session, &offsets);
+  }
+
+  free_offset_nodes(&offsets);
+  return rc;
+}
+
+int bamdb_session_get_rows_batch(bam_row_set_t **output,
+                                 bamdb_session_t *session,
+                                 const char *index_name, size_t num_keys,
+                                 char **keys) {
+  offset_list_t offsets = {0, NULL, NULL};
+  bamdb_key_offset_t *key_offsets;
+  size_t num_key_offsets;
+  int rc;
+
+  /* Always create an object for the caller */
+  *output = calloc(1, sizeof(bam_row_set_t));
+
+  rc = bamdb_session_get_offsets_batch(&key_offsets, &num_key_offsets,
+                                       session, index_name, num_keys, keys);
+  if (rc != BAMDB_SUCCESS) {
+    return rc;
+  }
+
+  /* A row matching several keys is returned once for each of them */
+  for (size_t i = 0; i < num_key_offsets; ++i) {
+    push_offset(&offsets, key_offsets[i].offset);
+  }
+  rc = read_bam_rows(*output, session, &offsets);
+  if (rc == BAMDB_SUCCESS) {
+    /* The offsets were already in file order, so rows line up with them */
+    (*output)->key_ids = malloc(num_key_offsets * sizeof(size_t));
+    for (size_t i = 0; i < num_key_offsets; ++i) {
+      (*output)->key_ids[i] = key_offsets[i].key_id;
+    }
+  }
+
+  free_offset_nodes(&offsets);
+  free(key_offsets);
+  return rc;
+}
+
+struct bamdb_row_iter {
+  bamdb_session_t *session;
+  /* Offsets of the rows in file order and, for a batch lookup, the key each
+   * one matched */
+  int64_t *offsets;
+  size_t *key_ids;
+  size_t num_offsets;
+  /* Position of the row returned by the next call to bamdb_row_iter_next */
+  size_t next;
+  bam_aux_header_list_t aux_tags;
+  /* Rows read ahead by the session's threads, those of the offsets from
+   * window_start up to window_end. Rows handed to the caller are set to
+   * NULL. */
+  bam_sequence_row_t **window;
+  size_t window_start;
+  size_t window_end;
+};
+
+/* Iterate over the rows at the offsets of a list, which is emptied */
+static int open_row_iter(bamdb_row_iter_t **iter, bamdb_session_t *session,
+                         offset_list_t *offsets) {
+  bamdb_row_iter_t *new_iter;
+  size_t i = 0;
+
+  if (session->input_file == 0) {
+    fprintf(stderr, "Rows can only be read from a session opened with the bam "
+                    "file\n");
+    free_offset_nodes(offsets);
+    return BAMDB_SEQUENCE_FILE_ERROR;
+  }
+
+  new_iter = calloc(1, sizeof(bamdb_row_iter_t));
+  new_iter->session = session;
+  new_iter->num_offsets = offsets->num_entries;
+  new_iter->offsets = malloc(offsets->num_entries * sizeof(int64_t));
+
+  /* Rows come back in file order, reading each block once */
+  sort_offset_list(offsets);
+  for (offset_node_t *node = offsets->head; node != NULL; node = node->next) {
+    new_iter->offsets[i++] = node->offset;
+  }
+  free_offset_nodes(offsets);
+
+  *iter = new_iter;
+  return BAMDB_SUCCESS;
+}
+
+int bamdb_session_iter_rows(bamdb_row_iter_t **iter, bamdb_session_t *session,
+                            const char *index_name, const char *key) {
+  offset_list_t offsets = {0, NULL, NULL};
+  int rc;
+
+  *iter = NULL;
+  rc = bamdb_session_get_offsets(&offsets, session, index_name, key);
+  if (rc != BAMDB_SUCCESS) {
+    free_offset_nodes(&offsets);
+    return rc;
+  }
+
+  return open_row_iter(iter, session, &offsets);
+}
+
+int bamdb_session_iter_rows_multi(bamdb_row_iter_t **iter,
+                                  bamdb_session_t *session,
+                                  size_t num_predicates, char **index_names,
+                                  char **keys, bamdb_combine_t combine) {
+  offset_list_t offsets = {0, NULL, NULL};
+  int rc;
+
+  *iter = NULL;
+  rc = bamdb_session_get_offsets_multi(&offsets, session, num_predicates,
+                                       index_names, keys, combine);
+  if (rc != BAMDB_SUCCESS) {
+    free_offset_nodes(&offsets);
+    return rc;
+  }
+
+  return open_row_iter(iter, session, &offsets);
+}
+
+int bamdb_session_iter_rows_range(bamdb_row_iter_t **iter,
+                                  bamdb_session_t *session,
+                                  const char *index_name, const char *min_key,
+                                  const char *max_key) {
+  offset_list_t offsets = {0, NULL, NULL};
+  int rc;
+
+  *iter = NULL;
+  rc = bamdb_session_get_offsets_range(&offsets, session, index_name, min_key,
+                                       max_key);
+  if (rc != BAMDB_SUCCESS) {
+    free_offset_nodes(&offsets);
+    return rc;
+  }
+
+  return open_row_iter(iter, session, &offsets);
+}
+
+int bamdb_session_iter_rows_batch(bamdb_row_iter_t **iter,
+                                  bamdb_session_t *session,
+                                  const char *index_name, size_t num_keys,
+                                  char **keys) {
+  bamdb_row_iter_t *new_iter;
+  bamdb_key_offset_t *key_offsets;
+  size_t num_key_offsets;
+  int rc;
+
+  *iter = NULL;
+  if (session->input_file == 0) {
+    fprintf(stderr, "Rows can only be read from a session opened with the bam "
+                    "file\n");
+    return BAMDB_SEQUENCE_FILE_ERROR;
+  }
+
+  rc = bamdb_session_get_offsets_batch(&key_offsets, &num_key_offsets,
+                                       session, index_name, num_keys, keys);
+  if (rc != BAMDB_SUCCESS) {
+    return rc;
+  }
+
+  /* The offsets already come in file order */
+  new_iter = calloc(1, sizeof(bamdb_row_iter_t));
+  new_iter->session = session;
+  new_iter->num_offsets = num_key_offsets;
+  new_iter->offsets = malloc(num_key_offsets * sizeof(int64_t));
+  new_iter->key_ids = malloc(num_key_offsets * sizeof(size_t));
+  for (size_t i = 0; i < num_key_offsets; ++i) {
+    new_iter->offsets[i] = key_offsets[i].offset;
+    new_iter->key_ids[i] = key_offsets[i].key_id;
+  }
+  free(key_offsets);
+
+  *iter = new_iter;
+  return BAMDB_SUCCESS;
+}
+
+/* Free the rows of the window the caller was not handed */
+static void clear_row_window(bamdb_row_iter_t *iter) {
+  for (size_t i = iter->next; i < iter->window_end; ++i) {
+    if (iter->window[i - iter->window_start] != NULL) {
+      destroy_bam_sequence_row(iter->window[i - iter->window_start]);
+    }
+  }
+  iter->window_start = iter->window_end = iter->next;
+}
+
+/* Read the rows following the last one returned into the window, with as
+ * many of the session's threads as there are rows for. The window holds at
+ * most ITER_WINDOW_THREAD_ROWS rows per thread, so memory stays bounded
+ * however large the result. Returns false if the rows left are too few to
+ * be worth threads, in which case they are read one at a time. */
+static bool fill_row_window(bamdb_row_iter_t *iter, int *rc) {
+  size_t max_threads = iter->session->num_threads;
+  size_t num_rows = iter->num_offsets - iter->next;
+  size_t num_threads;
+  bam_row_set_t rows;
+
+  if (num_rows > max_threads * ITER_WINDOW_THREAD_ROWS) {
+    num_rows = max_threads * ITER_WINDOW_THREAD_ROWS;
+  }
+  num_threads = num_rows / MIN_FETCH_THREAD_ROWS;
+  if (num_threads > max_threads) {
+    num_threads = max_threads;
+  }
+  if (num_threads < 2) {
+    return false;
+  }
+
+  if (iter->window == NULL) {
+    iter->window = calloc(max_threads * ITER_WINDOW_THREAD_ROWS,
+                          sizeof(bam_sequence_row_t *));
+  }
+
+  memset(iter->window, 0, num_rows * sizeof(bam_sequence_row_t *));
+  rows.num_entries = num_rows;
+  rows.rows = iter->window;
+  rows.aux_tags = iter->aux_tags;
+  rows.key_ids = NULL;
+  *rc = fetch_rows_parallel(&rows, iter->session, iter->offsets + iter->next,
+                            num_threads);
+  iter->aux_tags = rows.aux_tags;
+
+  /* Rows of spans that could not be launched were never read */
+  iter->window_start = iter->next;
+  iter->window_end = iter->next + rows.num_entries;
+  if (*rc != BAMDB_SUCCESS) {
+    clear_row_window(iter);
+  }
+  return true;
+}
+
+int bamdb_row_iter_next(bamdb_row_iter_t *iter, bam_sequence_row_t **row) {
+  int rc = BAMDB_SUCCESS;
+
+  *row = NULL;
+  if (iter->next == iter->num_offsets) {
+    return BAMDB_SUCCESS;
+  }
+
+  if (iter->next < iter->window_end ||
+      (iter->session->num_threads > 1 && fill_row_window(iter, &rc))) {
+    if (rc != BAMDB_SUCCESS) {
+      return rc;
+    }
+    *row = iter->window[iter->next - iter->window_start];
+    iter->window[iter->next++ - iter->window_start] = NULL;
+    return BAMDB_SUCCESS;
+  }
+
+  return get_bam_row(row, &iter->aux_tags, iter->offsets[iter->next++],
+                     iter->session->input_file, iter->session->header);
+}
+
+size_t bamdb_row_iter_key_id(const bamdb_row_iter_t *iter) {
+  return iter->key_ids != NULL && iter->next > 0
+             ? iter->key_ids[iter->next - 1]
+             : 0;
+}
+
+void bamdb_row_iter_close(bamdb_row_iter_t *iter) {
+  bam_aux_header_t *tag, *next;
+
+  if (iter == NULL) {
+    return;
+  }
+
+  clear_row_window(iter);
+  for (tag = iter->aux_tags.head; tag != NULL; tag = next) {
+    next = tag->next;
+    free(tag);
+  }
+  free(iter->window);
+  free(iter->key_ids);
+  free(iter->offsets);
+  free(iter);
+}
+
+int get_bam_rows(bam_row_set_t **output, const char *input_file_name,
+                 const char *db_path, const char *index_name, const char *key) {
+  bamdb_session_t *session;
+  int rc;
+
+  rc = bamdb_session_open(&session, input_file_name, db_path);
+  if (rc != BAMDB_SUCCESS) {
+    /* Always create an object for the caller */
+    *output = calloc(1, sizeof(bam_row_set_t));
+    return rc;
+  }
+  rc = bamdb_session_get_rows(output, session, index_name, key);
+  bamdb_session_close(session);
+  return rc;
+}
+
+int get_bam_rows_multi(bam_row_set_t **output, const char *input_file_name,
+                       const char *db_path, size_t num_predicates,
+                       char **index_names, char **keys,
+                       bamdb_combine_t combine) {
+  bamdb_session_t *session;
+  int rc;
+
+  rc = bamdb_session_open(&session, input_file_name, db_path);
+  if (rc != BAMDB_SUCCESS) {
+    /* Always create an object for the caller */
+    *output = calloc(1, sizeof(bam_row_set_t));
+    return rc;
+  }
+  rc = bamdb_session_get_rows_multi(output, session, num_predicates,
+                                    index_names, keys, combine);
+  bamdb_session_close(session);
+  return rc;
+}
+
+int get_bam_rows_range(bam_row_set_t **output, const char *input_file_name,
+                       const char *db_path, const char *index_name,
+                       const char *min_key, const char *max_key) {
+  bamdb_session_t *session;
+  int rc;
+
+  rc = bamdb_session_open(&session, input_file_name, db_path);
+  if (rc != BAMDB_SUCCESS) {
+    /* Always create an object for the caller */
+    *output = calloc(1, sizeof(bam_row_set_t));
+    return rc;
+  }
+  rc = bamdb_session_get_rows_range(output, session, index_name, min_key,
+                                    max_key);
+  bamdb_session_close(session);
+  return rc;
+}
@@ -1,4 +1,5 @@
 #ifdef BUILD_BAMDB_WRITER
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,12 +7,17 @@
 
 #include "bam_api.h"
 #include "bamdb.h"
+#include "bamdb_barcode.h"
+#include "bamdb_key.h"
 #include "bamdb_lmdb.h"
+#include "bamdb_meta.h"
+#include "bamdb_stats.h"
 
 enum bamdb_convert_to {
   BAMDB_CONVERT_TO_TEXT,
   BAMDB_CONVERT_TO_SQLITE,
-  BAMDB_CONVERT_TO_LMDB
+  BAMDB_CONVERT_TO_LMDB,
+  BAMDB_CONVERT_TO_TABLE
 };
 
 typedef struct bamdb_args {
@@ -19,9 +25,212 @@ typedef struct bamdb_args {
   char input_file_name[MAX_FILENAME];
   char *index_file_name;
   char *output_file_name;
-  char *bx;
+  char **keys;  // Every -b in order
+  size_t num_keys;
+  char **index_names;  // Every -k in order
+  size_t num_index_names;
+  bamdb_combine_t combine;
+  char *min_key;
+  char *max_key;
+  char *key_file_name;  // One key per line to look up as a batch
+  bool sorted_build;
+  size_t sort_buffer_size;
+  char *tmp_dir;
+  size_t num_deserialize_threads;
+  size_t num_decompress_threads;  // Extra BGZF inflate threads of a build
+  size_t num_fetch_threads;  // Threads reading the rows of a query
+  size_t num_chunks;
+  bool update;
+  bool resume;
+  bool single_env;
+  bool pack_barcodes;
+  bool compress_postings;
+  bool hash_qname;
+  bamdb_row_filter_t row_filter;
 } bam_args_t;
 
+/* Long options without a short form use values outside the char range */
+enum bamdb_long_opt {
+  BAMDB_OPT_UPDATE = 256,
+  BAMDB_OPT_RESUME,
+  BAMDB_OPT_SINGLE_ENV,
+  BAMDB_OPT_PACK_BARCODES,
+  BAMDB_OPT_MIN,
+  BAMDB_OPT_MAX,
+  BAMDB_OPT_ANY,
+  BAMDB_OPT_COMPRESS_POSTINGS,
+  BAMDB_OPT_HASH_QNAME,
+  BAMDB_OPT_REQUIRE_FLAGS,
+  BAMDB_OPT_EXCLUDE_FLAGS,
+  BAMDB_OPT_PRIMARY_ONLY,
+  BAMDB_OPT_MIN_MAPQ,
+  BAMDB_OPT_CONTIG,
+  BAMDB_OPT_KEYS_FROM,
+  BAMDB_OPT_FETCH_THREADS
+};
+
+static const struct option long_options[] = {
+    {"update", no_argument, NULL, BAMDB_OPT_UPDATE},
+    {"resume", no_argument, NULL, BAMDB_OPT_RESUME},
+    {"single-env", no_argument, NULL, BAMDB_OPT_SINGLE_ENV},
+    {"pack-barcodes", no_argument, NULL, BAMDB_OPT_PACK_BARCODES},
+    {"min", required_argument, NULL, BAMDB_OPT_MIN},
+    {"max", required_argument, NULL, BAMDB_OPT_MAX},
+    {"any", no_argument, NULL, BAMDB_OPT_ANY},
+    {"compress-postings", no_argument, NULL, BAMDB_OPT_COMPRESS_POSTINGS},
+    {"hash-qname", no_argument, NULL, BAMDB_OPT_HASH_QNAME},
+    {"require-flags", required_argument, NULL, BAMDB_OPT_REQUIRE_FLAGS},
+    {"exclude-flags", required_argument, NULL, BAMDB_OPT_EXCLUDE_FLAGS},
+    {"primary-only", no_argument, NULL, BAMDB_OPT_PRIMARY_ONLY},
+    {"min-mapq", required_argument, NULL, BAMDB_OPT_MIN_MAPQ},
+    {"contig", required_argument, NULL, BAMDB_OPT_CONTIG},
+    {"keys-from", required_argument, NULL, BAMDB_OPT_KEYS_FROM},
+    {"fetch-threads", required_argument, NULL, BAMDB_OPT_FETCH_THREADS},
+    {NULL, 0, NULL, 0}};
+
+static char **append_arg(char **list, size_t *num_args, const char *arg) {
+  list = realloc(list, (*num_args + 1) * sizeof(char *));
+  list[(*num_args)++] = strdup(arg);
+  return list;
+}
+
+/* Read one key per line, from stdin if file_name is "-". Empty lines are
+ * skipped. Returns NULL if the file cannot be read. */
+static char **read_key_file(const char *file_name, size_t *num_keys) {
+  FILE *fp = strcmp(file_name, "-") == 0 ? stdin : fopen(file_name, "r");
+  char **keys;
+  size_t capacity = 1024;
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t length;
+
+  if (fp == NULL) {
+    fprintf(stderr, "Unable to read keys from %s\n", file_name);
+    return NULL;
+  }
+
+  *num_keys = 0;
+  keys = malloc(capacity * sizeof(char *));
+  while ((length = getline(&line, &line_size, fp)) != -1) {
+    while (length > 0 &&
+           (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+      line[--length] = '\0';
+    }
+    if (length == 0) {
+      continue;
+    }
+    if (*num_keys == capacity) {
+      capacity *= 2;
+      keys = realloc(keys, capacity * sizeof(char *));
+    }
+    keys[(*num_keys)++] = strdup(line);
+  }
+
+  free(line);
+  if (fp != stdin) {
+    fclose(fp);
+  }
+  return keys;
+}
+
+static void append_offset(offset_list_t *offset_list, int64_t offset) {
+  offset_node_t *node = calloc(1, sizeof(offset_node_t));
+
+  node->offset = offset;
+  if (offset_list->tail == NULL) {
+    offset_list->head = node;
+  } else {
+    offset_list->tail->next = node;
+  }
+  offset_list->tail = node;
+  offset_list->num_entries++;
+}
+
+/* Keep the first max_rows offsets of a list in file order */
+static void truncate_offset_list(offset_list_t *offset_list,
+                                 size_t max_rows) {
+  offset_node_t *node = offset_list->head;
+  offset_node_t *next;
+
+  if (offset_list->num_entries <= max_rows) {
+    return;
+  }
+
+  sort_offset_list(offset_list);
+  for (size_t i = 1; i < max_rows; ++i) {
+    node = node->next;
+  }
+  next = node->next;
+  node->next = NULL;
+  offset_list->tail = node;
+  offset_list->num_entries = max_rows;
+
+  for (node = next; node != NULL; node = next) {
+    next = node->next;
+    free(node);
+  }
+}
+
+/* The n-th key is looked up in the n-th index given, keys past the last index
+ * use the last one and BX is searched if no index was given */
+static char *key_index_name(const bam_args_t *bam_args, size_t n) {
+  if (bam_args->num_index_names == 0) {
+    return "BX";
+  }
+  if (n >= bam_args->num_index_names) {
+    n = bam_args->num_index_names - 1;
+  }
+  return bam_args->index_names[n];
+}
+
+/* bamdb stats <index path> [index ...] prints the statistics of the named
+ * indices, or of every index of the database when none are named */
+static int print_index_stats(int argc, char *argv[]) {
+  bamdb_meta_t meta = {0};
+  bamdb_index_stats_t stats;
+  char **index_names = argv + 1;
+  size_t num_indices = argc - 1;
+  size_t suffix_len = strlen(BAMDB_PACKED_INDEX_SUFFIX);
+  int ret = 0;
+
+  if (argc < 1) {
+    fprintf(stderr, "Usage: bamdb stats <index path> [index ...]\n");
+    return 1;
+  }
+
+  if (num_indices == 0) {
+    if (bamdb_read_meta(argv[0], &meta) != BAMDB_SUCCESS) {
+      return 1;
+    }
+    index_names = meta.indices;
+    num_indices = meta.num_indices;
+  }
+
+  for (size_t i = 0; i < num_indices; ++i) {
+    char *name = strdup(index_names[i]);
+    size_t len = strlen(name);
+
+    /* Packed indices are recorded with a suffix in the metadata */
+    if (len > suffix_len &&
+        strcmp(name + len - suffix_len, BAMDB_PACKED_INDEX_SUFFIX) == 0) {
+      name[len - suffix_len] = '\0';
+    }
+
+    if (bamdb_read_stats(argv[0], name, &stats) == BAMDB_SUCCESS) {
+      bamdb_print_stats(stdout, name, &stats);
+      bamdb_free_stats(&stats);
+    } else if (bamdb_key_type(name) != BAMDB_KEY_REGION) {
+      fprintf(stderr, "No statistics for the %s index in %s\n", name,
+              argv[0]);
+      ret = 1;
+    }
+    free(name);
+  }
+
+  bamdb_free_meta(&meta);
+  return ret;
+}
+
 int main(int argc, char *argv[]) {
   int rc = 0;
   int c;
@@ -29,14 +238,43 @@ int main(int argc, char *argv[]) {
   int max_rows = 0;
 
   bam_args.index_file_name = NULL;
-  bam_args.bx = NULL;
+  bam_args.keys = NULL;
+  bam_args.num_keys = 0;
+  bam_args.index_names = NULL;
+  bam_args.num_index_names = 0;
+  bam_args.combine = BAMDB_COMBINE_AND;
+  bam_args.min_key = NULL;
+  bam_args.max_key = NULL;
+  bam_args.key_file_name = NULL;
   bam_args.output_file_name = NULL;
   bam_args.convert_to = BAMDB_CONVERT_TO_TEXT;
-  while ((c = getopt(argc, argv, "t:f:n:i:b:o:")) != -1) {
+  bam_args.sorted_build = false;
+  bam_args.sort_buffer_size = 0;
+  bam_args.tmp_dir = NULL;
+  bam_args.num_deserialize_threads = 1;
+  bam_args.num_decompress_threads = 0;
+  bam_args.num_fetch_threads = 0;
+  bam_args.num_chunks = 1;
+  bam_args.update = false;
+  bam_args.resume = false;
+  bam_args.single_env = false;
+  bam_args.pack_barcodes = false;
+  bam_args.compress_postings = false;
+  bam_args.hash_qname = false;
+  memset(&bam_args.row_filter, 0, sizeof(bamdb_row_filter_t));
+
+  if (argc > 1 && strcmp(argv[1], "stats") == 0) {
+    return print_index_stats(argc - 2, argv + 2);
+  }
+
+  while ((c = getopt_long(argc, argv, "t:f:n:i:b:k:o:sm:T:d:@:p:", long_options,
+                          NULL)) != -1) {
     switch (c) {
       case 't':
         if (strcmp(optarg, "lmdb") == 0) {
           bam_args.convert_to = BAMDB_CONVERT_TO_LMDB;
+        } else if (strcmp(optarg, "table") == 0) {
+          bam_args.convert_to = BAMDB_CONVERT_TO_TABLE;
         } else if (strcmp(optarg, "text") == 0) {
           bam_args.convert_to = BAMDB_CONVERT_TO_TEXT;
         } else {
@@ -54,26 +292,132 @@ int main(int argc, char *argv[]) {
         bam_args.index_file_name = strdup(optarg);
         break;
       case 'b':
-        bam_args.bx = strdup(optarg);
+        bam_args.keys = append_arg(bam_args.keys, &bam_args.num_keys, optarg);
+        break;
+      case 'k':
+        bam_args.index_names = append_arg(bam_args.index_names,
+                                          &bam_args.num_index_names, optarg);
         break;
       case 'o':
         bam_args.output_file_name = strdup(optarg);
         break;
+      case 's':
+        bam_args.sorted_build = true;
+        break;
+      case 'm':
+        /* Sort buffer size per index in megabytes */
+        bam_args.sort_buffer_size = (size_t)atol(optarg) * 1024 * 1024;
+        break;
+      case 'T':
+        bam_args.tmp_dir = strdup(optarg);
+        break;
+      case 'd':
+        bam_args.num_deserialize_threads = atoi(optarg);
+        break;
+      case '@':
+        bam_args.num_decompress_threads = atoi(optarg);
+        break;
+      case 'p':
+        bam_args.num_chunks = atoi(optarg);
+        break;
+      case BAMDB_OPT_UPDATE:
+        bam_args.update = true;
+        break;
+      case BAMDB_OPT_RESUME:
+        bam_args.resume = true;
+        break;
+      case BAMDB_OPT_SINGLE_ENV:
+        bam_args.single_env = true;
+        break;
+      case BAMDB_OPT_PACK_BARCODES:
+        bam_args.pack_barcodes = true;
+        break;
+      case BAMDB_OPT_MIN:
+        bam_args.min_key = strdup(optarg);
+        break;
+      case BAMDB_OPT_MAX:
+        bam_args.max_key = strdup(optarg);
+        break;
+      case BAMDB_OPT_ANY:
+        bam_args.combine = BAMDB_COMBINE_OR;
+        break;
+      case BAMDB_OPT_COMPRESS_POSTINGS:
+        bam_args.compress_postings = true;
+        break;
+      case BAMDB_OPT_HASH_QNAME:
+        bam_args.hash_qname = true;
+        break;
+      case BAMDB_OPT_REQUIRE_FLAGS:
+        /* Flags may be given in decimal or as 0x hex */
+        bam_args.row_filter.require_flags |= strtol(optarg, NULL, 0);
+        break;
+      case BAMDB_OPT_EXCLUDE_FLAGS:
+        bam_args.row_filter.exclude_flags |= strtol(optarg, NULL, 0);
+        break;
+      case BAMDB_OPT_PRIMARY_ONLY:
+        /* The primary alignments of mapped reads */
+        bam_args.row_filter.exclude_flags |=
+            BAM_FUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY;
+        break;
+      case BAMDB_OPT_MIN_MAPQ:
+        bam_args.row_filter.min_mapq = atoi(optarg);
+        break;
+      case BAMDB_OPT_CONTIG:
+        bam_args.row_filter.contigs =
+            append_arg(bam_args.row_filter.contigs,
+                       &bam_args.row_filter.num_contigs, optarg);
+        break;
+      case BAMDB_OPT_KEYS_FROM:
+        bam_args.key_file_name = strdup(optarg);
+        break;
+      case BAMDB_OPT_FETCH_THREADS:
+        bam_args.num_fetch_threads = atoi(optarg);
+        break;
       default:
         fprintf(stderr, "Unknown argument\n");
         return 1;
     }
   }
 
-  if (bam_args.convert_to == BAMDB_CONVERT_TO_LMDB) {
+  if (bam_args.convert_to == BAMDB_CONVERT_TO_LMDB ||
+      bam_args.convert_to == BAMDB_CONVERT_TO_TABLE) {
+    /* Every non optional argument names a key to index */
+    size_t num_keys = optind < argc ? (size_t)(argc - optind) : 1;
     bamdb_indices_t target_indices = {.includes_qname = true,
-                                      .num_key_indices = 1,
-                                      .key_indices = malloc(sizeof(char *))};
+                                      .num_key_indices = num_keys,
+                                      .key_indices =
+                                          calloc(num_keys, sizeof(char *)),
+                                      .packed_key_indices =
+                                          calloc(num_keys, sizeof(bool)),
+                                      .sorted_build = bam_args.sorted_build,
+                                      .sort_buffer_size =
+                                          bam_args.sort_buffer_size,
+                                      .tmp_dir = bam_args.tmp_dir,
+                                      .num_deserialize_threads =
+                                          bam_args.num_deserialize_threads,
+                                      .num_decompress_threads =
+                                          bam_args.num_decompress_threads,
+                                      .num_chunks = bam_args.num_chunks,
+                                      .update = bam_args.update,
+                                      .resume = bam_args.resume,
+                                      .single_env = bam_args.single_env,
+                                      .compress_postings =
+                                          bam_args.compress_postings,
+                                      .backend =
+                                          bam_args.convert_to ==
+                                                  BAMDB_CONVERT_TO_TABLE
+                                              ? BAMDB_BACKEND_TABLE
+                                              : BAMDB_BACKEND_LMDB,
+                                      .hash_qname = bam_args.hash_qname,
+                                      .row_filter = bam_args.row_filter};
 
-    target_indices.key_indices[0] = calloc(1, 3);
-    /* Get key name from first non optional argument */
-    if (optind < argc) {
-      strncpy(target_indices.key_indices[0], argv[optind], 2);
+    for (size_t i = 0; i < num_keys; ++i) {
+      target_indices.key_indices[i] =
+          strdup(optind + i < (size_t)argc ? argv[optind + i] : "");
+      /* Only string tags hold barcodes */
+      target_indices.packed_key_indices[i] =
+          bam_args.pack_barcodes &&
+          bamdb_key_type(target_indices.key_indices[i]) == BAMDB_KEY_STRING;
     }
 
     return generate_index_file(bam_args.input_file_name,
@@ -85,29 +429,128 @@ int main(int argc, char *argv[]) {
     strcpy(bam_args.input_file_name, argv[optind]);
   }
 
-  if (bam_args.bx != NULL && bam_args.index_file_name != NULL) {
+  /* --min and --max select a range of the index instead of a single key */
+  bool range_query = bam_args.min_key != NULL || bam_args.max_key != NULL;
+  /* Several keys select the rows matching all of them, or any with --any */
+  bool multi_query = bam_args.num_keys > 1;
+  char *index_name = key_index_name(&bam_args, 0);
+  char *key = bam_args.num_keys > 0 ? bam_args.keys[0] : NULL;
+
+  /* --keys-from looks up every key of a file in the first index given */
+  bool batch_query = bam_args.key_file_name != NULL;
+  char **batch_keys = NULL;
+  size_t num_batch_keys = 0;
+
+  if (range_query && multi_query) {
+    fprintf(stderr, "Range queries cannot be combined with other keys\n");
+    return 1;
+  }
+  if (batch_query && (range_query || bam_args.num_keys > 0)) {
+    fprintf(stderr, "--keys-from cannot be combined with -b, --min or "
+                    "--max\n");
+    return 1;
+  }
+  if (batch_query && (batch_keys = read_key_file(bam_args.key_file_name,
+                                                 &num_batch_keys)) == NULL) {
+    return 1;
+  }
+
+  /* Pair every key with its index */
+  char **key_indices = malloc((bam_args.num_keys + 1) * sizeof(char *));
+  for (size_t i = 0; i < bam_args.num_keys; ++i) {
+    key_indices[i] = key_index_name(&bam_args, i);
+  }
+
+  if ((key != NULL || range_query || batch_query) &&
+      bam_args.index_file_name != NULL) {
+    /* Every lookup of the query shares the header and index handles */
+    bamdb_session_t *session = NULL;
+    rc = bamdb_session_open(&session, bam_args.input_file_name,
+                            bam_args.index_file_name);
+    if (rc != BAMDB_SUCCESS) {
+      fprintf(stderr, "Unable to open %s with the index %s\n",
+              bam_args.input_file_name, bam_args.index_file_name);
+      return rc;
+    }
+    /* -@ only sets the inflate threads of a build */
+    if (bam_args.num_fetch_threads > 0) {
+      bamdb_session_set_threads(session, bam_args.num_fetch_threads);
+    }
+
     if (bam_args.output_file_name != NULL) {
       /* Write resulting rows to file */
       offset_list_t *offset_list = calloc(1, sizeof(offset_list_t));
 
-      rc = get_offsets_lmdb(offset_list, bam_args.index_file_name, "BX",
-                            bam_args.bx);
-      rc = write_row_subset(bam_args.input_file_name, offset_list,
-                            bam_args.output_file_name);
+      if (range_query) {
+        rc = bamdb_session_get_offsets_range(offset_list, session, index_name,
+                                             bam_args.min_key,
+                                             bam_args.max_key);
+      } else if (batch_query) {
+        bamdb_key_offset_t *key_offsets = NULL;
+        size_t num_key_offsets = 0;
+
+        rc = bamdb_session_get_offsets_batch(&key_offsets, &num_key_offsets,
+                                             session, index_name,
+                                             num_batch_keys, batch_keys);
+        /* A bam file holds each row once, whichever keys it matched */
+        for (size_t j = 0; j < num_key_offsets; ++j) {
+          if (j == 0 || key_offsets[j].offset != key_offsets[j - 1].offset) {
+            append_offset(offset_list, key_offsets[j].offset);
+          }
+        }
+        free(key_offsets);
+      } else if (multi_query) {
+        rc = bamdb_session_get_offsets_multi(offset_list, session,
+                                             bam_args.num_keys, key_indices,
+                                             bam_args.keys, bam_args.combine);
+      } else {
+        rc = bamdb_session_get_offsets(offset_list, session, index_name, key);
+      }
+      /* A failed lookup leaves no file rather than part of the rows */
+      if (rc == BAMDB_SUCCESS) {
+        if (max_rows > 0) {
+          truncate_offset_list(offset_list, max_rows);
+        }
+        rc = write_row_subset(bam_args.input_file_name, offset_list,
+                              bam_args.output_file_name);
+      }
       free(offset_list);
     } else {
-      /* Print rows in tab delim format */
-      bam_row_set_t *row_set = NULL;
-      rc = get_bam_rows(&row_set, bam_args.input_file_name,
-                        bam_args.index_file_name, "BX", bam_args.bx);
-
-      if (row_set != NULL) {
-        for (size_t j = 0; j < row_set->num_entries; ++j) {
-          print_sequence_row(row_set->rows[j]);
+      /* Print rows in tab delim format as they are read */
+      bamdb_row_iter_t *iter = NULL;
+      bam_sequence_row_t *row = NULL;
+      if (range_query) {
+        rc = bamdb_session_iter_rows_range(&iter, session, index_name,
+                                           bam_args.min_key, bam_args.max_key);
+      } else if (batch_query) {
+        rc = bamdb_session_iter_rows_batch(&iter, session, index_name,
+                                           num_batch_keys, batch_keys);
+      } else if (multi_query) {
+        rc = bamdb_session_iter_rows_multi(&iter, session, bam_args.num_keys,
+                                           key_indices, bam_args.keys,
+                                           bam_args.combine);
+      } else {
+        rc = bamdb_session_iter_rows(&iter, session, index_name, key);
+      }
+
+      /* -n stops after the first max_rows rows */
+      for (int j = 0; iter != NULL && (max_rows <= 0 || j < max_rows); ++j) {
+        rc = bamdb_row_iter_next(iter, &row);
+        if (rc != BAMDB_SUCCESS || row == NULL) {
+          break;
         }
-        free_bamdb_row_set(row_set);
+        /* Batch rows start with the key they matched */
+        if (batch_query) {
+          printf("%s\t", batch_keys[bamdb_row_iter_key_id(iter)]);
+        }
+        print_sequence_row(row);
+        destroy_bam_sequence_row(row);
       }
+      bamdb_row_iter_close(iter);
     }
+    bamdb_session_close(session);
   }
+
+  return rc;
 }
 #endif
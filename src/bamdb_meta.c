@@ -0,0 +1,242 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "bamdb_meta.h"
+#include "bamdb_status.h"
+
+#define MAX_PATH_CHARS 2048
+#define META_VERSION 1
+/* Bytes hashed at each end of the fingerprinted range */
+#define FINGERPRINT_SPAN 65536
+#define MAX_INDEX_NAME 64
+#define MAX_FILTER_CHARS 4096
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/* FNV-1a over len bytes starting at offset */
+static int hash_range(FILE *fp, int64_t offset, int64_t len, uint64_t *hash) {
+  unsigned char buffer[8192];
+  uint64_t h = FNV_OFFSET_BASIS;
+  size_t n;
+
+  if (fseeko(fp, offset, SEEK_SET) != 0) {
+    return BAMDB_SEQUENCE_FILE_ERROR;
+  }
+
+  while (len > 0) {
+    n = fread(buffer, 1,
+              len < (int64_t)sizeof(buffer) ? (size_t)len : sizeof(buffer), fp);
+    if (n == 0) {
+      return BAMDB_SEQUENCE_FILE_ERROR;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      h = (h ^ buffer[i]) * FNV_PRIME;
+    }
+    len -= n;
+  }
+
+  *hash = h;
+  return BAMDB_SUCCESS;
+}
+
+int bamdb_fingerprint_file(const char *file_name, int64_t file_size,
+                           bamdb_fingerprint_t *fingerprint) {
+  struct stat st;
+  FILE *fp;
+  int64_t span;
+  int rc;
+
+  if (stat(file_name, &st) != 0) {
+    fprintf(stderr, "Unable to stat %s\n", file_name);
+    return BAMDB_SEQUENCE_FILE_ERROR;
+  }
+
+  if (file_size < 0) {
+    file_size = st.st_size;
+  } else if (file_size > st.st_size) {
+    /* The file has shrunk, it cannot be the one that was indexed */
+    memset(fingerprint, 0, sizeof(bamdb_fingerprint_t));
+    fingerprint->file_size = -1;
+    return BAMDB_SUCCESS;
+  }
+
+  if ((fp = fopen(file_name, "rb")) == NULL) {
+    fprintf(stderr, "Unable to open file %s\n", file_name);
+    return BAMDB_SEQUENCE_FILE_ERROR;
+  }
+
+  span = file_size < FINGERPRINT_SPAN ? file_size : FINGERPRINT_SPAN;
+  fingerprint->file_size = file_size;
+  rc = hash_range(fp, 0, span, &fingerprint->head_hash);
+  if (rc == BAMDB_SUCCESS) {
+    rc = hash_range(fp, file_size - span, span, &fingerprint->tail_hash);
+  }
+  if (rc != BAMDB_SUCCESS) {
+    fprintf(stderr, "Error reading %s\n", file_name);
+  }
+
+  fclose(fp);
+  return rc;
+}
+
+bool bamdb_fingerprint_equal(const bamdb_fingerprint_t *a,
+                             const bamdb_fingerprint_t *b) {
+  return a->file_size == b->file_size && a->head_hash == b->head_hash &&
+         a->tail_hash == b->tail_hash;
+}
+
+static int read_meta_file(const char *db_path, const char *file_name,
+                          bamdb_meta_t *meta) {
+  char path[MAX_PATH_CHARS];
+  char name[MAX_INDEX_NAME];
+  char filter[MAX_FILTER_CHARS];
+  int version;
+  size_t num_indices;
+  int ret = BAMDB_DB_ERROR;
+  FILE *fp;
+
+  memset(meta, 0, sizeof(bamdb_meta_t));
+  snprintf(path, MAX_PATH_CHARS, "%s/%s", db_path, file_name);
+  if ((fp = fopen(path, "r")) == NULL) {
+    return BAMDB_DB_ERROR;
+  }
+
+  if (fscanf(fp, "version %d\n", &version) != 1 || version != META_VERSION ||
+      fscanf(fp, "end_voffset %" SCNd64 "\n", &meta->end_voffset) != 1 ||
+      fscanf(fp, "num_rows %" SCNu64 "\n", &meta->num_rows) != 1 ||
+      fscanf(fp, "file_size %" SCNd64 "\n", &meta->fingerprint.file_size) !=
+          1 ||
+      fscanf(fp, "head_hash %" SCNx64 "\n", &meta->fingerprint.head_hash) !=
+          1 ||
+      fscanf(fp, "tail_hash %" SCNx64 "\n", &meta->fingerprint.tail_hash) !=
+          1 ||
+      fscanf(fp, "indices %zu", &num_indices) != 1) {
+    fprintf(stderr, "Unable to parse index metadata at %s\n", path);
+    goto exit;
+  }
+
+  meta->indices = calloc(num_indices, sizeof(char *));
+  for (size_t i = 0; i < num_indices; ++i) {
+    if (fscanf(fp, " %63s", name) != 1) {
+      fprintf(stderr, "Unable to parse index metadata at %s\n", path);
+      goto exit;
+    }
+    meta->indices[meta->num_indices++] = strdup(name);
+  }
+
+  /* Only builds that left rows out record their filter */
+  if (fscanf(fp, " filter %4095[^\n]", filter) == 1) {
+    meta->row_filter = strdup(filter);
+  }
+
+  ret = BAMDB_SUCCESS;
+
+exit:
+  fclose(fp);
+  if (ret != BAMDB_SUCCESS) {
+    bamdb_free_meta(meta);
+  }
+  return ret;
+}
+
+static int write_meta_file(const char *db_path, const char *file_name,
+                           const bamdb_meta_t *meta) {
+  char path[MAX_PATH_CHARS];
+  char tmp_path[MAX_PATH_CHARS];
+  FILE *fp;
+  int rc;
+
+  snprintf(path, MAX_PATH_CHARS, "%s/%s", db_path, file_name);
+  snprintf(tmp_path, MAX_PATH_CHARS, "%s.tmp", path);
+  if ((fp = fopen(tmp_path, "w")) == NULL) {
+    fprintf(stderr, "Unable to write index metadata to %s\n", tmp_path);
+    return BAMDB_DB_ERROR;
+  }
+
+  fprintf(fp, "version %d\n", META_VERSION);
+  fprintf(fp, "end_voffset %" PRId64 "\n", meta->end_voffset);
+  fprintf(fp, "num_rows %" PRIu64 "\n", meta->num_rows);
+  fprintf(fp, "file_size %" PRId64 "\n", meta->fingerprint.file_size);
+  fprintf(fp, "head_hash %" PRIx64 "\n", meta->fingerprint.head_hash);
+  fprintf(fp, "tail_hash %" PRIx64 "\n", meta->fingerprint.tail_hash);
+  fprintf(fp, "indices %zu", meta->num_indices);
+  for (size_t i = 0; i < meta->num_indices; ++i) {
+    fprintf(fp, " %s", meta->indices[i]);
+  }
+  fprintf(fp, "\n");
+  if (meta->row_filter != NULL) {
+    fprintf(fp, "filter %s\n", meta->row_filter);
+  }
+
+  rc = ferror(fp);
+  if (fclose(fp) != 0 || rc != 0 || rename(tmp_path, path) != 0) {
+    fprintf(stderr, "Unable to write index metadata to %s\n", path);
+    remove(tmp_path);
+    return BAMDB_DB_ERROR;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+static void remove_meta_file(const char *db_path, const char *file_name) {
+  char path[MAX_PATH_CHARS];
+
+  snprintf(path, MAX_PATH_CHARS, "%s/%s", db_path, file_name);
+  remove(path);
+}
+
+int bamdb_read_meta(const char *db_path, bamdb_meta_t *meta) {
+  int rc = read_meta_file(db_path, BAMDB_META_FILE, meta);
+
+  if (rc != BAMDB_SUCCESS) {
+    fprintf(stderr, "No usable index metadata found in %s\n", db_path);
+  }
+  return rc;
+}
+
+int bamdb_write_meta(const char *db_path, const bamdb_meta_t *meta) {
+  return write_meta_file(db_path, BAMDB_META_FILE, meta);
+}
+
+void bamdb_remove_meta(const char *db_path) {
+  remove_meta_file(db_path, BAMDB_META_FILE);
+}
+
+int bamdb_read_checkpoint(const char *db_path, bamdb_meta_t *checkpoint) {
+  return read_meta_file(db_path, BAMDB_CHECKPOINT_FILE, checkpoint);
+}
+
+int bamdb_write_checkpoint(const char *db_path,
+                           const bamdb_meta_t *checkpoint) {
+  return write_meta_file(db_path, BAMDB_CHECKPOINT_FILE, checkpoint);
+}
+
+void bamdb_remove_checkpoint(const char *db_path) {
+  remove_meta_file(db_path, BAMDB_CHECKPOINT_FILE);
+}
+
+bool bamdb_meta_has_index(const bamdb_meta_t *meta, const char *index_name) {
+  for (size_t i = 0; i < meta->num_indices; ++i) {
+    if (strcmp(meta->indices[i], index_name) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void bamdb_free_meta(bamdb_meta_t *meta) {
+  for (size_t i = 0; i < meta->num_indices; ++i) {
+    free(meta->indices[i]);
+  }
+  free(meta->indices);
+  free(meta->row_filter);
+  meta->indices = NULL;
+  meta->num_indices = 0;
+  meta->row_filter = NULL;
+}
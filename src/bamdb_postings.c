@@ -0,0 +1,102 @@
+#include "bamdb_postings.h"
+#include "bamdb_key.h"
+
+size_t bamdb_encode_varint(uint64_t value, unsigned char *out) {
+  size_t n = 0;
+
+  while (value >= 0x80) {
+    out[n++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  out[n++] = (unsigned char)value;
+
+  return n;
+}
+
+size_t bamdb_decode_varint(const unsigned char *in, const unsigned char *end,
+                           uint64_t *value) {
+  size_t n = 0;
+  int shift = 0;
+
+  *value = 0;
+  while (in + n < end && (in[n] & 0x80) && shift < 63) {
+    *value |= (uint64_t)(in[n++] & 0x7f) << shift;
+    shift += 7;
+  }
+  if (in + n == end) {
+    return 0;
+  }
+  *value |= (uint64_t)in[n++] << shift;
+
+  return n;
+}
+
+size_t bamdb_encode_postings(const int64_t *offsets, size_t num_offsets,
+                             void *chunk, size_t *chunk_size) {
+  unsigned char *out = chunk;
+  unsigned char varint[BAMDB_MAX_VARINT_SIZE];
+  size_t size = sizeof(uint64_t);
+  size_t varint_size;
+  size_t i;
+
+  bamdb_store_be64((uint64_t)offsets[0], out);
+  for (i = 1; i < num_offsets; ++i) {
+    varint_size =
+        bamdb_encode_varint((uint64_t)(offsets[i] - offsets[i - 1]), varint);
+    if (size + varint_size > BAMDB_MAX_POSTING_CHUNK_SIZE) {
+      break;
+    }
+    for (size_t j = 0; j < varint_size; ++j) {
+      out[size++] = varint[j];
+    }
+  }
+
+  *chunk_size = size;
+  return i;
+}
+
+size_t bamdb_decode_postings(const void *chunk, size_t chunk_size,
+                             int64_t *offsets) {
+  const unsigned char *in = chunk;
+  const unsigned char *end = in + chunk_size;
+  uint64_t offset, delta;
+  size_t n = 0;
+  size_t varint_size;
+
+  if (chunk_size < sizeof(uint64_t) ||
+      chunk_size > BAMDB_MAX_POSTING_CHUNK_SIZE) {
+    return 0;
+  }
+
+  offset = bamdb_load_be64(in);
+  in += sizeof(uint64_t);
+  offsets[n++] = (int64_t)offset;
+
+  while (in < end) {
+    if ((varint_size = bamdb_decode_varint(in, end, &delta)) == 0) {
+      return 0;
+    }
+    in += varint_size;
+
+    offset += delta;
+    offsets[n++] = (int64_t)offset;
+  }
+
+  return n;
+}
+
+size_t bamdb_count_postings(const void *chunk, size_t chunk_size) {
+  const unsigned char *in = chunk;
+  size_t n = 1;
+
+  if (chunk_size < sizeof(uint64_t)) {
+    return 0;
+  }
+
+  /* Every varint ends with the one byte that has its top bit clear */
+  for (size_t i = sizeof(uint64_t); i < chunk_size; ++i) {
+    n += !(in[i] & 0x80);
+  }
+
+  return n;
+}
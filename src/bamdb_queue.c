@@ -0,0 +1,159 @@
+#ifdef BUILD_BAMDB_WRITER
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bamdb_queue.h"
+#include "bamdb_status.h"
+
+struct bamdb_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+
+  void **items;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  bool closed;
+
+  /* Only signal when somebody is actually waiting */
+  size_t waiting_producers;
+  size_t waiting_consumers;
+
+  uint64_t push_wait_ns;
+  uint64_t pop_wait_ns;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bamdb_queue_t *bamdb_queue_init(size_t capacity) {
+  bamdb_queue_t *queue = calloc(1, sizeof(bamdb_queue_t));
+
+  queue->capacity = capacity > 0 ? capacity : 1;
+  queue->items = malloc(queue->capacity * sizeof(void *));
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+
+  return queue;
+}
+
+int bamdb_queue_push(bamdb_queue_t *queue, void *item) {
+  pthread_mutex_lock(&queue->lock);
+
+  if (queue->count == queue->capacity && !queue->closed) {
+    uint64_t start = now_ns();
+
+    queue->waiting_producers++;
+    while (queue->count == queue->capacity && !queue->closed) {
+      pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->waiting_producers--;
+    queue->push_wait_ns += now_ns() - start;
+  }
+
+  if (queue->closed) {
+    pthread_mutex_unlock(&queue->lock);
+    return BAMDB_INTERNAL_ERROR;
+  }
+
+  queue->items[(queue->head + queue->count) % queue->capacity] = item;
+  queue->count++;
+
+  if (queue->waiting_consumers > 0) {
+    pthread_cond_signal(&queue->not_empty);
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return BAMDB_SUCCESS;
+}
+
+bool bamdb_queue_pop(bamdb_queue_t *queue, void **item) {
+  pthread_mutex_lock(&queue->lock);
+
+  if (queue->count == 0 && !queue->closed) {
+    uint64_t start = now_ns();
+
+    queue->waiting_consumers++;
+    while (queue->count == 0 && !queue->closed) {
+      pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    queue->waiting_consumers--;
+    queue->pop_wait_ns += now_ns() - start;
+  }
+
+  /* Closed queues are still drained before reporting the end */
+  if (queue->count == 0) {
+    pthread_mutex_unlock(&queue->lock);
+    return false;
+  }
+
+  *item = queue->items[queue->head];
+  queue->head = (queue->head + 1) % queue->capacity;
+  queue->count--;
+
+  if (queue->waiting_producers > 0) {
+    pthread_cond_signal(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return true;
+}
+
+void bamdb_queue_close(bamdb_queue_t *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = true;
+  pthread_cond_broadcast(&queue->not_empty);
+  pthread_cond_broadcast(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+size_t bamdb_queue_size(bamdb_queue_t *queue) {
+  size_t count;
+
+  pthread_mutex_lock(&queue->lock);
+  count = queue->count;
+  pthread_mutex_unlock(&queue->lock);
+
+  return count;
+}
+
+uint64_t bamdb_queue_push_wait_ns(bamdb_queue_t *queue) {
+  uint64_t wait;
+
+  pthread_mutex_lock(&queue->lock);
+  wait = queue->push_wait_ns;
+  pthread_mutex_unlock(&queue->lock);
+
+  return wait;
+}
+
+uint64_t bamdb_queue_pop_wait_ns(bamdb_queue_t *queue) {
+  uint64_t wait;
+
+  pthread_mutex_lock(&queue->lock);
+  wait = queue->pop_wait_ns;
+  pthread_mutex_unlock(&queue->lock);
+
+  return wait;
+}
+
+void bamdb_queue_destroy(bamdb_queue_t *queue) {
+  if (queue == NULL) {
+    return;
+  }
+
+  pthread_cond_destroy(&queue->not_full);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_mutex_destroy(&queue->lock);
+  free(queue->items);
+  free(queue);
+}
+
+#endif
@@ -0,0 +1,547 @@
+#ifdef BUILD_BAMDB_WRITER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bamdb_sort.h"
+#include "bamdb_status.h"
+
+#define MAX_PATH_CHARS 2048
+/* stdio buffer used for each run file */
+#define RUN_IO_BUFFER_SIZE (1024 * 1024)
+/* Most runs read at once. Every open run holds a file and its stdio buffer,
+ * so more runs are first merged into fewer, longer ones. */
+#define MAX_MERGE_RUNS 64
+
+/* In-memory and on-disk layout of a single pair. The key bytes directly
+ * follow the header. */
+typedef struct sort_rec {
+  int64_t voffset;
+  uint32_t key_size;
+} sort_rec_t;
+
+#define sort_rec_key(r) ((char *)(r) + sizeof(sort_rec_t))
+/* Keep records 8 byte aligned inside the arena */
+#define sort_rec_span(n) ((sizeof(sort_rec_t) + (n) + 7) & ~(size_t)7)
+
+/* A run stays on disk between merges and is only open while it is written or
+ * read */
+typedef struct sort_run {
+  char *path;
+  FILE *fp;
+  char *io_buffer;
+  sort_rec_t *rec;
+  size_t rec_capacity;
+} sort_run_t;
+
+struct bamdb_sorter {
+  char *tmp_dir;
+  char *name;
+
+  /* Current in-memory run */
+  char *arena;
+  size_t arena_size;
+  size_t arena_used;
+  sort_rec_t **recs;
+  size_t max_recs;
+  size_t num_recs;
+
+  /* Runs already spilled to disk */
+  sort_run_t *runs;
+  size_t num_runs;
+  /* Gives every run file of the sorter its own name */
+  size_t next_run_id;
+};
+
+static int compare_recs(const sort_rec_t *a, const sort_rec_t *b) {
+  /* Mirror LMDB's default key comparison: bytewise over the common prefix,
+   * then the shorter key first */
+  size_t len = a->key_size < b->key_size ? a->key_size : b->key_size;
+  int diff = memcmp(sort_rec_key(a), sort_rec_key(b), len);
+  if (diff != 0) {
+    return diff;
+  }
+
+  if (a->key_size != b->key_size) {
+    return a->key_size < b->key_size ? -1 : 1;
+  }
+
+  /* Fixed size duplicates are also compared bytewise */
+  return memcmp(&a->voffset, &b->voffset, sizeof(int64_t));
+}
+
+static int qsort_recs(const void *a, const void *b) {
+  return compare_recs(*(sort_rec_t *const *)a, *(sort_rec_t *const *)b);
+}
+
+bamdb_sorter_t *bamdb_sorter_init(const char *tmp_dir, const char *name,
+                                  size_t max_memory) {
+  bamdb_sorter_t *sorter = calloc(1, sizeof(bamdb_sorter_t));
+
+  if (max_memory == 0) {
+    max_memory = BAMDB_DEFAULT_SORT_BUFFER_SIZE;
+  }
+
+  /* Three quarters of the budget hold the pairs, the rest holds the
+   * pointers we sort */
+  sorter->arena_size = max_memory / 4 * 3;
+  sorter->max_recs = (max_memory / 4) / sizeof(sort_rec_t *);
+  sorter->arena = malloc(sorter->arena_size);
+  sorter->recs = malloc(sorter->max_recs * sizeof(sort_rec_t *));
+  sorter->tmp_dir = strdup(tmp_dir);
+  sorter->name = strdup(name);
+
+  if (sorter->arena == NULL || sorter->recs == NULL) {
+    fprintf(stderr, "Unable to allocate %zu bytes of sort buffer\n",
+            max_memory);
+    bamdb_sorter_destroy(sorter);
+    return NULL;
+  }
+
+  return sorter;
+}
+
+/* Open the file of a run with its own stdio buffer */
+static int open_run(sort_run_t *run, const char *mode) {
+  run->fp = fopen(run->path, mode);
+  if (run->fp == NULL) {
+    fprintf(stderr, "Unable to open sort run %s\n", run->path);
+    return BAMDB_INTERNAL_ERROR;
+  }
+  run->io_buffer = malloc(RUN_IO_BUFFER_SIZE);
+  setvbuf(run->fp, run->io_buffer, _IOFBF, RUN_IO_BUFFER_SIZE);
+
+  return BAMDB_SUCCESS;
+}
+
+/* Name a new run of sorter and open it for writing */
+static int create_run(bamdb_sorter_t *sorter, sort_run_t *run) {
+  char run_path[MAX_PATH_CHARS];
+
+  memset(run, 0, sizeof(sort_run_t));
+  snprintf(run_path, MAX_PATH_CHARS, "%s/%s.%zu.run", sorter->tmp_dir,
+           sorter->name, sorter->next_run_id++);
+  run->path = strdup(run_path);
+
+  return open_run(run, "wb");
+}
+
+/* Close a run and free its buffers. Fails if buffered writes could not be
+ * flushed. */
+static int close_run(sort_run_t *run) {
+  int rc = 0;
+
+  if (run->fp != NULL) {
+    rc = fclose(run->fp);
+    run->fp = NULL;
+  }
+  free(run->io_buffer);
+  run->io_buffer = NULL;
+  free(run->rec);
+  run->rec = NULL;
+  run->rec_capacity = 0;
+
+  return rc == 0 ? BAMDB_SUCCESS : BAMDB_INTERNAL_ERROR;
+}
+
+static void remove_run(sort_run_t *run) {
+  close_run(run);
+  if (run->path != NULL) {
+    remove(run->path);
+    free(run->path);
+    run->path = NULL;
+  }
+}
+
+static int write_run_rec(sort_run_t *run, const sort_rec_t *header,
+                         const void *key) {
+  if (fwrite(header, sizeof(sort_rec_t), 1, run->fp) != 1 ||
+      (header->key_size > 0 &&
+       fwrite(key, header->key_size, 1, run->fp) != 1)) {
+    fprintf(stderr, "Error writing sort run %s\n", run->path);
+    return BAMDB_INTERNAL_ERROR;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+static int spill_run(bamdb_sorter_t *sorter) {
+  sort_run_t *run;
+  int rc;
+
+  qsort(sorter->recs, sorter->num_recs, sizeof(sort_rec_t *), qsort_recs);
+
+  sorter->runs =
+      realloc(sorter->runs, (sorter->num_runs + 1) * sizeof(sort_run_t));
+  run = &sorter->runs[sorter->num_runs];
+  rc = create_run(sorter, run);
+  /* Counted even if it failed so the file is removed with the sorter */
+  sorter->num_runs++;
+  if (rc != BAMDB_SUCCESS) {
+    return rc;
+  }
+
+  for (size_t i = 0; i < sorter->num_recs && rc == BAMDB_SUCCESS; ++i) {
+    sort_rec_t *rec = sorter->recs[i];
+    rc = write_run_rec(run, rec, sort_rec_key(rec));
+  }
+
+  /* Closed until it is merged, so spilled runs hold no file or buffer */
+  if (close_run(run) != BAMDB_SUCCESS && rc == BAMDB_SUCCESS) {
+    fprintf(stderr, "Error writing sort run %s\n", run->path);
+    rc = BAMDB_INTERNAL_ERROR;
+  }
+  if (rc != BAMDB_SUCCESS) {
+    return rc;
+  }
+
+  sorter->arena_used = 0;
+  sorter->num_recs = 0;
+
+  return BAMDB_SUCCESS;
+}
+
+int bamdb_sorter_add(bamdb_sorter_t *sorter, const void *key, size_t key_size,
+                     int64_t voffset) {
+  size_t span = sort_rec_span(key_size);
+  sort_rec_t *rec;
+  int rc;
+
+  if (span > sorter->arena_size) {
+    fprintf(stderr, "Key of %zu bytes does not fit in the sort buffer\n",
+            key_size);
+    return BAMDB_INTERNAL_ERROR;
+  }
+
+  if (sorter->arena_used + span > sorter->arena_size ||
+      sorter->num_recs == sorter->max_recs) {
+    rc = spill_run(sorter);
+    if (rc != BAMDB_SUCCESS) {
+      return rc;
+    }
+  }
+
+  rec = (sort_rec_t *)(sorter->arena + sorter->arena_used);
+  rec->voffset = voffset;
+  rec->key_size = key_size;
+  memcpy(sort_rec_key(rec), key, key_size);
+
+  sorter->arena_used += span;
+  sorter->recs[sorter->num_recs++] = rec;
+
+  return BAMDB_SUCCESS;
+}
+
+/* Read the next record of a run into run->rec. Returns 1 if a record was
+ * read, 0 at the end of the run and a negative value on error. */
+static int read_run_rec(sort_run_t *run) {
+  sort_rec_t header;
+
+  if (fread(&header, sizeof(sort_rec_t), 1, run->fp) != 1) {
+    return feof(run->fp) ? 0 : -1;
+  }
+
+  if (run->rec_capacity < sizeof(sort_rec_t) + header.key_size) {
+    run->rec_capacity = sizeof(sort_rec_t) + header.key_size;
+    run->rec = realloc(run->rec, run->rec_capacity);
+  }
+
+  *run->rec = header;
+  if (header.key_size > 0 &&
+      fread(sort_rec_key(run->rec), header.key_size, 1, run->fp) != 1) {
+    return -1;
+  }
+
+  return 1;
+}
+
+/* A source is either a spilled run or the in-memory run of a sorter */
+typedef struct merge_source {
+  bamdb_sorter_t *sorter;
+  sort_run_t *run;
+  size_t mem_pos;
+} merge_source_t;
+
+/* Min-heap over the current record of every source */
+typedef struct merge_state {
+  merge_source_t *sources;
+  size_t *heap;
+  size_t heap_size;
+} merge_state_t;
+
+static sort_rec_t *source_rec(merge_state_t *state, size_t i) {
+  merge_source_t *source = &state->sources[i];
+
+  if (source->run == NULL) {
+    return source->sorter->recs[source->mem_pos];
+  }
+  return source->run->rec;
+}
+
+/* Advance a source; returns 1 if it still has records */
+static int advance_source(merge_state_t *state, size_t i) {
+  merge_source_t *source = &state->sources[i];
+
+  if (source->run == NULL) {
+    source->mem_pos++;
+    return source->mem_pos < source->sorter->num_recs;
+  }
+  return read_run_rec(source->run);
+}
+
+static void sift_down(merge_state_t *state, size_t i) {
+  size_t *heap = state->heap;
+
+  for (;;) {
+    size_t smallest = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+
+    if (left < state->heap_size &&
+        compare_recs(source_rec(state, heap[left]),
+                     source_rec(state, heap[smallest])) < 0) {
+      smallest = left;
+    }
+    if (right < state->heap_size &&
+        compare_recs(source_rec(state, heap[right]),
+                     source_rec(state, heap[smallest])) < 0) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+
+    size_t tmp = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+/* Merge the sources, calling cb for every distinct pair in order. Runs are
+ * only open during the merge. */
+static int merge_sources(merge_source_t *sources, size_t num_sources,
+                         bamdb_sorter_cb cb, void *arg) {
+  merge_state_t state = {.sources = sources, .heap_size = 0};
+  sort_rec_t *last = NULL;
+  size_t last_capacity = 0;
+  int ret = BAMDB_SUCCESS;
+  int rc;
+
+  state.heap = malloc(num_sources * sizeof(size_t));
+
+  for (size_t i = 0; i < num_sources; ++i) {
+    merge_source_t *source = &sources[i];
+
+    if (source->run == NULL) {
+      source->mem_pos = 0;
+      if (source->sorter->num_recs > 0) {
+        state.heap[state.heap_size++] = i;
+      }
+      continue;
+    }
+
+    rc = open_run(source->run, "rb");
+    if (rc == BAMDB_SUCCESS) {
+      rc = read_run_rec(source->run);
+    }
+    if (rc < 0) {
+      fprintf(stderr, "Error reading sort run %s\n", source->run->path);
+      ret = BAMDB_INTERNAL_ERROR;
+      goto exit;
+    } else if (rc > 0) {
+      state.heap[state.heap_size++] = i;
+    }
+  }
+
+  for (size_t i = state.heap_size; i-- > 0;) {
+    sift_down(&state, i);
+  }
+
+  while (state.heap_size > 0) {
+    size_t source = state.heap[0];
+    sort_rec_t *rec = source_rec(&state, source);
+    bool new_key = true;
+
+    if (last != NULL) {
+      new_key = last->key_size != rec->key_size ||
+                memcmp(sort_rec_key(last), sort_rec_key(rec),
+                       rec->key_size) != 0;
+    }
+
+    /* A row only ever produces one pair per key, so an exact repeat can
+     * only come from duplicated input and is dropped */
+    if (new_key || last->voffset != rec->voffset) {
+      rc = cb(sort_rec_key(rec), rec->key_size, rec->voffset, new_key, arg);
+      if (rc != 0) {
+        ret = rc;
+        goto exit;
+      }
+
+      if (last_capacity < sizeof(sort_rec_t) + rec->key_size) {
+        last_capacity = sizeof(sort_rec_t) + rec->key_size;
+        last = realloc(last, last_capacity);
+      }
+      memcpy(last, rec, sizeof(sort_rec_t) + rec->key_size);
+    }
+
+    rc = advance_source(&state, source);
+    if (rc < 0) {
+      fprintf(stderr, "Error reading sort run %s\n",
+              state.sources[source].run->path);
+      ret = BAMDB_INTERNAL_ERROR;
+      goto exit;
+    } else if (rc == 0) {
+      state.heap[0] = state.heap[--state.heap_size];
+    }
+    sift_down(&state, 0);
+  }
+
+exit:
+  for (size_t i = 0; i < num_sources; ++i) {
+    if (sources[i].run != NULL) {
+      close_run(sources[i].run);
+    }
+  }
+  free(last);
+  free(state.heap);
+  return ret;
+}
+
+static int write_merged_pair(const void *key, size_t key_size,
+                             int64_t voffset, bool new_key, void *arg) {
+  sort_rec_t header;
+
+  (void)new_key;
+  memset(&header, 0, sizeof(sort_rec_t));
+  header.voffset = voffset;
+  header.key_size = key_size;
+
+  return write_run_rec((sort_run_t *)arg, &header, key);
+}
+
+/* Merge the spilled runs of all sorters MAX_MERGE_RUNS at a time into longer
+ * runs of the first sorter, until a single pass can read all that are left.
+ * The sorters still hold the same pairs between them. */
+static int reduce_runs(bamdb_sorter_t **sorters, size_t num_sorters) {
+  bamdb_sorter_t *dest = sorters[0];
+  merge_source_t sources[MAX_MERGE_RUNS];
+  sort_run_t merged;
+  size_t num_runs = 0;
+  int rc;
+
+  for (size_t i = 0; i < num_sorters; ++i) {
+    num_runs += sorters[i]->num_runs;
+  }
+  if (num_runs <= MAX_MERGE_RUNS) {
+    return BAMDB_SUCCESS;
+  }
+
+  dest->runs = realloc(dest->runs, num_runs * sizeof(sort_run_t));
+  for (size_t i = 1; i < num_sorters; ++i) {
+    memcpy(&dest->runs[dest->num_runs], sorters[i]->runs,
+           sorters[i]->num_runs * sizeof(sort_run_t));
+    dest->num_runs += sorters[i]->num_runs;
+    free(sorters[i]->runs);
+    sorters[i]->runs = NULL;
+    sorters[i]->num_runs = 0;
+  }
+
+  printf("Merging %zu sorted runs of %s in several passes\n", num_runs,
+         dest->name);
+  /* The oldest runs are merged first and the result queued behind the
+   * others, so every pair is rewritten about as often as any other */
+  while (dest->num_runs > MAX_MERGE_RUNS) {
+    for (size_t i = 0; i < MAX_MERGE_RUNS; ++i) {
+      sources[i].sorter = dest;
+      sources[i].run = &dest->runs[i];
+    }
+
+    rc = create_run(dest, &merged);
+    if (rc == BAMDB_SUCCESS) {
+      rc = merge_sources(sources, MAX_MERGE_RUNS, write_merged_pair, &merged);
+    }
+    if (close_run(&merged) != BAMDB_SUCCESS && rc == BAMDB_SUCCESS) {
+      fprintf(stderr, "Error writing sort run %s\n", merged.path);
+      rc = BAMDB_INTERNAL_ERROR;
+    }
+    if (rc != BAMDB_SUCCESS) {
+      remove_run(&merged);
+      return rc;
+    }
+
+    for (size_t i = 0; i < MAX_MERGE_RUNS; ++i) {
+      remove_run(&dest->runs[i]);
+    }
+    memmove(dest->runs, dest->runs + MAX_MERGE_RUNS,
+            (dest->num_runs - MAX_MERGE_RUNS) * sizeof(sort_run_t));
+    dest->num_runs -= MAX_MERGE_RUNS;
+    dest->runs[dest->num_runs++] = merged;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+int bamdb_sorter_merge(bamdb_sorter_t *sorter, bamdb_sorter_cb cb, void *arg) {
+  return bamdb_sorter_merge_many(&sorter, 1, cb, arg);
+}
+
+int bamdb_sorter_merge_many(bamdb_sorter_t **sorters, size_t num_sorters,
+                            bamdb_sorter_cb cb, void *arg) {
+  merge_source_t *sources;
+  size_t num_sources = 0;
+  int ret;
+
+  ret = reduce_runs(sorters, num_sorters);
+  if (ret != BAMDB_SUCCESS) {
+    return ret;
+  }
+
+  for (size_t i = 0; i < num_sorters; ++i) {
+    num_sources += sorters[i]->num_runs + 1;
+  }
+  sources = calloc(num_sources, sizeof(merge_source_t));
+
+  num_sources = 0;
+  for (size_t i = 0; i < num_sorters; ++i) {
+    bamdb_sorter_t *sorter = sorters[i];
+
+    for (size_t j = 0; j < sorter->num_runs; ++j) {
+      sources[num_sources].sorter = sorter;
+      sources[num_sources++].run = &sorter->runs[j];
+    }
+
+    /* The final run never has to touch the disk */
+    qsort(sorter->recs, sorter->num_recs, sizeof(sort_rec_t *), qsort_recs);
+    sources[num_sources++].sorter = sorter;
+  }
+
+  ret = merge_sources(sources, num_sources, cb, arg);
+  free(sources);
+  return ret;
+}
+
+size_t bamdb_sorter_num_runs(const bamdb_sorter_t *sorter) {
+  return sorter->num_runs;
+}
+
+void bamdb_sorter_destroy(bamdb_sorter_t *sorter) {
+  if (sorter == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < sorter->num_runs; ++i) {
+    remove_run(&sorter->runs[i]);
+  }
+
+  free(sorter->runs);
+  free(sorter->recs);
+  free(sorter->arena);
+  free(sorter->tmp_dir);
+  free(sorter->name);
+  free(sorter);
+}
+
+#endif
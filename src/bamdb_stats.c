@@ -0,0 +1,184 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bamdb_stats.h"
+#include "bamdb_status.h"
+
+#define MAX_PATH_CHARS 2048
+#define STATS_VERSION 1
+/* Longest key read back from a statistics file */
+#define MAX_KEY_CHARS 1024
+
+static void stats_path(char *path, const char *db_path,
+                       const char *index_name) {
+  snprintf(path, MAX_PATH_CHARS, "%s/%s%s", db_path, index_name,
+           BAMDB_STATS_SUFFIX);
+}
+
+bool bamdb_stats_is_top(const bamdb_index_stats_t *stats, uint64_t num_rows) {
+  return stats->num_top_keys < BAMDB_STATS_TOP_KEYS ||
+         num_rows > stats->top_keys[BAMDB_STATS_TOP_KEYS - 1].num_rows;
+}
+
+void bamdb_stats_add_key(bamdb_index_stats_t *stats, const char *key,
+                         uint64_t num_rows) {
+  size_t bin = 0;
+  size_t i;
+
+  stats->num_keys++;
+  stats->num_rows += num_rows;
+  while (bin + 1 < BAMDB_STATS_HISTOGRAM_BINS && num_rows >> (bin + 1) > 0) {
+    ++bin;
+  }
+  stats->histogram[bin]++;
+
+  if (key == NULL || !bamdb_stats_is_top(stats, num_rows)) {
+    return;
+  }
+
+  /* Insertion into the short sorted list, dropping its last key when full */
+  if (stats->num_top_keys == BAMDB_STATS_TOP_KEYS) {
+    free(stats->top_keys[--stats->num_top_keys].key);
+  }
+  for (i = stats->num_top_keys;
+       i > 0 && stats->top_keys[i - 1].num_rows < num_rows; --i) {
+    stats->top_keys[i] = stats->top_keys[i - 1];
+  }
+  stats->top_keys[i].key = strdup(key);
+  stats->top_keys[i].num_rows = num_rows;
+  stats->num_top_keys++;
+}
+
+int bamdb_read_stats(const char *db_path, const char *index_name,
+                     bamdb_index_stats_t *stats) {
+  char path[MAX_PATH_CHARS];
+  char key[MAX_KEY_CHARS];
+  int version;
+  size_t num_bins, num_top_keys;
+  uint64_t num_rows;
+  int ret = BAMDB_DB_ERROR;
+  FILE *fp;
+
+  memset(stats, 0, sizeof(bamdb_index_stats_t));
+  stats_path(path, db_path, index_name);
+  if ((fp = fopen(path, "r")) == NULL) {
+    return BAMDB_DB_ERROR;
+  }
+
+  if (fscanf(fp, "version %d\n", &version) != 1 ||
+      version != STATS_VERSION ||
+      fscanf(fp, "num_keys %" SCNu64 "\n", &stats->num_keys) != 1 ||
+      fscanf(fp, "num_rows %" SCNu64 "\n", &stats->num_rows) != 1 ||
+      fscanf(fp, "histogram %zu", &num_bins) != 1 ||
+      num_bins > BAMDB_STATS_HISTOGRAM_BINS) {
+    goto exit;
+  }
+  for (size_t i = 0; i < num_bins; ++i) {
+    if (fscanf(fp, " %" SCNu64, &stats->histogram[i]) != 1) {
+      goto exit;
+    }
+  }
+
+  if (fscanf(fp, " top_keys %zu\n", &num_top_keys) != 1 ||
+      num_top_keys > BAMDB_STATS_TOP_KEYS) {
+    goto exit;
+  }
+  /* Keys take the rest of their line and may hold spaces */
+  for (size_t i = 0; i < num_top_keys; ++i) {
+    if (fscanf(fp, "%" SCNu64 " ", &num_rows) != 1 ||
+        fgets(key, MAX_KEY_CHARS, fp) == NULL) {
+      goto exit;
+    }
+    key[strcspn(key, "\n")] = '\0';
+    stats->top_keys[i].key = strdup(key);
+    stats->top_keys[i].num_rows = num_rows;
+    stats->num_top_keys++;
+  }
+
+  ret = BAMDB_SUCCESS;
+
+exit:
+  fclose(fp);
+  if (ret != BAMDB_SUCCESS) {
+    fprintf(stderr, "Unable to parse index statistics at %s\n", path);
+    bamdb_free_stats(stats);
+  }
+  return ret;
+}
+
+int bamdb_write_stats(const char *db_path, const char *index_name,
+                      const bamdb_index_stats_t *stats) {
+  char path[MAX_PATH_CHARS];
+  char tmp_path[MAX_PATH_CHARS];
+  FILE *fp;
+  int rc;
+
+  stats_path(path, db_path, index_name);
+  snprintf(tmp_path, MAX_PATH_CHARS, "%s.tmp", path);
+  if ((fp = fopen(tmp_path, "w")) == NULL) {
+    fprintf(stderr, "Unable to write index statistics to %s\n", tmp_path);
+    return BAMDB_DB_ERROR;
+  }
+
+  fprintf(fp, "version %d\n", STATS_VERSION);
+  fprintf(fp, "num_keys %" PRIu64 "\n", stats->num_keys);
+  fprintf(fp, "num_rows %" PRIu64 "\n", stats->num_rows);
+  fprintf(fp, "histogram %d", BAMDB_STATS_HISTOGRAM_BINS);
+  for (size_t i = 0; i < BAMDB_STATS_HISTOGRAM_BINS; ++i) {
+    fprintf(fp, " %" PRIu64, stats->histogram[i]);
+  }
+  fprintf(fp, "\ntop_keys %zu\n", stats->num_top_keys);
+  for (size_t i = 0; i < stats->num_top_keys; ++i) {
+    fprintf(fp, "%" PRIu64 " %s\n", stats->top_keys[i].num_rows,
+            stats->top_keys[i].key);
+  }
+
+  rc = ferror(fp);
+  if (fclose(fp) != 0 || rc != 0 || rename(tmp_path, path) != 0) {
+    fprintf(stderr, "Unable to write index statistics to %s\n", path);
+    remove(tmp_path);
+    return BAMDB_DB_ERROR;
+  }
+
+  return BAMDB_SUCCESS;
+}
+
+void bamdb_remove_stats(const char *db_path, const char *index_name) {
+  char path[MAX_PATH_CHARS];
+
+  stats_path(path, db_path, index_name);
+  remove(path);
+}
+
+void bamdb_print_stats(FILE *fp, const char *index_name,
+                       const bamdb_index_stats_t *stats) {
+  fprintf(fp, "%s\n", index_name);
+  fprintf(fp, "  keys: %" PRIu64 "\n", stats->num_keys);
+  fprintf(fp, "  rows: %" PRIu64 "\n", stats->num_rows);
+  if (stats->num_keys > 0) {
+    fprintf(fp, "  mean rows per key: %.2f\n",
+            (double)stats->num_rows / stats->num_keys);
+  }
+
+  fprintf(fp, "  rows per key:\n");
+  for (size_t i = 0; i < BAMDB_STATS_HISTOGRAM_BINS; ++i) {
+    if (stats->histogram[i] > 0) {
+      fprintf(fp, "    %" PRIu64 "-%" PRIu64 ": %" PRIu64 " keys\n",
+              (uint64_t)1 << i, ((uint64_t)2 << i) - 1, stats->histogram[i]);
+    }
+  }
+
+  fprintf(fp, "  most frequent keys:\n");
+  for (size_t i = 0; i < stats->num_top_keys; ++i) {
+    fprintf(fp, "    %s: %" PRIu64 " rows\n", stats->top_keys[i].key,
+            stats->top_keys[i].num_rows);
+  }
+}
+
+void bamdb_free_stats(bamdb_index_stats_t *stats) {
+  for (size_t i = 0; i < stats->num_top_keys; ++i) {
+    free(stats->top_keys[i].key);
+  }
+  stats->num_top_keys = 0;
+}
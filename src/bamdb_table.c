@@ -0,0 +1,356 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bamdb_postings.h"
+#include "bamdb_status.h"
+#include "bamdb_table.h"
+
+#define TABLE_MAGIC "BAMDBST1"
+#define MAX_PATH_CHARS 2048
+
+typedef struct table_header {
+  char magic[8];
+  uint32_t flags;
+  uint32_t block_size;
+  uint64_t num_keys;
+  uint64_t num_blocks;
+  /* Entries end at data_end, the fence index starts at the next multiple of
+   * 8 so it can be read in place */
+  uint64_t data_end;
+  uint64_t fence_offset;
+} table_header_t;
+
+struct bamdb_table_writer {
+  FILE *fp;
+  char path[MAX_PATH_CHARS];
+  char tmp_path[MAX_PATH_CHARS];
+  table_header_t header;
+  /* Bytes written so far and where the last block starts */
+  uint64_t size;
+  uint64_t block_start;
+  uint64_t *fences;
+  size_t fence_capacity;
+  /* Encoded offsets of the entry being added */
+  unsigned char *postings;
+  size_t postings_capacity;
+};
+
+struct bamdb_table {
+  const table_header_t *header;
+  /* The whole mapping, entry positions count from its start */
+  const unsigned char *data;
+  const uint64_t *fences;
+  size_t mapped_size;
+};
+
+void bamdb_table_path(char *path, size_t path_size, const char *db_path,
+                      const char *index_name) {
+  snprintf(path, path_size, "%s/%s%s", db_path, index_name,
+           BAMDB_TABLE_SUFFIX);
+}
+
+int bamdb_table_compare(const void *a, size_t a_size, const void *b,
+                        size_t b_size) {
+  int diff = memcmp(a, b, a_size < b_size ? a_size : b_size);
+
+  if (diff != 0) {
+    return diff;
+  }
+
+  return (a_size > b_size) - (a_size < b_size);
+}
+
+bamdb_table_writer_t *bamdb_table_create(const char *path, uint32_t flags) {
+  bamdb_table_writer_t *writer = calloc(1, sizeof(bamdb_table_writer_t));
+
+  snprintf(writer->path, MAX_PATH_CHARS, "%s", path);
+  snprintf(writer->tmp_path, MAX_PATH_CHARS, "%s.tmp", path);
+  if ((writer->fp = fopen(writer->tmp_path, "wb")) == NULL) {
+    fprintf(stderr, "Unable to write %s\n", writer->tmp_path);
+    free(writer);
+    return NULL;
+  }
+
+  memcpy(writer->header.magic, TABLE_MAGIC, sizeof(writer->header.magic));
+  writer->header.flags = flags;
+  writer->header.block_size = BAMDB_TABLE_BLOCK_SIZE;
+
+  /* The header is written again once the table is complete */
+  if (fwrite(&writer->header, sizeof(table_header_t), 1, writer->fp) != 1) {
+    fprintf(stderr, "Unable to write %s\n", writer->tmp_path);
+    bamdb_table_discard(writer);
+    return NULL;
+  }
+  writer->size = sizeof(table_header_t);
+
+  return writer;
+}
+
+int bamdb_table_add(bamdb_table_writer_t *writer, const void *key,
+                    size_t key_size, const int64_t *offsets,
+                    size_t num_offsets) {
+  unsigned char key_prefix[BAMDB_MAX_VARINT_SIZE];
+  unsigned char counts[2 * BAMDB_MAX_VARINT_SIZE];
+  size_t key_prefix_size, counts_size;
+  size_t postings_size = 0;
+
+  if (num_offsets * BAMDB_MAX_VARINT_SIZE > writer->postings_capacity) {
+    writer->postings_capacity = num_offsets * BAMDB_MAX_VARINT_SIZE * 2;
+    writer->postings = realloc(writer->postings, writer->postings_capacity);
+  }
+  for (size_t i = 0; i < num_offsets; ++i) {
+    postings_size += bamdb_encode_varint(
+        (uint64_t)(i == 0 ? offsets[0] : offsets[i] - offsets[i - 1]),
+        writer->postings + postings_size);
+  }
+
+  key_prefix_size = bamdb_encode_varint(key_size, key_prefix);
+  counts_size = bamdb_encode_varint(num_offsets, counts);
+  counts_size += bamdb_encode_varint(postings_size, counts + counts_size);
+
+  /* Entries never straddle blocks, a block ends after the entry that takes
+   * it past the block size */
+  if (writer->header.num_blocks == 0 ||
+      writer->size - writer->block_start >= BAMDB_TABLE_BLOCK_SIZE) {
+    if (writer->header.num_blocks == writer->fence_capacity) {
+      writer->fence_capacity =
+          writer->fence_capacity > 0 ? writer->fence_capacity * 2 : 256;
+      writer->fences =
+          realloc(writer->fences, writer->fence_capacity * sizeof(uint64_t));
+    }
+    writer->fences[writer->header.num_blocks++] = writer->size;
+    writer->block_start = writer->size;
+  }
+
+  if (fwrite(key_prefix, 1, key_prefix_size, writer->fp) != key_prefix_size ||
+      fwrite(key, 1, key_size, writer->fp) != key_size ||
+      fwrite(counts, 1, counts_size, writer->fp) != counts_size ||
+      fwrite(writer->postings, 1, postings_size, writer->fp) !=
+          postings_size) {
+    fprintf(stderr, "Unable to write %s\n", writer->tmp_path);
+    return BAMDB_DB_ERROR;
+  }
+
+  writer->size += key_prefix_size + key_size + counts_size + postings_size;
+  writer->header.num_keys++;
+  return BAMDB_SUCCESS;
+}
+
+static void free_writer(bamdb_table_writer_t *writer) {
+  free(writer->fences);
+  free(writer->postings);
+  free(writer);
+}
+
+int bamdb_table_finish(bamdb_table_writer_t *writer) {
+  static const unsigned char padding[sizeof(uint64_t)] = {0};
+  size_t padding_size =
+      (sizeof(uint64_t) - writer->size % sizeof(uint64_t)) % sizeof(uint64_t);
+  int rc;
+
+  writer->header.data_end = writer->size;
+  writer->header.fence_offset = writer->size + padding_size;
+
+  rc = fwrite(padding, 1, padding_size, writer->fp) == padding_size &&
+               fwrite(writer->fences, sizeof(uint64_t),
+                      writer->header.num_blocks,
+                      writer->fp) == writer->header.num_blocks &&
+               fseek(writer->fp, 0, SEEK_SET) == 0 &&
+               fwrite(&writer->header, sizeof(table_header_t), 1,
+                      writer->fp) == 1
+           ? 0
+           : -1;
+  if (fclose(writer->fp) != 0 || rc != 0 ||
+      rename(writer->tmp_path, writer->path) != 0) {
+    fprintf(stderr, "Unable to write %s\n", writer->path);
+    remove(writer->tmp_path);
+    free_writer(writer);
+    return BAMDB_DB_ERROR;
+  }
+
+  free_writer(writer);
+  return BAMDB_SUCCESS;
+}
+
+void bamdb_table_discard(bamdb_table_writer_t *writer) {
+  if (writer == NULL) {
+    return;
+  }
+
+  fclose(writer->fp);
+  remove(writer->tmp_path);
+  free_writer(writer);
+}
+
+bamdb_table_t *bamdb_table_open(const char *path) {
+  bamdb_table_t *table;
+  table_header_t *header;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    /* Indices built with LMDB have no table */
+    if (errno != ENOENT) {
+      fprintf(stderr, "Unable to open %s\n", path);
+    }
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(table_header_t)) {
+    fprintf(stderr, "%s is not a valid table\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %s\n", path);
+    return NULL;
+  }
+
+  header = map;
+  if (memcmp(header->magic, TABLE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->data_end < sizeof(table_header_t) ||
+      header->fence_offset < header->data_end ||
+      header->fence_offset % sizeof(uint64_t) != 0 ||
+      (header->num_blocks == 0) != (header->num_keys == 0) ||
+      (uint64_t)st.st_size !=
+          header->fence_offset + header->num_blocks * sizeof(uint64_t)) {
+    fprintf(stderr, "%s is not a valid table\n", path);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  table = calloc(1, sizeof(bamdb_table_t));
+  table->header = header;
+  table->data = map;
+  table->fences = (const uint64_t *)(table->data + header->fence_offset);
+  table->mapped_size = st.st_size;
+
+  return table;
+}
+
+void bamdb_table_close(bamdb_table_t *table) {
+  if (table == NULL) {
+    return;
+  }
+
+  munmap((void *)table->data, table->mapped_size);
+  free(table);
+}
+
+uint32_t bamdb_table_flags(const bamdb_table_t *table) {
+  return table->header->flags;
+}
+
+uint64_t bamdb_table_num_keys(const bamdb_table_t *table) {
+  return table->header->num_keys;
+}
+
+/* Parse the entry at pos, false past the last entry or if it is malformed */
+static bool read_entry(const bamdb_table_t *table, uint64_t pos,
+                       bamdb_table_entry_t *entry) {
+  const unsigned char *in = table->data + pos;
+  const unsigned char *end = table->data + table->header->data_end;
+  uint64_t key_size, postings_size;
+  size_t n;
+
+  if (pos < sizeof(table_header_t) || pos >= table->header->data_end) {
+    return false;
+  }
+
+  if ((n = bamdb_decode_varint(in, end, &key_size)) == 0 ||
+      key_size > (uint64_t)(end - in - n)) {
+    return false;
+  }
+  in += n;
+  entry->key = in;
+  entry->key_size = key_size;
+  in += key_size;
+
+  if ((n = bamdb_decode_varint(in, end, &entry->num_offsets)) == 0) {
+    return false;
+  }
+  in += n;
+  if ((n = bamdb_decode_varint(in, end, &postings_size)) == 0 ||
+      postings_size > (uint64_t)(end - in - n)) {
+    return false;
+  }
+  in += n;
+  entry->postings = in;
+  entry->postings_size = postings_size;
+  entry->next = in + postings_size - table->data;
+
+  return true;
+}
+
+bool bamdb_table_seek(const bamdb_table_t *table, const void *key,
+                      size_t key_size, bamdb_table_entry_t *entry) {
+  size_t lo = 0;
+  size_t hi = table->header->num_blocks;
+  size_t mid;
+
+  if (hi == 0) {
+    return false;
+  }
+
+  /* Find the last block starting at or below key, or the first block if
+   * every key is above it */
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (!read_entry(table, table->fences[mid], entry)) {
+      return false;
+    }
+    if (bamdb_table_compare(entry->key, entry->key_size, key, key_size) <= 0) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (!read_entry(table, table->fences[lo], entry)) {
+    return false;
+  }
+  while (bamdb_table_compare(entry->key, entry->key_size, key, key_size) < 0) {
+    if (!bamdb_table_next(table, entry)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool bamdb_table_first(const bamdb_table_t *table,
+                       bamdb_table_entry_t *entry) {
+  return read_entry(table, sizeof(table_header_t), entry);
+}
+
+bool bamdb_table_next(const bamdb_table_t *table, bamdb_table_entry_t *entry) {
+  return read_entry(table, entry->next, entry);
+}
+
+size_t bamdb_table_decode(const bamdb_table_entry_t *entry, int64_t *offsets) {
+  const unsigned char *in = entry->postings;
+  const unsigned char *end = in + entry->postings_size;
+  uint64_t value;
+  uint64_t offset = 0;
+  size_t n;
+
+  for (uint64_t i = 0; i < entry->num_offsets; ++i) {
+    if ((n = bamdb_decode_varint(in, end, &value)) == 0) {
+      return 0;
+    }
+    in += n;
+    offset = i == 0 ? value : offset + value;
+    offsets[i] = (int64_t)offset;
+  }
+
+  return entry->num_offsets;
+}